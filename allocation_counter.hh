@@ -0,0 +1,16 @@
+
+#pragma once
+
+#include <cstdint>
+
+// Heap allocation counter
+// replaces the global operator new and delete with malloc based versions
+// that count the allocations of the program, so a benchmark or a test can
+// check that a kernel or a step of the time loop does not allocate once its
+// workspace buffers have grown; include in one translation unit of a
+// program only (grav_bench, the allocation test)
+
+// allocations since the start of the program
+uint64_t allocation_count();
+
+#include "allocation_counter_impl.hh"
@@ -0,0 +1,42 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "allocation_counter.hh"
+
+namespace {
+static std::atomic<uint64_t> allocations{0};
+}
+
+uint64_t allocation_count() { return allocations.load(); }
+
+// the replacements are not inlined into their callers, where GCC would
+// match the free() of operator delete against the operator new of the call
+[[gnu::noinline]] void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void *operator new(std::size_t size, std::align_val_t align) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  const std::size_t a = static_cast<std::size_t>(align);
+  if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a))
+    return p;
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+[[gnu::noinline]] void operator delete(void *p, std::align_val_t) noexcept {
+  std::free(p);
+}
+[[gnu::noinline]] void operator delete(void *p, std::size_t,
+                                       std::align_val_t) noexcept {
+  std::free(p);
+}
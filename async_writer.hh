@@ -0,0 +1,49 @@
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "system.hh"
+
+// Background snapshot writer
+// submit() copies the particle state into one of queue_depth staging
+// systems and returns, a dedicated thread writes the staged snapshots in
+// order; submit() blocks while all staging systems are in flight
+template <class SystemT> class AsyncWriter {
+public:
+  using T = typename SystemT::T;
+
+  AsyncWriter(const SystemT &system, int queue_depth);
+  ~AsyncWriter();
+  AsyncWriter(const AsyncWriter &) = delete;
+  AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+  // stage system and queue it for write_output(filenum, step, time, ...)
+  void submit(int filenum, int step, double time, const SystemT &system);
+  // wait until all queued snapshots are written
+  void flush();
+
+private:
+  struct Slot {
+    SystemT system;
+    int filenum{0};
+    int step{0};
+    double time{0.0};
+  };
+
+  void run();
+
+  std::vector<Slot> slots;
+  std::deque<int> free_slots;
+  std::deque<int> pending;
+  int busy{0}; // slots taken by the writer thread
+  bool stop{false};
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::thread worker;
+};
+
+#include "async_writer_impl.hh"
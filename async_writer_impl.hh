@@ -0,0 +1,112 @@
+
+#pragma once
+
+#include <algorithm>
+#include <execution>
+#include "async_writer.hh"
+
+namespace {
+// copy the state written to snapshots, reuses the capacity of dst
+template <class vecT>
+void stage_particles(System<vecT> &dst, const System<vecT> &src) {
+  dst.sysPos.resize(src.sysPos.size());
+  dst.sysVel.resize(src.sysVel.size());
+  dst.sysMss.resize(src.sysMss.size());
+  std::copy(std::execution::par_unseq, src.sysPos.begin(), src.sysPos.end(), dst.sysPos.begin());
+  std::copy(std::execution::par_unseq, src.sysVel.begin(), src.sysVel.end(), dst.sysVel.begin());
+  std::copy(std::execution::par_unseq, src.sysMss.begin(), src.sysMss.end(), dst.sysMss.begin());
+  dst.sysId.resize(src.sysId.size());
+  std::copy(std::execution::par_unseq, src.sysId.begin(), src.sysId.end(), dst.sysId.begin());
+  dst.num_bodies = src.num_bodies;
+  dst.output = src.output;
+  dst.output_prefix = src.output_prefix;
+}
+
+template <class vecT>
+void stage_particles(SystemSoA<vecT> &dst, const SystemSoA<vecT> &src) {
+  dst.sysPos.resize(src.sysPos.size());
+  dst.sysVel.resize(src.sysVel.size());
+  dst.sysMss.resize(src.sysMss.size());
+  for (auto [d, s] : {std::make_pair(&dst.sysPos, &src.sysPos),
+                      std::make_pair(&dst.sysVel, &src.sysVel)}) {
+    std::copy(std::execution::par_unseq, s->x.begin(), s->x.end(), d->x.begin());
+    std::copy(std::execution::par_unseq, s->y.begin(), s->y.end(), d->y.begin());
+    std::copy(std::execution::par_unseq, s->z.begin(), s->z.end(), d->z.begin());
+  }
+  std::copy(std::execution::par_unseq, src.sysMss.begin(), src.sysMss.end(), dst.sysMss.begin());
+  dst.num_bodies = src.num_bodies;
+  dst.output = src.output;
+  dst.output_prefix = src.output_prefix;
+}
+}
+
+template <class SystemT>
+AsyncWriter<SystemT>::AsyncWriter(const SystemT &system, int queue_depth)
+    : slots(std::max(queue_depth, 1)) {
+  // allocate staging buffers up front
+  for (size_t s = 0; s < slots.size(); s++) {
+    stage_particles(slots[s].system, system);
+    free_slots.push_back(s);
+  }
+  worker = std::thread([this]() { run(); });
+}
+
+template <class SystemT> AsyncWriter<SystemT>::~AsyncWriter() {
+  flush();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cond.notify_all();
+  worker.join();
+}
+
+template <class SystemT>
+void AsyncWriter<SystemT>::submit(int filenum, int step, double time,
+                                  const SystemT &system) {
+  int s;
+  {
+    // backpressure: wait for a free staging system
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this]() { return !free_slots.empty(); });
+    s = free_slots.front();
+    free_slots.pop_front();
+  }
+  stage_particles(slots[s].system, system);
+  slots[s].filenum = filenum;
+  slots[s].step = step;
+  slots[s].time = time;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.push_back(s);
+  }
+  cond.notify_all();
+}
+
+template <class SystemT> void AsyncWriter<SystemT>::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [this]() { return pending.empty() && busy == 0; });
+}
+
+template <class SystemT> void AsyncWriter<SystemT>::run() {
+  while (true) {
+    int s;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [this]() { return stop || !pending.empty(); });
+      if (pending.empty())
+        return;
+      s = pending.front();
+      pending.pop_front();
+      busy++;
+    }
+    Slot &slot = slots[s];
+    write_output(slot.filenum, slot.step, slot.time, slot.system);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busy--;
+      free_slots.push_back(s);
+    }
+    cond.notify_all();
+  }
+}
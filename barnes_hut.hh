@@ -0,0 +1,58 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "physics.hh"
+#include "reorder.hh"
+#include "system.hh"
+
+// Barnes-Hut octree node
+// particles of a node are the contiguous range [begin, end) of the
+// Morton-sorted particle arrays, children are the node range
+// [first_child, child_end), first_child < 0 marks a leaf
+template <class vecT> struct BHNode {
+  using T = typename vecT::value_type;
+  vecT com;       // center of mass
+  T mass{0.0};    // total mass
+  T size{0.0};    // cell edge length
+  int begin{0};
+  int end{0};
+  int parent{-1};
+  int first_child{-1};
+  int child_end{-1};
+};
+
+// Octree over Morton-sorted copies of the system positions and masses
+template <class vecT> struct BHTree {
+  using T = typename vecT::value_type;
+  std::vector<BHNode<vecT>> nodes;  // level order, root is nodes[0]
+  std::vector<int> level_start;     // first node of each level (+ end)
+  std::vector<uint64_t> keys;       // sorted Morton keys
+  std::vector<int> order;           // sorted slot -> particle index
+  std::vector<vecT> pos;            // sorted positions
+  std::vector<T> mss;               // sorted masses
+  // scratch of build_octree, kept so rebuilds reuse the capacity
+  RadixSortBuffers radix;
+  std::vector<int> node_id;
+  std::vector<int> flags;
+  std::vector<int> offsets;
+};
+
+// Build octree from system positions and masses
+template <class vecT>
+void build_octree(const System<vecT> &system, BHTree<vecT> &tree);
+
+// Calculate Barnes-Hut forces with opening angle theta
+// the tree is rebuilt in the system workspace
+template <class vecT, typename T>
+void accumulate_forces_bh(System<vecT> &system, std::vector<vecT> &accel,
+                          T theta, FusedKick<vecT> kick = {});
+
+// Calculate Barnes-Hut forces on the particles listed in active only,
+// the tree is still built over all particles
+template <class vecT, typename T>
+void accumulate_forces_bh(System<vecT> &system, std::vector<vecT> &accel,
+                          T theta, const std::vector<int> &active);
+
+#include "barnes_hut_impl.hh"
@@ -0,0 +1,273 @@
+
+#pragma once
+
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <vector>
+#include "barnes_hut.hh"
+#include "math_functions.hh"
+#include "physics.hh"
+#include "reorder.hh"
+
+namespace {
+// max particles per leaf
+static constexpr int bh_leaf_size = 16;
+// Morton keys hold 21 bits per dimension, one octree level per 3 bits
+static constexpr int bh_max_depth = curve_bits;
+// at most 7 siblings stay on the stack per level while descending
+static constexpr int bh_stack_size = 8 * (bh_max_depth + 1);
+
+// Morton key of prefix up to octree level l
+inline uint64_t key_prefix(uint64_t key, int l) {
+  return key >> (3 * (bh_max_depth - l));
+}
+}
+
+// Build octree from system positions and masses
+// 1. bounding cube and Morton key of every particle
+// 2. sort particles by key, so every octree cell is a contiguous range
+// 3. create the octree level by level: a child cell starts wherever the key
+//    prefix of that level changes inside a parent cell that is not a leaf
+// 4. reduce masses and centers of mass from the deepest level up
+template <class vecT>
+void build_octree(const System<vecT> &system, BHTree<vecT> &tree) {
+  using T = typename vecT::value_type;
+  using Node = BHNode<vecT>;
+  const int sys_size = system.sysPos.size();
+
+  // an empty system has an empty tree of zero levels
+  if (sys_size == 0) {
+    tree.nodes.clear();
+    tree.level_start.assign(1, 0);
+    tree.keys.clear();
+    tree.order.clear();
+    tree.pos.clear();
+    tree.mss.clear();
+    return;
+  }
+
+  // bounding cube, Morton keys and sort order
+  const CurveFrame<vecT> frame = curve_frame(system.sysPos);
+  const T size = frame.size;
+  curve_keys(system.sysPos, frame, SortCurve::morton, tree.keys);
+  radix_sort(tree.keys, tree.order, tree.radix);
+
+  const IndexRange sys_i = index_range(sys_size);
+
+  // sorted copies of positions and masses
+  tree.pos.resize(sys_size);
+  tree.mss.resize(sys_size);
+  {
+    vecT const *posptr = system.sysPos.data();
+    T const *mssptr = system.sysMss.data();
+    vecT *sposptr = tree.pos.data();
+    T *smssptr = tree.mss.data();
+    int const *ordptr = tree.order.data();
+    std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                  std::end(sys_i), [=](int i) {
+                    const int p = ordptr[i];
+                    sposptr[i] = posptr[p];
+                    smssptr[i] = mssptr[p];
+                  });
+  }
+
+  // root
+  tree.nodes.clear();
+  tree.level_start.clear();
+  {
+    Node root;
+    root.size = size;
+    root.begin = 0;
+    root.end = sys_size;
+    tree.nodes.push_back(root);
+    tree.level_start.push_back(0);
+    tree.level_start.push_back(1);
+  }
+
+  // parent cell of each sorted particle at the current level, -1 once the
+  // particle sits in a leaf
+  std::vector<int> &node_id = tree.node_id;
+  std::vector<int> &flags = tree.flags;
+  std::vector<int> &offsets = tree.offsets;
+  node_id.assign(sys_size, 0);
+  flags.resize(sys_size);
+  offsets.resize(sys_size);
+
+  for (int l = 1; l <= bh_max_depth; l++) {
+    const int base = tree.level_start[l];
+
+    // flag the first particle of every new child cell
+    {
+      uint64_t const *keyptr = tree.keys.data();
+      Node const *nodeptr = tree.nodes.data();
+      int const *nidptr = node_id.data();
+      std::transform(std::execution::par_unseq, std::begin(sys_i),
+                     std::end(sys_i), std::begin(flags), [=](int i) {
+                       const int n = nidptr[i];
+                       if (n < 0 || nodeptr[n].end - nodeptr[n].begin <= bh_leaf_size)
+                         return 0;
+                       if (i == nodeptr[n].begin)
+                         return 1;
+                       return int(key_prefix(keyptr[i], l) !=
+                                  key_prefix(keyptr[i - 1], l));
+                     });
+    }
+    std::exclusive_scan(std::execution::par_unseq, std::begin(flags),
+                        std::end(flags), std::begin(offsets), 0);
+    const int count = offsets[sys_size - 1] + flags[sys_size - 1];
+    if (count == 0)
+      break;
+
+    tree.nodes.resize(base + count);
+    tree.level_start.push_back(base + count);
+
+    // create child cells and move particles into them
+    {
+      Node *nodeptr = tree.nodes.data();
+      int const *fptr = flags.data();
+      int const *optr = offsets.data();
+      int *nidptr = node_id.data();
+      std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                    std::end(sys_i), [=](int i) {
+                      int &n = nidptr[i];
+                      if (n < 0)
+                        return;
+                      if (fptr[i]) {
+                        Node &child = nodeptr[base + optr[i]];
+                        child = Node();
+                        child.begin = i;
+                        child.parent = n;
+                        child.size = nodeptr[n].size / 2;
+                      }
+                      if (nodeptr[n].end - nodeptr[n].begin <= bh_leaf_size)
+                        n = -1;
+                      else
+                        n = base + optr[i] + fptr[i] - 1;
+                    });
+    }
+
+    // close child ranges and link children to their parents
+    {
+      Node *nodeptr = tree.nodes.data();
+      const int level_end = base + count;
+      std::for_each(std::execution::par_unseq, nodeptr + base,
+                    nodeptr + level_end, [=](Node &child) {
+                      const int c = &child - nodeptr;
+                      Node &parent = nodeptr[child.parent];
+                      const bool last = c + 1 == level_end ||
+                                        nodeptr[c + 1].parent != child.parent;
+                      child.end = last ? parent.end : nodeptr[c + 1].begin;
+                      if (c == base || nodeptr[c - 1].parent != child.parent)
+                        parent.first_child = c;
+                      if (last)
+                        parent.child_end = c + 1;
+                    });
+    }
+  }
+
+  // masses and centers of mass, deepest level first
+  for (int l = tree.level_start.size() - 2; l >= 0; l--) {
+    Node *nodeptr = tree.nodes.data();
+    vecT const *sposptr = tree.pos.data();
+    T const *smssptr = tree.mss.data();
+    std::for_each(std::execution::par_unseq, nodeptr + tree.level_start[l],
+                  nodeptr + tree.level_start[l + 1], [=](Node &node) {
+                    vecT com;
+                    T mass{0.0};
+                    if (node.first_child < 0) {
+                      for (int j = node.begin; j < node.end; j++) {
+                        com += sposptr[j] * smssptr[j];
+                        mass += smssptr[j];
+                      }
+                    } else {
+                      for (int c = node.first_child; c < node.child_end; c++) {
+                        com += nodeptr[c].com * nodeptr[c].mass;
+                        mass += nodeptr[c].mass;
+                      }
+                    }
+                    node.com = mass > 0 ? com / mass : com;
+                    node.mass = mass;
+                  });
+  }
+}
+
+namespace {
+// walk tree from the root for a particle at pos
+// a cell is accepted as a single body if size / distance < theta,
+// leaves that have to be opened are summed directly
+template <class vecT, typename T>
+inline vecT bh_walk(const BHNode<vecT> *nodeptr, const vecT *sposptr,
+                    const T *smssptr, const vecT &pos, T theta_sq) {
+  using Node = BHNode<vecT>;
+  vecT acc;
+  int stack[bh_stack_size];
+  int sp = 0;
+  stack[sp++] = 0;
+  while (sp > 0) {
+    const Node &node = nodeptr[stack[--sp]];
+    if (node.first_child < 0) {
+      for (int j = node.begin; j < node.end; j++)
+        acc += acceleration(pos, sposptr[j], smssptr[j]);
+      continue;
+    }
+    const vecT dist = node.com - pos;
+    if (node.size * node.size < theta_sq * dot_product(dist)) {
+      acc += acceleration(pos, node.com, node.mass);
+      continue;
+    }
+    for (int c = node.first_child; c < node.child_end; c++)
+      stack[sp++] = c;
+  }
+  return acc;
+}
+}
+
+// Calculate Barnes-Hut forces
+// use for_each over the sorted particles to parallelize the tree walk,
+// neighbouring threads walk similar paths through the tree
+template <class vecT, typename T>
+void accumulate_forces_bh(System<vecT> &system, std::vector<vecT> &accel,
+                          T theta, FusedKick<vecT> kick) {
+  using Node = BHNode<vecT>;
+  BHTree<vecT> &tree = system.workspace.tree;
+  build_octree(system, tree);
+
+  const T theta_sq = theta * theta;
+  Node const *nodeptr = tree.nodes.data();
+  vecT const *sposptr = tree.pos.data();
+  T const *smssptr = tree.mss.data();
+  int const *ordptr = tree.order.data();
+  vecT *accptr = accel.data();
+  vecT *velptr = kick.vel;
+  const float dt = kick.dt;
+  const IndexRange sys_i = index_range(system.sysPos.size());
+  std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                std::end(sys_i), [=](int i) {
+                  const vecT acc =
+                      bh_walk(nodeptr, sposptr, smssptr, sposptr[i], theta_sq);
+                  accptr[ordptr[i]] = acc;
+                  if (velptr)
+                    velptr[ordptr[i]] += acc * dt;
+                });
+}
+
+template <class vecT, typename T>
+void accumulate_forces_bh(System<vecT> &system, std::vector<vecT> &accel,
+                          T theta, const std::vector<int> &active) {
+  using Node = BHNode<vecT>;
+  BHTree<vecT> &tree = system.workspace.tree;
+  build_octree(system, tree);
+
+  const T theta_sq = theta * theta;
+  Node const *nodeptr = tree.nodes.data();
+  vecT const *sposptr = tree.pos.data();
+  T const *smssptr = tree.mss.data();
+  vecT const *posptr = system.sysPos.data();
+  vecT *accptr = accel.data();
+  std::for_each(std::execution::par_unseq, std::begin(active),
+                std::end(active), [=](int i) {
+                  accptr[i] =
+                      bh_walk(nodeptr, sposptr, smssptr, posptr[i], theta_sq);
+                });
+}
@@ -0,0 +1,556 @@
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "allocation_counter.hh"
+#include "diagnostics.hh"
+#include "ensemble.hh"
+#include "merging.hh"
+#include "numa.hh"
+#include "reorder.hh"
+#include "system.hh"
+#include "vec.hh"
+#if !defined(ENABLE_CUDA) && !defined(ENABLE_ACPP)
+#include <tbb/global_control.h>
+#endif
+
+// Kernel and scaling benchmarks
+// every benchmark runs for each N and thread count, interactions/s and
+// GFLOP/s (20 flops per pairwise interaction) are reported for the force
+// kernels and integrators, particles/s for the O(N) kernels; only the
+// interactions a run evaluates are counted, N^2 / 2 pairs of the symmetric
+// kernel, 3 passes of a Yoshida step, the active particles of a block step
+// results, strong and weak scaling efficiencies are written as JSON
+// heap allocations per run are counted as well, the kernels and the time
+// loop must not allocate once their workspace buffers have grown, the exit
+// status is 1 if one of them does
+// the memory bandwidth of every pair of cpu node and memory node is
+// measured first, the diagonal is the per-socket bandwidth
+
+template <typename T> using vecT = Vec3<T>;
+using BenchSystem = System<vecT<float>>;
+
+static constexpr double flops_per_interaction = 20.0;
+
+struct BenchOptions {
+  std::vector<int> sizes{1024, 4096, 16384};
+  std::vector<int> threads;
+  int weak_n{2048}; // particles per thread of the weak scaling runs
+  int reps{3};
+  std::vector<std::string> filter; // benchmark name prefixes, empty runs all
+  std::string out;                 // JSON file, empty writes to stdout
+  NumaMode numa{NumaMode::off};
+  ThreadPinning pin{ThreadPinning::none};
+  int bandwidth_mb{256}; // triad arrays per node pair, 0 skips the measurement
+};
+
+struct BandwidthResult {
+  int cpu_node;
+  int mem_node;
+  double gbytes_per_s;
+};
+
+struct BenchResult {
+  std::string name;
+  bool pairs; // work is interactions, otherwise N particles
+  int n;
+  int threads;
+  double seconds;
+  double interactions; // per run
+  double allocations; // heap allocations per run
+};
+
+struct Benchmark {
+  std::string name;
+  bool pairs;
+  std::function<void(BenchSystem &)> run;
+  bool allocation_free{true}; // steady state kernel, must not allocate
+  // interactions evaluated by the last run, N^2 if empty
+  std::function<double(const BenchSystem &)> interactions{};
+};
+
+double all_interactions(const BenchSystem &system) {
+  const double n = system.sysPos.size();
+  return n * n;
+}
+
+std::vector<int> parse_list(const std::string &value) {
+  std::vector<int> list;
+  std::stringstream ss(value);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    list.push_back(std::stoi(item));
+  return list;
+}
+
+// Parse --key=value options into options
+void parse_options(int argc, char *argv[], BenchOptions &options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg(argv[i]);
+    const auto eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      std::cerr << "WARNING: ignoring argument " << arg << "\n";
+      continue;
+    }
+    const std::string key = arg.substr(2, eq - 2);
+    const std::string value = arg.substr(eq + 1);
+    if (key == "n") {
+      options.sizes = parse_list(value);
+    } else if (key == "threads") {
+      options.threads = parse_list(value);
+    } else if (key == "weak-n") {
+      options.weak_n = std::stoi(value);
+    } else if (key == "reps") {
+      options.reps = std::max(1, std::stoi(value));
+    } else if (key == "filter") {
+      std::stringstream ss(value);
+      std::string item;
+      while (std::getline(ss, item, ','))
+        options.filter.push_back(item);
+    } else if (key == "out") {
+      options.out = value;
+    } else if (key == "numa") {
+      if (value == "off")
+        options.numa = NumaMode::off;
+      else if (value == "first-touch")
+        options.numa = NumaMode::first_touch;
+      else if (value == "replicate")
+        options.numa = NumaMode::replicate;
+      else
+        std::cerr << "WARNING: unknown NUMA mode " << value << "\n";
+    } else if (key == "pin") {
+      if (value == "none")
+        options.pin = ThreadPinning::none;
+      else if (value == "compact")
+        options.pin = ThreadPinning::compact;
+      else if (value == "scatter")
+        options.pin = ThreadPinning::scatter;
+      else
+        std::cerr << "WARNING: unknown thread pinning " << value << "\n";
+    } else if (key == "bandwidth-mb") {
+      options.bandwidth_mb = std::max(0, std::stoi(value));
+    } else {
+      std::cerr << "WARNING: unknown option " << arg << "\n";
+    }
+  }
+  if (options.threads.empty()) {
+    // 1, 2, 4, ... up to the hardware threads
+    const int hw = std::max(1u, std::thread::hardware_concurrency());
+    for (int t = 1; t < hw; t *= 2)
+      options.threads.push_back(t);
+    options.threads.push_back(hw);
+  }
+}
+
+bool selected(const BenchOptions &options, const std::string &name) {
+  if (options.filter.empty())
+    return true;
+  return std::any_of(std::begin(options.filter), std::end(options.filter),
+                     [&](const std::string &f) { return name.rfind(f, 0) == 0; });
+}
+
+// Benchmarks on a set up system, each run is one call of the kernel
+std::vector<Benchmark> make_benchmarks() {
+  using Engine = ForceEngine;
+  std::vector<Benchmark> list;
+  // tree and mesh engines do not evaluate all pairs, they report particles/s
+  auto forces = [&](const std::string &name, Engine engine,
+                    Precision precision = Precision::single) {
+    const bool pairs = all_pairs(engine);
+    list.push_back({"forces." + name, pairs, [=](BenchSystem &system) {
+                      system.engine = engine;
+                      system.precision = precision;
+                      compute_forces(system, system.sysAcc);
+                    }});
+  };
+  forces("direct", Engine::direct);
+  forces("tiled", Engine::tiled);
+  forces("simd", Engine::simd);
+  forces("symmetric", Engine::symmetric);
+  // each pair once
+  list.back().interactions = [](const BenchSystem &system) {
+    const double n = system.sysPos.size();
+    return n * (n - 1) / 2;
+  };
+  forces("mixed", Engine::direct, Precision::mixed);
+  forces("kahan", Engine::direct, Precision::kahan);
+  forces("bh", Engine::barnes_hut);
+  forces("fmm", Engine::fmm);
+  forces("pm", Engine::pm);
+  forces("p3m", Engine::p3m);
+  // direct kernel that also stores the potentials for the diagnostics
+  list.push_back({"forces.direct_potential", true, [](BenchSystem &system) {
+                    system.engine = Engine::direct;
+                    system.precision = Precision::single;
+                    system.want_potential = true;
+                    compute_forces(system, system.sysAcc);
+                    system.want_potential = false;
+                    system.has_potential = false;
+                  }});
+  // reductions at the output cadence, after a force pass that stored the
+  // potentials
+  list.push_back({"diagnostics", false, [](BenchSystem &system) {
+                    system.has_potential = true;
+                    system.workspace.output.potential.resize(system.sysPos.size());
+                    measure_diagnostics(system);
+                  }});
+
+  list.push_back({"reorder.morton", false, [](BenchSystem &system) {
+                    reorder_particles(system, SortCurve::morton);
+                  }});
+  list.push_back({"reorder.hilbert", false, [](BenchSystem &system) {
+                    reorder_particles(system, SortCurve::hilbert);
+                  }});
+  // close pair search of the merging, a tenth of the mean separation in the
+  // bounding cube as capture radius; the merge itself would shrink the system
+  list.push_back({"merge.search", false, [](BenchSystem &system) {
+                    const float radius =
+                        0.1f * curve_frame(system.sysPos).size /
+                        std::cbrt(float(system.sysPos.size()));
+                    find_close_pairs(system, radius);
+                  }});
+
+  // adaptive step criteria, one reduction over the particles each step
+  list.push_back({"timestep.acceleration", false, [](BenchSystem &system) {
+                    system.timestep_control = TimestepControl::acceleration;
+                    criterion_timestep(system);
+                    system.timestep_control = TimestepControl::fixed;
+                  }});
+  list.push_back({"timestep.aarseth", false, [](BenchSystem &system) {
+                    system.timestep_control = TimestepControl::aarseth;
+                    system.sysJerk.resize(system.sysAcc.size());
+                    system.jerk_step = system.step;
+                    criterion_timestep(system);
+                    system.timestep_control = TimestepControl::fixed;
+                  }});
+
+  list.push_back({"update_velocities", false, [](BenchSystem &system) {
+                    update_velocities(system, system.timestep);
+                  }});
+  list.push_back({"update_positions", false, [](BenchSystem &system) {
+                    update_positions(system, system.timestep);
+                  }});
+
+  // integrators use the direct engine
+  auto integrator = [&](const std::string &name,
+                        std::function<void(BenchSystem &)> step,
+                        std::function<double(const BenchSystem &)> interactions = {}) {
+    list.push_back({"integrate." + name, true,
+                    [=](BenchSystem &system) {
+                      system.engine = Engine::direct;
+                      system.precision = Precision::single;
+                      step(system);
+                    },
+                    true, interactions});
+  };
+  integrator("euler", [](BenchSystem &system) { integrate_euler(system); });
+  integrator("verlet3", [](BenchSystem &system) { integrate_verlet3(system); });
+  integrator("verlet4", [](BenchSystem &system) { integrate_verlet4(system); });
+  integrator("fused", [](BenchSystem &system) { integrate_fused(system); });
+  // the force targets of the last step, all particles against the active
+  auto block_targets = std::make_shared<uint64_t>(0);
+  integrator(
+      "block",
+      [=](BenchSystem &system) { *block_targets = integrate_block(system); },
+      [=](const BenchSystem &system) {
+        return double(*block_targets) * system.sysPos.size();
+      });
+  // count the steps like the time loop, so that the runs after the warm up
+  // reuse the jerks and Acc(t) of the previous step
+  integrator("hermite", [](BenchSystem &system) {
+    integrate_hermite(system);
+    ++system.step;
+  });
+  // three force passes per step
+  integrator(
+      "yoshida",
+      [](BenchSystem &system) {
+        integrate_yoshida(system);
+        ++system.step;
+      },
+      [](const BenchSystem &system) { return 3 * all_interactions(system); });
+
+  // 16 members of n/4 particles, the interactions of one system of n
+  // the ensemble is set up again by the warm up run when n changes
+  auto ensemble = std::make_shared<Ensemble<vecT<float>>>();
+  list.push_back({"integrate.ensemble", true, [=](BenchSystem &system) {
+                    const int member_n = system.num_bodies / 4;
+                    if (ensemble->members.empty() ||
+                        ensemble->members[0].num_bodies != member_n) {
+                      std::vector<Config> configs(16);
+                      for (size_t k = 0; k < configs.size(); k++) {
+                        configs[k].nbodies = member_n;
+                        configs[k].timestep = system.timestep;
+                        configs[k].end_time = system.end_time;
+                        configs[k].seed = k + 1;
+                      }
+                      ensemble->setup(configs);
+                    }
+                    integrate_ensemble(*ensemble);
+                  }});
+
+  // one step of the time loop without output
+  list.push_back({"advance", true, [](BenchSystem &system) {
+                    system.engine = Engine::direct;
+                    system.precision = Precision::single;
+                    system.timestep_control = TimestepControl::fixed;
+                    system.output = OutputFormat::none;
+                    system.end_time = system.elapsed_time + system.timestep / 2;
+                    advance_system(system);
+                  }});
+
+  list.push_back({"setup", false, [](BenchSystem &system) {
+                    Config config;
+                    config.nbodies = system.num_bodies;
+                    config.timestep = system.timestep;
+                    config.end_time = system.end_time;
+                    BenchSystem fresh;
+                    fresh.setup(config);
+                  }, false});
+  // file streams and names allocate
+  list.push_back({"write_points", false, [](BenchSystem &system) {
+                    write_points(0, system);
+                    std::remove("velocity_magnitude.0.3D");
+                  }, false});
+  list.push_back({"write_snapshot", false, [](BenchSystem &system) {
+                    write_snapshot("snapshot.bench.bin", 0, system.elapsed_time,
+                                   system);
+                    std::remove("snapshot.bench.bin");
+                  }, false});
+  return list;
+}
+
+struct BenchTiming {
+  double seconds;      // fastest run
+  double interactions; // of the fastest run
+  double allocations;  // mean per run
+};
+
+// fastest of reps runs after one warm up run, which also grows the
+// workspace buffers, and the mean allocations of the timed runs
+BenchTiming time_benchmark(const Benchmark &bench, BenchSystem &system, int reps) {
+  bench.run(system);
+  BenchTiming timing{std::numeric_limits<double>::max(), 0, 0};
+  const uint64_t allocations = allocation_count();
+  for (int r = 0; r < reps; r++) {
+    const auto start = std::chrono::steady_clock::now();
+    bench.run(system);
+    const auto stop = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(stop - start).count();
+    if (seconds < timing.seconds) {
+      timing.seconds = seconds;
+      timing.interactions = bench.interactions ? bench.interactions(system)
+                                               : all_interactions(system);
+    }
+  }
+  timing.allocations = double(allocation_count() - allocations) / reps;
+  return timing;
+}
+
+// run all selected benchmarks for n particles on threads threads
+void run_benchmarks(const BenchOptions &options,
+                    const std::vector<Benchmark> &benchmarks, int n,
+                    int threads, std::vector<BenchResult> &results,
+                    int &allocation_errors) {
+#if !defined(ENABLE_CUDA) && !defined(ENABLE_ACPP)
+  tbb::global_control limit(tbb::global_control::max_allowed_parallelism,
+                            threads);
+#endif
+  Config config;
+  config.nbodies = n;
+  config.timestep = 1.0f;
+  config.end_time = 1.0f;
+  config.numa = options.numa;
+  BenchSystem system;
+  system.setup(config);
+  tune_tile_sizes(system);
+
+  for (const Benchmark &bench : benchmarks) {
+    if (!selected(options, bench.name))
+      continue;
+    const auto [seconds, interactions, allocations] =
+        time_benchmark(bench, system, options.reps);
+    std::cerr << bench.name << " n=" << n << " threads=" << threads << ": "
+              << seconds * 1e3 << " ms\n";
+    if (bench.allocation_free && allocations > 0) {
+      std::cerr << "ERROR: " << bench.name << " n=" << n << " made "
+                << allocations << " heap allocations per run\n";
+      allocation_errors++;
+    }
+    results.push_back(
+        {bench.name, bench.pairs, n, threads, seconds, interactions, allocations});
+  }
+}
+
+// STREAM triad a = b + s c on arrays bound to mem_node, one thread pinned
+// to each cpu of cpu_node, best of reps, 3 arrays of traffic per sweep
+double triad_bandwidth(int cpu_node, int mem_node, std::size_t bytes, int reps) {
+  const std::vector<int> &cpus = numa_topology().node_cpus[cpu_node];
+  const std::size_t n = bytes / (3 * sizeof(double));
+  std::vector<double> a, b, c;
+  for (std::vector<double> *array : {&a, &b, &c}) {
+    array->reserve(n);
+    numa_bind(array->data(), n * sizeof(double), mem_node);
+  }
+  a.resize(n);
+  b.assign(n, 1.0);
+  c.assign(n, 2.0);
+
+  const int num_threads = cpus.size();
+  double best = std::numeric_limits<double>::max();
+  for (int r = 0; r < reps; r++) {
+    std::vector<std::thread> threads;
+    std::atomic<int> ready{0};
+    std::chrono::steady_clock::time_point start;
+    for (int t = 0; t < num_threads; t++)
+      threads.emplace_back([&, t] {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[t], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+        const std::size_t first = n * t / num_threads;
+        const std::size_t last = n * (t + 1) / num_threads;
+        // start together once all threads are pinned
+        if (ready.fetch_add(1) + 1 == num_threads)
+          start = std::chrono::steady_clock::now();
+        while (ready.load() < num_threads) {
+        }
+        for (std::size_t i = first; i < last; i++)
+          a[i] = b[i] + 3.0 * c[i];
+      });
+    for (std::thread &thread : threads)
+      thread.join();
+    const auto stop = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(stop - start).count());
+  }
+  return 3.0 * n * sizeof(double) / best * 1e-9;
+}
+
+std::vector<BandwidthResult> measure_bandwidth(const BenchOptions &options) {
+  std::vector<BandwidthResult> results;
+  if (options.bandwidth_mb == 0)
+    return results;
+  const NumaTopology &topology = numa_topology();
+  const std::size_t bytes = std::size_t(options.bandwidth_mb) << 20;
+  for (int cpu_node = 0; cpu_node < topology.num_nodes(); cpu_node++)
+    for (int mem_node = 0; mem_node < topology.num_nodes(); mem_node++) {
+      if (topology.node_cpus[cpu_node].empty())
+        continue;
+      const double gbytes_per_s =
+          triad_bandwidth(cpu_node, mem_node, bytes, options.reps);
+      std::cerr << "bandwidth cpu_node=" << cpu_node << " mem_node=" << mem_node
+                << ": " << gbytes_per_s << " GB/s\n";
+      results.push_back({cpu_node, mem_node, gbytes_per_s});
+    }
+  return results;
+}
+
+// work units per second, interactions or particles
+double rate(const BenchResult &result) {
+  return (result.pairs ? result.interactions : result.n) / result.seconds;
+}
+
+// result of the same benchmark and size on the fewest threads
+const BenchResult &baseline(const std::vector<BenchResult> &results,
+                            const BenchResult &result, bool same_n) {
+  const BenchResult *best = &result;
+  for (const BenchResult &r : results)
+    if (r.name == result.name && (!same_n || r.n == result.n) &&
+        r.threads < best->threads)
+      best = &r;
+  return *best;
+}
+
+void write_result(std::ostream &out, const BenchResult &result) {
+  out << "\"benchmark\": \"" << result.name << "\", \"n\": " << result.n
+      << ", \"threads\": " << result.threads
+      << ", \"seconds\": " << result.seconds
+      << ", \"allocations\": " << result.allocations;
+  if (result.pairs)
+    out << ", \"interactions_per_s\": " << rate(result)
+        << ", \"gflops\": " << rate(result) * flops_per_interaction * 1e-9;
+  else
+    out << ", \"particles_per_s\": " << rate(result);
+}
+
+// strong scaling: same n, efficiency = t0 T(t0) / (t T(t))
+// weak scaling: n proportional to threads, efficiency = rate(t) t0 / (rate(t0) t)
+void write_json(std::ostream &out, const BenchOptions &options,
+                const std::vector<BandwidthResult> &bandwidth,
+                const std::vector<BenchResult> &strong,
+                const std::vector<BenchResult> &weak) {
+  out << std::setprecision(6);
+  out << "{\n";
+  out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+  out << "  \"numa_nodes\": " << numa_topology().num_nodes() << ",\n";
+  out << "  \"numa_bandwidth\": [";
+  for (size_t i = 0; i < bandwidth.size(); i++)
+    out << (i ? ",\n" : "\n") << "    {\"cpu_node\": " << bandwidth[i].cpu_node
+        << ", \"mem_node\": " << bandwidth[i].mem_node
+        << ", \"gbytes_per_s\": " << bandwidth[i].gbytes_per_s << "}";
+  out << "\n  ],\n";
+  out << "  \"flops_per_interaction\": " << flops_per_interaction << ",\n";
+  out << "  \"weak_n_per_thread\": " << options.weak_n << ",\n";
+  out << "  \"strong_scaling\": [";
+  for (size_t i = 0; i < strong.size(); i++) {
+    const BenchResult &base = baseline(strong, strong[i], true);
+    const double efficiency = base.seconds * base.threads /
+                              (strong[i].seconds * strong[i].threads);
+    out << (i ? ",\n" : "\n") << "    {";
+    write_result(out, strong[i]);
+    out << ", \"efficiency\": " << efficiency << "}";
+  }
+  out << "\n  ],\n";
+  out << "  \"weak_scaling\": [";
+  for (size_t i = 0; i < weak.size(); i++) {
+    const BenchResult &base = baseline(weak, weak[i], false);
+    const double efficiency =
+        rate(weak[i]) * base.threads / (rate(base) * weak[i].threads);
+    out << (i ? ",\n" : "\n") << "    {";
+    write_result(out, weak[i]);
+    out << ", \"efficiency\": " << efficiency << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options;
+  parse_options(argc, argv, options);
+  const std::vector<Benchmark> benchmarks = make_benchmarks();
+
+  // messages of the kernels go to stderr, stdout only gets the JSON
+  std::streambuf *stdout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+  const std::vector<BandwidthResult> bandwidth = measure_bandwidth(options);
+  ThreadPinner pinner(options.pin);
+  std::vector<BenchResult> strong, weak;
+  int allocation_errors = 0;
+  for (int n : options.sizes)
+    for (int threads : options.threads)
+      run_benchmarks(options, benchmarks, n, threads, strong, allocation_errors);
+  for (int threads : options.threads)
+    run_benchmarks(options, benchmarks, options.weak_n * threads, threads, weak,
+                   allocation_errors);
+  std::cout.rdbuf(stdout_buf);
+
+  if (options.out.empty()) {
+    write_json(std::cout, options, bandwidth, strong, weak);
+  } else {
+    std::ofstream outfile(options.out);
+    write_json(outfile, options, bandwidth, strong, weak);
+  }
+  return allocation_errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,52 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "system.hh"
+
+// Checkpoint file, the complete state needed to continue a run
+// 128 byte header followed by raw arrays in native byte order:
+//   positions     N x 3 values (x, y, z)
+//   velocities    N x 3 values
+//   accelerations N x 3 values, the integrators reuse them in the next step
+//   masses        N values
+//   particle ids  num_ids int32 values, original index of each particle of
+//                 a reordered system (see reorder.hh), absent otherwise
+//   jerks         num_jerks x 3 values, the Hermite integrator reuses them
+//                 in the next step, absent otherwise
+//   RNG state     rng_size bytes, text form of the generator in utils.hh
+// AoS and SoA systems write the same format, either can restart from it
+struct CheckpointHeader {
+  char magic[8];        // "NBODYCKP"
+  uint32_t version;
+  uint32_t value_size;  // sizeof(T)
+  uint64_t num_bodies;
+  uint64_t step;        // completed time steps
+  uint64_t filenum;     // next snapshot number
+  double elapsed_time;
+  double timestep;      // current step
+  double end_time;
+  uint64_t rng_size;
+  uint64_t num_ids;     // 0 or num_bodies
+  uint64_t num_jerks;   // 0 or num_bodies
+  double max_timestep;  // adaptive step bound, 0 in older files
+  double output_interval; // 0 for 20 steps of max_timestep
+  uint64_t reserved[3];
+};
+static_assert(sizeof(CheckpointHeader) == 128);
+
+// write checkpoint of system, the file is replaced atomically so that a
+// crash during the write leaves the previous checkpoint intact
+template <class vecT>
+void write_checkpoint(const std::string &filename, System<vecT> &system);
+template <class vecT>
+void write_checkpoint(const std::string &filename, SystemSoA<vecT> &system);
+
+// restore particles and time stepping state of system from checkpoint
+template <class vecT>
+void read_checkpoint(const std::string &filename, System<vecT> &system);
+template <class vecT>
+void read_checkpoint(const std::string &filename, SystemSoA<vecT> &system);
+
+#include "checkpoint_impl.hh"
@@ -0,0 +1,275 @@
+
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checkpoint.hh"
+#include "instrumentation.hh"
+#include "utils.hh"
+
+namespace {
+static constexpr char checkpoint_magic[8] = {'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P'};
+static constexpr uint32_t checkpoint_version = 1;
+
+template <typename T, class SystemT>
+CheckpointHeader make_checkpoint_header(const SystemT &system, uint64_t num_bodies,
+                                        uint64_t num_ids, uint64_t num_jerks,
+                                        const std::string &rng_state) {
+  CheckpointHeader header{};
+  std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+  header.version = checkpoint_version;
+  header.value_size = sizeof(T);
+  header.num_bodies = num_bodies;
+  header.step = system.step;
+  header.filenum = system.filenum;
+  header.elapsed_time = system.elapsed_time;
+  header.timestep = system.timestep;
+  header.max_timestep = system.max_timestep;
+  header.output_interval = system.output_interval;
+  header.end_time = system.end_time;
+  header.rng_size = rng_state.size();
+  header.num_ids = num_ids;
+  header.num_jerks = num_jerks;
+  return header;
+}
+
+// write buffer to fd, retrying short writes
+inline bool write_all(int fd, const void *data, std::size_t length) {
+  const char *ptr = static_cast<const char *>(data);
+  while (length > 0) {
+    const ssize_t n = ::write(fd, ptr, length);
+    if (n < 0)
+      return false;
+    ptr += n;
+    length -= n;
+  }
+  return true;
+}
+
+// write header and arrays to filename.tmp, sync it to disk and rename it
+// over filename, rename is atomic on POSIX file systems
+template <typename T>
+void write_checkpoint_file(const std::string &filename,
+                           const CheckpointHeader &header,
+                           const std::vector<T> &pos, const std::vector<T> &vel,
+                           const std::vector<T> &acc, const std::vector<T> &mss,
+                           const std::vector<int> &ids,
+                           const std::vector<T> &jerk,
+                           const std::string &rng_state) {
+  const std::string tmpname = filename + ".tmp";
+  const int fd = ::open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cout << "WARNING: failed to open " << tmpname << "\n";
+    return;
+  }
+  bool ok = write_all(fd, &header, sizeof(header));
+  for (const std::vector<T> *values : {&pos, &vel, &acc, &mss})
+    ok = ok && write_all(fd, values->data(), values->size() * sizeof(T));
+  ok = ok && write_all(fd, ids.data(), ids.size() * sizeof(int));
+  ok = ok && write_all(fd, jerk.data(), jerk.size() * sizeof(T));
+  ok = ok && write_all(fd, rng_state.data(), rng_state.size());
+  NBODY_COUNT("bytes.checkpoint", uint64_t(::lseek(fd, 0, SEEK_CUR)));
+  ok = ::fsync(fd) == 0 && ok;
+  ok = ::close(fd) == 0 && ok;
+  if (!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+    std::cout << "WARNING: failed to write checkpoint " << filename << "\n";
+    std::remove(tmpname.c_str());
+  }
+}
+
+// read header and arrays, arrays are resized to the stored particle count
+// and the RNG is restored, ids is empty unless the system was reordered and
+// jerk is empty unless it was written by the Hermite integrator
+template <typename T>
+CheckpointHeader read_checkpoint_file(const std::string &filename,
+                                      std::vector<T> &pos, std::vector<T> &vel,
+                                      std::vector<T> &acc, std::vector<T> &mss,
+                                      std::vector<int> &ids, std::vector<T> &jerk) {
+  std::ifstream infile(filename, std::ios::binary);
+  if (!infile) {
+    std::cout << "ERROR: cannot open " << filename << ", exiting.\n";
+    exit(1);
+  }
+  CheckpointHeader header;
+  infile.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!infile || std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 ||
+      header.version != checkpoint_version) {
+    std::cout << "ERROR: " << filename << " is not a checkpoint file, exiting.\n";
+    exit(1);
+  }
+  if (header.value_size != sizeof(T)) {
+    std::cout << "ERROR: " << filename << " has a different value type, exiting.\n";
+    exit(1);
+  }
+  const std::size_t sys_size = header.num_bodies;
+  pos.resize(3 * sys_size);
+  vel.resize(3 * sys_size);
+  acc.resize(3 * sys_size);
+  mss.resize(sys_size);
+  for (std::vector<T> *values : {&pos, &vel, &acc, &mss})
+    infile.read(reinterpret_cast<char *>(values->data()), values->size() * sizeof(T));
+  if (header.num_ids != 0 && header.num_ids != sys_size) {
+    std::cout << "ERROR: " << filename << " has " << header.num_ids
+              << " particle ids for " << sys_size << " particles, exiting.\n";
+    exit(1);
+  }
+  ids.resize(header.num_ids);
+  infile.read(reinterpret_cast<char *>(ids.data()), ids.size() * sizeof(int));
+  if (header.num_jerks != 0 && header.num_jerks != sys_size) {
+    std::cout << "ERROR: " << filename << " has " << header.num_jerks
+              << " jerks for " << sys_size << " particles, exiting.\n";
+    exit(1);
+  }
+  jerk.resize(3 * header.num_jerks);
+  infile.read(reinterpret_cast<char *>(jerk.data()), jerk.size() * sizeof(T));
+  std::string rng_state(header.rng_size, '\0');
+  infile.read(rng_state.data(), rng_state.size());
+  if (!infile) {
+    std::cout << "ERROR: " << filename << " is truncated, exiting.\n";
+    exit(1);
+  }
+  set_rng_state(rng_state);
+  return header;
+}
+
+template <class SystemT>
+void restore_checkpoint_state(const CheckpointHeader &header, SystemT &system) {
+  using T = typename SystemT::T;
+  system.num_bodies = header.num_bodies;
+  system.step = header.step;
+  system.filenum = header.filenum;
+  system.elapsed_time = header.elapsed_time;
+  system.timestep = T(header.timestep);
+  system.max_timestep =
+      header.max_timestep > 0 ? T(header.max_timestep) : system.timestep;
+  system.output_interval = header.output_interval;
+  system.end_time = T(header.end_time);
+}
+
+// pack x, y, z of AoS vectors without the padding of Vec3
+template <class vecT, typename T>
+void pack_vec3(const std::vector<vecT> &in, std::vector<T> &out) {
+  out.resize(3 * in.size());
+  for (std::size_t i = 0; i < in.size(); i++) {
+    out[3 * i] = in[i].x;
+    out[3 * i + 1] = in[i].y;
+    out[3 * i + 2] = in[i].z;
+  }
+}
+
+template <class vecT, typename T>
+void unpack_vec3(const std::vector<T> &in, std::vector<vecT> &out) {
+  out.resize(in.size() / 3);
+  for (std::size_t i = 0; i < out.size(); i++)
+    out[i] = vecT(in[3 * i], in[3 * i + 1], in[3 * i + 2]);
+}
+
+template <typename T>
+void pack_vec3(const Vec3SoA<T> &in, std::vector<T> &out) {
+  out.resize(3 * in.size());
+  for (std::size_t i = 0; i < in.size(); i++) {
+    out[3 * i] = in.x[i];
+    out[3 * i + 1] = in.y[i];
+    out[3 * i + 2] = in.z[i];
+  }
+}
+
+template <typename T>
+void unpack_vec3(const std::vector<T> &in, Vec3SoA<T> &out) {
+  out.resize(in.size() / 3);
+  for (std::size_t i = 0; i < out.size(); i++) {
+    out.x[i] = in[3 * i];
+    out.y[i] = in[3 * i + 1];
+    out.z[i] = in[3 * i + 2];
+  }
+}
+}
+
+template <class vecT>
+void write_checkpoint(const std::string &filename, System<vecT> &system) {
+  using T = typename vecT::value_type;
+  const std::string rng_state = get_rng_state();
+  std::vector<T> &pos = system.workspace.output.pack_pos;
+  std::vector<T> &vel = system.workspace.output.pack_vel;
+  std::vector<T> &acc = system.workspace.output.pack_acc;
+  pack_vec3(system.sysPos, pos);
+  pack_vec3(system.sysVel, vel);
+  pack_vec3(system.sysAcc, acc);
+  // the jerks of the last Hermite step, a later step recomputes stale ones
+  std::vector<T> &jerk = system.workspace.output.pack_jerk;
+  jerk.clear();
+  if (system.jerk_step == system.step)
+    pack_vec3(system.sysJerk, jerk);
+  write_checkpoint_file(filename,
+                        make_checkpoint_header<T>(system, system.sysPos.size(),
+                                                  system.sysId.size(),
+                                                  jerk.size() / 3, rng_state),
+                        pos, vel, acc, system.sysMss, system.sysId, jerk,
+                        rng_state);
+}
+
+template <class vecT>
+void write_checkpoint(const std::string &filename, SystemSoA<vecT> &system) {
+  using T = typename vecT::value_type;
+  const std::string rng_state = get_rng_state();
+  std::vector<T> &pos = system.workspace.output.pack_pos;
+  std::vector<T> &vel = system.workspace.output.pack_vel;
+  std::vector<T> &acc = system.workspace.output.pack_acc;
+  std::vector<T> &mss = system.workspace.output.pack_mss;
+  mss.assign(system.sysMss.begin(), system.sysMss.end());
+  pack_vec3(system.sysPos, pos);
+  pack_vec3(system.sysVel, vel);
+  pack_vec3(system.sysAcc, acc);
+  write_checkpoint_file(filename,
+                        make_checkpoint_header<T>(system, system.sysMss.size(), 0,
+                                                  0, rng_state),
+                        pos, vel, acc, mss, std::vector<int>(), std::vector<T>(),
+                        rng_state);
+}
+
+template <class vecT>
+void read_checkpoint(const std::string &filename, System<vecT> &system) {
+  using T = typename vecT::value_type;
+  std::vector<T> pos, vel, acc, jerk;
+  const CheckpointHeader header = read_checkpoint_file(
+      filename, pos, vel, acc, system.sysMss, system.sysId, jerk);
+  restore_checkpoint_state(header, system);
+  unpack_vec3(pos, system.sysPos);
+  unpack_vec3(vel, system.sysVel);
+  unpack_vec3(acc, system.sysAcc);
+  unpack_vec3(jerk, system.sysJerk);
+  system.jerk_step = jerk.empty() ? -1 : system.step;
+}
+
+template <class vecT>
+void read_checkpoint(const std::string &filename, SystemSoA<vecT> &system) {
+  using T = typename vecT::value_type;
+  std::vector<T> pos, vel, acc, mss, jerk;
+  std::vector<int> ids;
+  const CheckpointHeader header =
+      read_checkpoint_file(filename, pos, vel, acc, mss, ids, jerk);
+  restore_checkpoint_state(header, system);
+  // back to the original order, the SoA layout is never reordered
+  if (!ids.empty()) {
+    std::vector<T> unsorted(pos.size());
+    for (std::vector<T> *values : {&pos, &vel, &acc}) {
+      for (size_t i = 0; i < ids.size(); i++)
+        for (int c = 0; c < 3; c++)
+          unsorted[3 * ids[i] + c] = (*values)[3 * i + c];
+      values->swap(unsorted);
+    }
+    unsorted.resize(mss.size());
+    for (size_t i = 0; i < ids.size(); i++)
+      unsorted[ids[i]] = mss[i];
+    mss.swap(unsorted);
+  }
+  unpack_vec3(pos, system.sysPos);
+  unpack_vec3(vel, system.sysVel);
+  unpack_vec3(acc, system.sysAcc);
+  system.sysMss = aligned_vector<T>(mss.begin(), mss.end());
+}
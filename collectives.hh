@@ -0,0 +1,16 @@
+
+#pragma once
+
+// Rank queries and reductions of distributed runs
+// they do not depend on System, so the modules included by system.hh can
+// use them; without ENABLE_MPI they run a single rank
+
+// rank of the calling process and number of ranks, a single rank in
+// programs that never call distributed_init (grav_bench)
+int distributed_rank();
+int distributed_size();
+
+// smallest value over all ranks
+double distributed_min(double value);
+
+#include "collectives_impl.hh"
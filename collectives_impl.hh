@@ -0,0 +1,39 @@
+
+#pragma once
+
+#include "collectives.hh"
+
+#ifdef ENABLE_MPI
+#include <mpi.h>
+
+inline int distributed_rank() {
+  int initialized, rank;
+  MPI_Initialized(&initialized);
+  if (!initialized)
+    return 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  return rank;
+}
+
+inline int distributed_size() {
+  int initialized, size;
+  MPI_Initialized(&initialized);
+  if (!initialized)
+    return 1;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  return size;
+}
+
+inline double distributed_min(double value) {
+  if (distributed_size() > 1)
+    MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+  return value;
+}
+
+#else
+
+inline int distributed_rank() { return 0; }
+inline int distributed_size() { return 1; }
+inline double distributed_min(double value) { return value; }
+
+#endif
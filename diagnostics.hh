@@ -0,0 +1,49 @@
+
+#pragma once
+
+#include <fstream>
+#include <string>
+#include "vec.hh"
+
+// Conservation diagnostics at the output cadence
+// kinetic energy, momentum, angular momentum and center of mass are
+// parallel reductions over the particles. The potential energy needs the
+// potential of every particle, which the direct kernel stores in the force
+// pass before an output (System::want_potential) at the cost of one more
+// multiply-add per pair. Other engines, the block integrator and the SoA
+// layout get it from a separate all-pairs pass at the output cadence
+
+template <class vecT> struct System;
+template <class vecT> struct SystemSoA;
+
+// sums in double, G = 1
+struct Diagnostics {
+  double kinetic{0.0};   // sum m v^2 / 2
+  double potential{0.0}; // sum over pairs of -m_i m_j / |r_ij|, softened
+  double mass{0.0};
+  Vec3<double> momentum;         // sum m v
+  Vec3<double> angular_momentum; // sum m r x v, about the origin
+  Vec3<double> center_of_mass;
+  double energy() const { return kinetic + potential; }
+};
+
+// measure system, uses the potentials of the last force pass if it stored
+// them, otherwise runs a potential pass
+template <class vecT> Diagnostics measure_diagnostics(System<vecT> &system);
+template <class vecT> Diagnostics measure_diagnostics(SystemSoA<vecT> &system);
+
+// Time series file of the diagnostics, one line per output
+// energy_error is relative to the energy of the first line of the file
+class DiagnosticsLog {
+public:
+  // a restarted run (append) continues the file of the first run
+  DiagnosticsLog(const std::string &filename, bool append);
+  void write(int step, double time, const Diagnostics &diagnostics);
+
+private:
+  std::ofstream file;
+  double initial_energy{0.0};
+  bool has_initial{false};
+};
+
+#include "diagnostics_impl.hh"
@@ -0,0 +1,183 @@
+
+#pragma once
+
+#include <cmath>
+#include <execution>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include "diagnostics.hh"
+#include "instrumentation.hh"
+#include "math_functions.hh"
+#include "system.hh"
+#include "workspace.hh"
+
+namespace {
+// partial sums of the diagnostics reduction
+struct DiagnosticsSum {
+  double kinetic{0.0};
+  double potential{0.0};
+  double mass{0.0};
+  Vec3<double> momentum;
+  Vec3<double> angular_momentum;
+  Vec3<double> mass_moment; // sum m r
+};
+
+inline DiagnosticsSum operator+(const DiagnosticsSum &a, const DiagnosticsSum &b) {
+  DiagnosticsSum sum = a;
+  sum.kinetic += b.kinetic;
+  sum.potential += b.potential;
+  sum.mass += b.mass;
+  sum.momentum += b.momentum;
+  sum.angular_momentum += b.angular_momentum;
+  sum.mass_moment += b.mass_moment;
+  return sum;
+}
+
+// reduce over n particles, particle(i) returns position, velocity, mass
+// and potential of particle i
+template <class Particle>
+Diagnostics reduce_diagnostics(int n, Particle particle) {
+  const IndexRange sys_i = index_range(n);
+  const DiagnosticsSum sum = std::transform_reduce(
+      std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+      DiagnosticsSum{}, std::plus<>(), [=](int i) {
+        Vec3<double> pos, vel;
+        double mss, pot;
+        particle(i, pos, vel, mss, pot);
+        DiagnosticsSum s;
+        s.kinetic = 0.5 * mss * dot_product(vel);
+        s.potential = 0.5 * mss * pot; // each pair appears twice
+        s.mass = mss;
+        s.momentum = vel * mss;
+        s.angular_momentum = cross_product(pos, vel) * mss;
+        s.mass_moment = pos * mss;
+        return s;
+      });
+  Diagnostics diagnostics;
+  diagnostics.kinetic = sum.kinetic;
+  diagnostics.potential = sum.potential;
+  diagnostics.mass = sum.mass;
+  diagnostics.momentum = sum.momentum;
+  diagnostics.angular_momentum = sum.angular_momentum;
+  if (sum.mass > 0.0)
+    diagnostics.center_of_mass = sum.mass_moment / sum.mass;
+  return diagnostics;
+}
+
+// potential of every particle from a separate all-pairs pass, the same
+// pair terms as the direct kernel, pos(i) returns the position of i
+template <class vecT, class Position>
+void potential_pass(int n, Position pos, typename vecT::value_type const *mssptr,
+                    typename vecT::value_type *potptr) {
+  using T = typename vecT::value_type;
+  NBODY_TIMER("potential");
+  const IndexRange sys_i = index_range(n);
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  const vecT p = pos(i);
+                  T pot{0.0};
+                  for (int j = 0; j < n; j++)
+                    acceleration(p, pos(j), j == i ? T(0.0) : mssptr[j], pot);
+                  potptr[i] = pot;
+                });
+}
+}
+
+template <class vecT> Diagnostics measure_diagnostics(System<vecT> &system) {
+  using T = typename vecT::value_type;
+  NBODY_TIMER("diagnostics");
+  const int sys_size = system.sysPos.size();
+  vecT const *posptr = system.sysPos.data();
+  vecT const *velptr = system.sysVel.data();
+  T const *mssptr = system.sysMss.data();
+  std::vector<T> &potential = system.workspace.output.potential;
+  if (!system.has_potential) {
+    potential.resize(sys_size);
+    potential_pass<vecT>(sys_size, [=](int i) { return posptr[i]; }, mssptr,
+                         potential.data());
+  }
+  system.has_potential = false;
+  T const *potptr = potential.data();
+  return reduce_diagnostics(sys_size, [=](int i, Vec3<double> &pos,
+                                          Vec3<double> &vel, double &mss,
+                                          double &pot) {
+    pos = Vec3<double>(posptr[i].x, posptr[i].y, posptr[i].z);
+    vel = Vec3<double>(velptr[i].x, velptr[i].y, velptr[i].z);
+    mss = mssptr[i];
+    pot = potptr[i];
+  });
+}
+
+template <class vecT> Diagnostics measure_diagnostics(SystemSoA<vecT> &system) {
+  using T = typename vecT::value_type;
+  NBODY_TIMER("diagnostics");
+  const int sys_size = system.sysMss.size();
+  T const *xptr = system.sysPos.x.data();
+  T const *yptr = system.sysPos.y.data();
+  T const *zptr = system.sysPos.z.data();
+  T const *vxptr = system.sysVel.x.data();
+  T const *vyptr = system.sysVel.y.data();
+  T const *vzptr = system.sysVel.z.data();
+  T const *mssptr = system.sysMss.data();
+  std::vector<T> &potential = system.workspace.output.potential;
+  potential.resize(sys_size);
+  potential_pass<vecT>(
+      sys_size, [=](int i) { return vecT(xptr[i], yptr[i], zptr[i]); }, mssptr,
+      potential.data());
+  T const *potptr = potential.data();
+  return reduce_diagnostics(sys_size, [=](int i, Vec3<double> &pos,
+                                          Vec3<double> &vel, double &mss,
+                                          double &pot) {
+    pos = Vec3<double>(xptr[i], yptr[i], zptr[i]);
+    vel = Vec3<double>(vxptr[i], vyptr[i], vzptr[i]);
+    mss = mssptr[i];
+    pot = potptr[i];
+  });
+}
+
+inline DiagnosticsLog::DiagnosticsLog(const std::string &filename, bool append) {
+  // a continued file keeps the energy of its first line as reference
+  if (append) {
+    std::ifstream previous(filename);
+    std::string line;
+    while (!has_initial && std::getline(previous, line)) {
+      std::istringstream fields(line);
+      double step, time, kinetic, potential;
+      if (line.empty() || line[0] == '#')
+        continue;
+      has_initial =
+          bool(fields >> step >> time >> kinetic >> potential >> initial_energy);
+    }
+  }
+  file.open(filename, append ? std::ios::app : std::ios::trunc);
+  if (!file) {
+    std::cout << "WARNING: failed to open " << filename << "\n";
+    return;
+  }
+  file << std::setprecision(10);
+  if (!append)
+    file << "# step time kinetic potential energy energy_error px py pz Lx Ly "
+            "Lz xcom ycom zcom\n";
+}
+
+inline void DiagnosticsLog::write(int step, double time,
+                                  const Diagnostics &diagnostics) {
+  const double energy = diagnostics.energy();
+  if (!has_initial) {
+    initial_energy = energy;
+    has_initial = true;
+  }
+  const double error = initial_energy != 0.0
+                           ? (energy - initial_energy) / std::abs(initial_energy)
+                           : 0.0;
+  const Vec3<double> &p = diagnostics.momentum;
+  const Vec3<double> &l = diagnostics.angular_momentum;
+  const Vec3<double> &c = diagnostics.center_of_mass;
+  file << step << " " << time << " " << diagnostics.kinetic << " "
+       << diagnostics.potential << " " << energy << " " << error << " " << p.x
+       << " " << p.y << " " << p.z << " " << l.x << " " << l.y << " " << l.z
+       << " " << c.x << " " << c.y << " " << c.z << "\n";
+  file.flush();
+}
@@ -0,0 +1,50 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "collectives.hh"
+#include "system.hh"
+
+// Distributed memory runs, ENABLE_MPI builds only
+// every rank sets up the same initial conditions and keeps the block
+// [first, first + n_local) of particles, forces are summed by passing the
+// position and mass blocks around a ring of ranks
+// without ENABLE_MPI the functions below run a single rank
+
+// position and mass blocks of the ring, in flight and in use
+template <class vecT> struct RingBuffers {
+  using T = typename vecT::value_type;
+  std::vector<vecT> ring_pos[2];
+  std::vector<T> ring_mss[2];
+};
+
+// MPI_Init, output of ranks other than 0 is silenced
+void distributed_init(int &argc, char **&argv);
+void distributed_finalize();
+
+// share the interactive input and the seed of rank 0 with all ranks
+void distributed_config(Config &config);
+
+// first particle of the block owned by rank, blocks differ by at most one
+int rank_first(int num_bodies, int rank, int num_ranks);
+
+// keep the block of the calling rank, switch off what MPI runs do not support
+template <class vecT> void distribute_particles(System<vecT> &system);
+
+#ifdef ENABLE_MPI
+// all-pairs forces on the local particles
+// the next block is in flight while the current one is accumulated
+template <class vecT>
+void accumulate_forces_ring(System<vecT> &system, std::vector<vecT> &accel);
+
+// write snapshot and points files with collective MPI-IO, the files are
+// identical to those of a single rank run
+template <class vecT>
+void write_snapshot_collective(const std::string &filename, int step, double time,
+                               System<vecT> &system);
+template <class vecT>
+void write_points_collective(const std::string &filename, System<vecT> &system);
+#endif
+
+#include "distributed_impl.hh"
@@ -0,0 +1,252 @@
+
+#pragma once
+
+#include <algorithm>
+#include <execution>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include "distributed.hh"
+#include "instrumentation.hh"
+#include "physics.hh"
+#include "reorder.hh"
+#include "snapshot.hh"
+#include "utils.hh"
+#include "workspace.hh"
+
+#ifdef ENABLE_MPI
+#include <mpi.h>
+
+namespace {
+template <typename T> MPI_Datatype mpi_type();
+template <> inline MPI_Datatype mpi_type<float>() { return MPI_FLOAT; }
+template <> inline MPI_Datatype mpi_type<double>() { return MPI_DOUBLE; }
+
+// open filename for a collective write, truncating an older file
+inline bool open_collective(const std::string &filename, MPI_File &file) {
+  if (MPI_File_open(MPI_COMM_WORLD, filename.c_str(),
+                    MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                    &file) != MPI_SUCCESS) {
+    std::cout << "WARNING: failed to write " << filename << "\n";
+    return false;
+  }
+  MPI_File_set_size(file, 0);
+  return true;
+}
+}
+
+inline void distributed_init(int &argc, char **&argv) {
+  // only the main thread calls MPI, the parallel algorithms never do
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  if (distributed_rank() != 0)
+    std::cout.setstate(std::ios::failbit);
+}
+
+inline void distributed_finalize() { MPI_Finalize(); }
+
+inline void distributed_config(Config &config) {
+  if (distributed_rank() == 0 && config.seed < 0) {
+    config.seed = std::random_device()();
+    std::cout << "seed: " << config.seed << "\n";
+  }
+  MPI_Bcast(&config.nbodies, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&config.shape, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&config.end_time, 1, MPI_FLOAT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&config.timestep, 1, MPI_FLOAT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&config.seed, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
+}
+
+#else
+
+inline void distributed_init(int &, char **&) {}
+inline void distributed_finalize() {}
+inline void distributed_config(Config &) {}
+
+#endif
+
+inline int rank_first(int num_bodies, int rank, int num_ranks) {
+  return int(int64_t(num_bodies) * rank / num_ranks);
+}
+
+template <class vecT> void distribute_particles(System<vecT> &system) {
+  system.rank = distributed_rank();
+  system.num_ranks = distributed_size();
+  if (system.num_ranks == 1)
+    return;
+
+  if (system.engine != ForceEngine::direct)
+    std::cout << "WARNING: MPI runs only support the direct force engine, "
+                 "using direct\n";
+  if (system.precision != Precision::single)
+    std::cout << "WARNING: MPI runs only support single precision sums\n";
+  if (system.integrator == Integrator::block ||
+      system.integrator == Integrator::hermite)
+    std::cout << "WARNING: MPI runs do not support block time steps or the "
+                 "Hermite integrator, using verlet\n";
+  if (system.checkpoint_interval > 0)
+    std::cout << "WARNING: MPI runs do not write checkpoints\n";
+  if (system.sort_curve != SortCurve::none)
+    std::cout << "WARNING: MPI runs do not reorder particles\n";
+  if (system.diagnostics)
+    std::cout << "WARNING: MPI runs do not write diagnostics\n";
+  if (system.merge_radius > 0)
+    std::cout << "WARNING: MPI runs do not merge close pairs\n";
+  system.engine = ForceEngine::direct;
+  system.precision = Precision::single;
+  if (system.integrator == Integrator::block ||
+      system.integrator == Integrator::hermite)
+    system.integrator = Integrator::verlet;
+  system.checkpoint_interval = 0;
+  system.sort_curve = SortCurve::none;
+  system.diagnostics = false;
+  system.merge_radius = 0;
+  // a restart from a reordered checkpoint, ranks own original index ranges
+  restore_particle_order(system);
+  // snapshots are written collectively, which the writer thread cannot join
+  system.output_queue = 0;
+
+  const int first = rank_first(system.num_bodies, system.rank, system.num_ranks);
+  const int last = rank_first(system.num_bodies, system.rank + 1, system.num_ranks);
+  system.first = first;
+  system.sysPos = std::vector<vecT>(system.sysPos.begin() + first,
+                                    system.sysPos.begin() + last);
+  system.sysVel = std::vector<vecT>(system.sysVel.begin() + first,
+                                    system.sysVel.begin() + last);
+  system.sysAcc = std::vector<vecT>(system.sysAcc.begin() + first,
+                                    system.sysAcc.begin() + last);
+  system.sysMss = std::vector<typename vecT::value_type>(
+      system.sysMss.begin() + first, system.sysMss.begin() + last);
+  std::cout << system.num_ranks << " ranks, up to "
+            << (system.num_bodies + system.num_ranks - 1) / system.num_ranks
+            << " particles each\n";
+}
+
+#ifdef ENABLE_MPI
+
+template <class vecT>
+void accumulate_forces_ring(System<vecT> &system, std::vector<vecT> &accel) {
+  using T = typename vecT::value_type;
+  const int rank = system.rank;
+  const int num_ranks = system.num_ranks;
+  const int left = (rank + num_ranks - 1) % num_ranks;
+  const int right = (rank + 1) % num_ranks;
+  const int num_bodies = system.num_bodies;
+  auto block_size = [=](int r) {
+    return rank_first(num_bodies, r + 1, num_ranks) -
+           rank_first(num_bodies, r, num_ranks);
+  };
+
+  // double buffered blocks, [cur] is accumulated while [1 - cur] arrives
+  RingBuffers<vecT> &work = system.workspace.ring;
+  const int max_block = (num_bodies + num_ranks - 1) / num_ranks;
+  for (int b = 0; b < 2; b++) {
+    work.ring_pos[b].resize(max_block);
+    work.ring_mss[b].resize(max_block);
+  }
+  std::copy(system.sysPos.begin(), system.sysPos.end(), work.ring_pos[0].begin());
+  std::copy(system.sysMss.begin(), system.sysMss.end(), work.ring_mss[0].begin());
+
+  const IndexRange sys_i = index_range(system.sysPos.size());
+  vecT const *tgtptr = system.sysPos.data();
+  vecT *accptr = accel.data();
+  for (int step = 0; step < num_ranks; step++) {
+    const int cur = step % 2;
+    const int owner = (rank + num_ranks - step) % num_ranks;
+    const size_t src_size = block_size(owner);
+
+    // pass the current block on to the right, receive the next from the left
+    MPI_Request requests[4];
+    int num_requests = 0;
+    if (step + 1 < num_ranks) {
+      const int next_size = block_size((owner + num_ranks - 1) % num_ranks);
+      MPI_Irecv(work.ring_pos[1 - cur].data(), next_size * sizeof(vecT),
+                MPI_BYTE, left, 0, MPI_COMM_WORLD, &requests[num_requests++]);
+      MPI_Irecv(work.ring_mss[1 - cur].data(), next_size, mpi_type<T>(), left,
+                1, MPI_COMM_WORLD, &requests[num_requests++]);
+      MPI_Isend(work.ring_pos[cur].data(), src_size * sizeof(vecT), MPI_BYTE,
+                right, 0, MPI_COMM_WORLD, &requests[num_requests++]);
+      MPI_Isend(work.ring_mss[cur].data(), src_size, mpi_type<T>(), right, 1,
+                MPI_COMM_WORLD, &requests[num_requests++]);
+    }
+
+    vecT const *posptr = work.ring_pos[cur].data();
+    T const *mssptr = work.ring_mss[cur].data();
+    const bool first_block = step == 0;
+    std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                  std::end(sys_i), [=](int i) {
+                    const vecT pos = tgtptr[i];
+                    vecT acc = first_block ? vecT() : accptr[i];
+                    for (size_t j = 0; j < src_size; j++)
+                      acc += acceleration(pos, posptr[j], mssptr[j]);
+                    accptr[i] = acc;
+                  });
+
+    NBODY_TIMER("ring_wait");
+    MPI_Waitall(num_requests, requests, MPI_STATUSES_IGNORE);
+  }
+}
+
+template <class vecT>
+void write_snapshot_collective(const std::string &filename, int step, double time,
+                               System<vecT> &system) {
+  NBODY_TIMER("write_snapshot");
+  using U = typename vecT::value_type;
+  pack_snapshot(system);
+  const std::vector<U> &pos = system.workspace.output.pack_pos;
+  const std::vector<U> &vel = system.workspace.output.pack_vel;
+  const SnapshotHeader header =
+      make_snapshot_header<U>(step, time, system.num_bodies);
+
+  MPI_File file;
+  if (!open_collective(filename, file))
+    return;
+  // gaps before the 64 byte aligned arrays read back as zeros
+  if (system.rank == 0)
+    MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+  const uint64_t first = system.first;
+  MPI_File_write_at_all(file, header.pos_offset + 3 * first * sizeof(U),
+                        pos.data(), pos.size(), mpi_type<U>(), MPI_STATUS_IGNORE);
+  MPI_File_write_at_all(file, header.vel_offset + 3 * first * sizeof(U),
+                        vel.data(), vel.size(), mpi_type<U>(), MPI_STATUS_IGNORE);
+  MPI_File_write_at_all(file, header.mss_offset + first * sizeof(U),
+                        system.sysMss.data(), system.sysMss.size(),
+                        mpi_type<U>(), MPI_STATUS_IGNORE);
+  MPI_File_close(&file);
+  NBODY_COUNT("bytes.write_snapshot",
+              (6 * system.sysPos.size() + system.sysMss.size()) * sizeof(U));
+}
+
+template <class vecT>
+void write_points_collective(const std::string &filename, System<vecT> &system) {
+  const auto &vmag = calculate_velocity_mag(system);
+  std::ostringstream out;
+  out << std::setprecision(8);
+  if (system.rank == 0) {
+    out << "x y z velocity\n";
+    out << "#coordflag xyzm\n";
+  }
+  for (std::size_t i = 0; i < system.sysPos.size(); i++) {
+    out << system.sysPos[i].x << " " << system.sysPos[i].y << " "
+        << system.sysPos[i].z << " " << vmag[i] << "\n";
+  }
+  const std::string text = out.str();
+
+  // each rank writes its lines after those of the lower ranks
+  long long size = text.size();
+  long long offset = 0;
+  MPI_Exscan(&size, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  if (system.rank == 0)
+    offset = 0;
+  MPI_File file;
+  if (!open_collective(filename, file))
+    return;
+  MPI_File_write_at_all(file, offset, text.data(), text.size(), MPI_CHAR,
+                        MPI_STATUS_IGNORE);
+  MPI_File_close(&file);
+  NBODY_COUNT("bytes.write_points", uint64_t(size));
+}
+
+#endif
@@ -0,0 +1,52 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "system.hh"
+
+// Ensemble of independent systems advanced together
+// members keep their own storage, parameters and output files, every step
+// runs one kick-drift pass and one force-kick pass over the particles of all
+// running members, so many small systems keep the threads as busy as one
+// large system
+// members use the direct engine and the fused velocity Verlet step, their
+// results are bit-identical to running each one alone with
+// --integrator=fused
+
+// pointers of a running member, particle g of a pass is particle
+// g - first of its member
+template <class vecT> struct EnsembleMember {
+  using T = typename vecT::value_type;
+  int member{0}; // index in Ensemble::members
+  int first{0};
+  int size{0};
+  float dt{0.0f};
+  vecT *pos{nullptr};
+  vecT *vel{nullptr};
+  vecT *acc{nullptr};
+  T const *mss{nullptr};
+};
+
+template <class vecT> struct Ensemble {
+  using T = typename vecT::value_type;
+  std::vector<System<vecT>> members;
+  std::vector<EnsembleMember<vecT>> running; // members not past end_time
+  std::vector<int> member_of;                // running entry of each particle
+  int num_particles{0};                      // particles of running members
+  uint64_t num_interactions{0};
+  Ensemble() {}
+  // set up (or restart) one member per config
+  void setup(std::vector<Config> &configs);
+  // run all members to their end time, with their snapshots and checkpoints
+  void advance();
+};
+
+// refresh the running members, the particle map is only rebuilt when a
+// member finishes or changes size
+template <class vecT> void update_running(Ensemble<vecT> &ensemble);
+
+// one fused kick-drift-kick step of every running member
+template <class vecT> void integrate_ensemble(Ensemble<vecT> &ensemble);
+
+#include "ensemble_impl.hh"
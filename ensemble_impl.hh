@@ -0,0 +1,181 @@
+
+#pragma once
+
+#include <algorithm>
+#include <execution>
+#include <iostream>
+#include "checkpoint.hh"
+#include "ensemble.hh"
+#include "instrumentation.hh"
+#include "merging.hh"
+#include "physics.hh"
+#include "reorder.hh"
+#include "workspace.hh"
+
+template <class vecT> void Ensemble<vecT>::setup(std::vector<Config> &configs) {
+  const bool other_engine = std::any_of(
+      configs.begin(), configs.end(), [](const Config &config) {
+        return config.engine != ForceEngine::direct ||
+               config.precision != Precision::single;
+      });
+  const bool other_integrator = std::any_of(
+      configs.begin(), configs.end(), [](const Config &config) {
+        return config.integrator != Integrator::verlet &&
+               config.integrator != Integrator::fused;
+      });
+  if (other_engine)
+    std::cout << "WARNING: ensemble members use the direct engine with single "
+                 "precision sums\n";
+  if (other_integrator)
+    std::cout << "WARNING: ensemble members use the fused velocity Verlet "
+                 "step\n";
+  if (std::any_of(configs.begin(), configs.end(),
+                  [](const Config &config) { return config.diagnostics; }))
+    std::cout << "WARNING: ensemble members do not write diagnostics\n";
+  if (std::any_of(configs.begin(), configs.end(), [](const Config &config) {
+        return config.timestep_control != TimestepControl::fixed;
+      }))
+    std::cout << "WARNING: ensemble members use fixed time steps\n";
+
+  members = std::vector<System<vecT>>(configs.size());
+  running.reserve(configs.size());
+  for (size_t k = 0; k < configs.size(); k++) {
+    Config &config = configs[k];
+    config.engine = ForceEngine::direct;
+    config.precision = Precision::single;
+    config.integrator = Integrator::fused;
+    config.timestep_control = TimestepControl::fixed;
+    if (config.restart_file.empty())
+      members[k].setup(config);
+    else
+      members[k].restart(config);
+  }
+  update_running(*this);
+}
+
+template <class vecT> void Ensemble<vecT>::advance() {
+  NBODY_TIMER("advance");
+  using T = typename vecT::value_type;
+  for (System<vecT> &member : members)
+    if (member.step == 0)
+      write_output(member.filenum++, member.step, member.elapsed_time, member);
+
+  while (!running.empty()) {
+    integrate_ensemble(*this);
+    bool written = false;
+    for (const EnsembleMember<vecT> &entry : running) {
+      System<vecT> &member = members[entry.member];
+      member.elapsed_time = T(member.elapsed_time) + member.timestep;
+      ++member.step;
+      // the running entries pick up the new arrays in update_running
+      merge_close_pairs(member);
+      reorder_if_due(member);
+      if (member.step % output_steps(member) == 0) {
+        NBODY_TIMER("output");
+        write_output(member.filenum++, member.step, member.elapsed_time, member);
+        written = true;
+      }
+      if (member.checkpoint_interval > 0 &&
+          member.step % member.checkpoint_interval == 0) {
+        NBODY_TIMER("checkpoint");
+        write_checkpoint(member.checkpoint_file, member);
+      }
+    }
+    if (written)
+      std::cout << "writing files of " << running.size() << " members at step: "
+                << members[running[0].member].step << "\n";
+    update_running(*this);
+  }
+}
+
+template <class vecT> void update_running(Ensemble<vecT> &ensemble) {
+  std::vector<EnsembleMember<vecT>> &running = ensemble.running;
+  bool changed = false;
+  size_t r = 0;
+  int first = 0;
+  uint64_t interactions = 0;
+  for (size_t k = 0; k < ensemble.members.size(); k++) {
+    System<vecT> &member = ensemble.members[k];
+    if (member.elapsed_time > member.end_time)
+      continue;
+    EnsembleMember<vecT> entry;
+    entry.member = k;
+    entry.first = first;
+    entry.size = member.sysPos.size();
+    entry.dt = static_cast<float>(member.timestep);
+    entry.pos = member.sysPos.data();
+    entry.vel = member.sysVel.data();
+    entry.acc = member.sysAcc.data();
+    entry.mss = member.sysMss.data();
+    if (r == running.size()) {
+      running.push_back(entry);
+      changed = true;
+    } else {
+      changed |= running[r].member != entry.member || running[r].size != entry.size;
+      running[r] = entry;
+    }
+    first += entry.size;
+    interactions += uint64_t(entry.size) * entry.size;
+    r++;
+  }
+  if (r != running.size()) {
+    running.resize(r);
+    changed = true;
+  }
+  ensemble.num_particles = first;
+  ensemble.num_interactions = interactions;
+  if (!changed)
+    return;
+
+  ensemble.member_of.resize(first);
+  for (size_t e = 0; e < running.size(); e++)
+    std::fill(std::execution::par_unseq,
+              ensemble.member_of.begin() + running[e].first,
+              ensemble.member_of.begin() + running[e].first + running[e].size,
+              int(e));
+}
+
+// same operations and order as integrate_fused with the direct engine
+template <class vecT> void integrate_ensemble(Ensemble<vecT> &ensemble) {
+  using T = typename vecT::value_type;
+  const EnsembleMember<vecT> *runptr = ensemble.running.data();
+  const int *memberptr = ensemble.member_of.data();
+  const IndexRange flat_i = index_range(ensemble.num_particles);
+
+  // Vel(t+dt/2) = Vel(t) + 0.5 * dt * Acc(t)
+  // Pos(t+dt) = Pos(t) + Vel(t+dt/2) * dt
+  {
+    NBODY_TIMER("kick_drift");
+    std::for_each(std::execution::par_unseq, std::begin(flat_i),
+                  std::end(flat_i), [=](int g) {
+                    const EnsembleMember<vecT> &m = runptr[memberptr[g]];
+                    const int i = g - m.first;
+                    const float dt = m.dt;
+                    const float half_dt{dt / 2};
+                    m.vel[i] += m.acc[i] * half_dt;
+                    m.pos[i] += m.vel[i] * dt;
+                  });
+  }
+  // Acc(t+dt) = f(Pos(t+dt))
+  // Vel(t+dt) = Vel(t+dt/2) + 0.5 * dt * Acc(t+dt)
+  {
+    NBODY_TIMER("forces_kick");
+    NBODY_COUNT("force_targets", ensemble.num_particles);
+    NBODY_COUNT("interactions", ensemble.num_interactions);
+    std::for_each(std::execution::par_unseq, std::begin(flat_i),
+                  std::end(flat_i), [=](int g) {
+                    const EnsembleMember<vecT> &m = runptr[memberptr[g]];
+                    const int i = g - m.first;
+                    const size_t sys_size = m.size;
+                    vecT const *posptr = m.pos;
+                    T const *mssptr = m.mss;
+                    const float half_dt{m.dt / 2};
+                    const vecT pos = posptr[i];
+                    vecT acc;
+                    for (size_t j = 0; j < sys_size; j++)
+                      acc += acceleration(pos, posptr[j], mssptr[j]);
+                    m.acc[i] = acc;
+                    m.vel[i] += acc * half_dt;
+                  });
+  }
+}
@@ -0,0 +1,38 @@
+
+#pragma once
+
+#include <vector>
+#include "system.hh"
+
+// Cartesian fast multipole method on the Barnes-Hut octree
+// multipoles of order p are shifted up the tree (M2M), translated into local
+// Taylor expansions of well-separated cells (M2L), shifted down the tree (L2L)
+// and evaluated at the particles (L2P), near cells are summed directly (P2P)
+// a cell pair A, B is well separated if r_A + r_B < theta * |com_A - com_B|
+// the expansions cost O(N) for a fixed order, but the tree is rebuilt every
+// call with a pass over all particles per level, so the engine is
+// O(N log N) overall like Barnes-Hut
+// the error falls with theta^(p+1) for float and double positions alike:
+// offsets from the cell centers, the expansions and the near cell sums are
+// all taken in double with the exact inverse square root. Against the
+// direct kernels, whose rsqrt estimate is itself about 4e-4 rms off, the
+// difference levels off near that estimate error (order 6 at theta 0.25
+// is 2e-5 rms from exact softened gravity at N = 4096)
+
+// Highest supported expansion order
+static constexpr int fmm_max_order = 8;
+
+// Expansions of the tree cells, the tree itself is shared with Barnes-Hut
+template <class vecT> struct FmmBuffers {
+  std::vector<double> multipoles;
+  std::vector<double> locals;
+  std::vector<double> radius;
+  std::vector<vecT> sorted_acc; // accelerations in tree order
+};
+
+// Calculate FMM forces with expansion order p and opening angle theta
+template <class vecT, typename T>
+void accumulate_forces_fmm(System<vecT> &system, std::vector<vecT> &accel,
+                           T theta, int p);
+
+#include "fmm_impl.hh"
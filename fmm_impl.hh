@@ -0,0 +1,344 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <execution>
+#include <numeric>
+#include <vector>
+#include "barnes_hut.hh"
+#include "fmm.hh"
+#include "physics.hh"
+
+namespace {
+// number of expansion coefficients up to order p
+constexpr int fmm_ncoef(int p) { return (p + 1) * (p + 2) * (p + 3) / 6; }
+// walk stack, 7 siblings stay on the stack per step, a step descends either
+// the target or the source tree
+static constexpr int fmm_stack_size = 8 * 2 * (bh_max_depth + 1);
+
+// flat index of multi-index (nx, ny, nz), ordered by degree
+inline int fmm_index(int nx, int ny, int nz) {
+  const int s = nx + ny + nz;
+  const int j = ny + nz;
+  return s * (s + 1) * (s + 2) / 6 + j * (j + 1) / 2 + nz;
+}
+
+// neighbours of a multi-index k in the flat ordering, -1 if outside order p
+struct FMMCoef {
+  int degree;
+  int exponent[3];
+  int minus1[3]; // k - e_i
+  int minus2[3]; // k - 2e_i
+  int plus1[3];  // k + e_i
+};
+
+// C(n+m, m) * X_{n+m} * Y_m summed into Z_n, shared by M2L, M2M and L2L
+struct FMMTerm {
+  int n;
+  int nm;
+  int m;
+  double c;
+};
+
+// index tables for expansion order p
+struct FMMTables {
+  std::vector<FMMCoef> coefs;
+  std::vector<FMMTerm> terms; // all n, m with |n| + |m| <= p
+  FMMTables(int p) {
+    double binom[fmm_max_order + 1][fmm_max_order + 1]{};
+    for (int n = 0; n <= p; n++) {
+      binom[n][0] = 1.0;
+      for (int k = 1; k <= n; k++)
+        binom[n][k] = binom[n - 1][k - 1] + (k < n ? binom[n - 1][k] : 0.0);
+    }
+    auto index = [=](int nx, int ny, int nz) {
+      return nx < 0 || ny < 0 || nz < 0 || nx + ny + nz > p
+                 ? -1
+                 : fmm_index(nx, ny, nz);
+    };
+    for (int s = 0; s <= p; s++)
+      for (int nx = s; nx >= 0; nx--)
+        for (int nz = 0; nz <= s - nx; nz++) {
+          const int ny = s - nx - nz;
+          coefs.push_back({s,
+                           {nx, ny, nz},
+                           {index(nx - 1, ny, nz), index(nx, ny - 1, nz),
+                            index(nx, ny, nz - 1)},
+                           {index(nx - 2, ny, nz), index(nx, ny - 2, nz),
+                            index(nx, ny, nz - 2)},
+                           {index(nx + 1, ny, nz), index(nx, ny + 1, nz),
+                            index(nx, ny, nz + 1)}});
+          for (int t = 0; t <= p - s; t++)
+            for (int mx = t; mx >= 0; mx--)
+              for (int mz = 0; mz <= t - mx; mz++) {
+                const int my = t - mx - mz;
+                terms.push_back({fmm_index(nx, ny, nz),
+                                 fmm_index(nx + mx, ny + my, nz + mz),
+                                 fmm_index(mx, my, mz),
+                                 binom[nx + mx][mx] * binom[ny + my][my] *
+                                     binom[nz + mz][mz]});
+              }
+        }
+  }
+};
+
+// tables of expansion order p, built once for all orders
+inline const FMMTables &fmm_tables(int p) {
+  static const std::vector<FMMTables> tables = [] {
+    std::vector<FMMTables> t;
+    for (int order = 0; order <= fmm_max_order; order++)
+      t.emplace_back(order);
+    return t;
+  }();
+  return tables[p];
+}
+
+// a - b in double, exact for float positions, so that the expansions do not
+// lose the digits of the offsets from the cell centers
+template <class vecT> struct FMMOffset {
+  double x, y, z;
+  FMMOffset(const vecT &a, const vecT &b)
+      : x(double(a.x) - b.x), y(double(a.y) - b.y), z(double(a.z) - b.z) {}
+  double magnitude() const { return std::sqrt(x * x + y * y + z * z); }
+};
+
+// near cell pair term of the kernel softening in double with the exact
+// inverse square root, the rsqrt estimate of the direct kernels would cap
+// the accuracy of every expansion order
+template <class vecT, typename T>
+void fmm_p2p(const vecT &pos1, const vecT &pos2, T mass2, double *acc) {
+  const FMMOffset<vecT> d(pos2, pos1);
+  const double r_sq = d.x * d.x + d.y * d.y + d.z * d.z + 0.00001;
+  const double impulse = double(mass2) / (r_sq * std::sqrt(r_sq));
+  acc[0] += d.x * impulse;
+  acc[1] += d.y * impulse;
+  acc[2] += d.z * impulse;
+}
+
+// monomials v^k for all k of the tables
+inline void fmm_monomials(double vx, double vy, double vz, int nc,
+                          const FMMCoef *coefs, double *mono) {
+  const double v[3] = {vx, vy, vz};
+  mono[0] = 1.0;
+  for (int k = 1; k < nc; k++) {
+    const int i = coefs[k].minus1[0] >= 0 ? 0 : coefs[k].minus1[1] >= 0 ? 1 : 2;
+    mono[k] = mono[coefs[k].minus1[i]] * v[i];
+  }
+}
+
+// Taylor coefficients a_k = D^k(1/|R|) / k! for all k of the tables
+// |k| r^2 a_k = -(2|k|-1) sum_i R_i a_{k-e_i} - (|k|-1) sum_i a_{k-2e_i}
+inline void fmm_taylor(double rx, double ry, double rz, int nc,
+                       const FMMCoef *coefs, double *a) {
+  const double r[3] = {rx, ry, rz};
+  const double inv_r2 = 1.0 / (rx * rx + ry * ry + rz * rz);
+  a[0] = std::sqrt(inv_r2);
+  for (int k = 1; k < nc; k++) {
+    const FMMCoef &coef = coefs[k];
+    double t1{0.0}, t2{0.0};
+    for (int i = 0; i < 3; i++) {
+      if (coef.minus1[i] >= 0) t1 += r[i] * a[coef.minus1[i]];
+      if (coef.minus2[i] >= 0) t2 += a[coef.minus2[i]];
+    }
+    const int s = coef.degree;
+    a[k] = -((2 * s - 1) * t1 + (s - 1) * t2) * inv_r2 / s;
+  }
+}
+}
+
+// Calculate FMM forces
+// multipoles M_m = sum_j m_j (c - x_j)^m about the center of mass c of a cell
+// locals L_n with potential(c + u) = sum_n L_n u^n
+// 1. octree and multipoles, deepest level first (P2M, M2M)
+// 2. every cell walks the source tree along its own ancestors, so each cell
+//    takes exactly the M2L translations its ancestors did not take, leaves
+//    also sum their near cells directly (P2P)
+// 3. locals are shifted down the tree (L2L) and evaluated (L2P)
+template <class vecT, typename T>
+void accumulate_forces_fmm(System<vecT> &system, std::vector<vecT> &accel,
+                           T theta, int p) {
+  using Node = BHNode<vecT>;
+  static constexpr int max_nc = fmm_ncoef(fmm_max_order);
+  p = std::clamp(p, 1, fmm_max_order);
+  const int nc = fmm_ncoef(p);
+  const FMMTables &tables = fmm_tables(p);
+  const int num_terms = tables.terms.size();
+
+  FmmBuffers<vecT> &work = system.workspace.fmm;
+  BHTree<vecT> &tree = system.workspace.tree;
+  build_octree(system, tree);
+  const int num_nodes = tree.nodes.size();
+  const int num_levels = tree.level_start.size() - 1;
+
+  std::vector<double> &multipoles = work.multipoles;
+  std::vector<double> &locals = work.locals;
+  std::vector<double> &radius = work.radius;
+  std::vector<vecT> &sorted_acc = work.sorted_acc;
+  // resize grows the capacity geometrically, assign would reallocate
+  // whenever the tree gains a node
+  multipoles.resize(size_t(num_nodes) * nc);
+  locals.resize(size_t(num_nodes) * nc);
+  radius.resize(num_nodes);
+  sorted_acc.resize(tree.pos.size());
+  std::fill(std::execution::par_unseq, std::begin(multipoles), std::end(multipoles), 0.0);
+  std::fill(std::execution::par_unseq, std::begin(locals), std::end(locals), 0.0);
+  std::fill(std::execution::par_unseq, std::begin(radius), std::end(radius), 0.0);
+  std::fill(std::execution::par_unseq, std::begin(sorted_acc), std::end(sorted_acc), vecT());
+
+  Node const *nodeptr = tree.nodes.data();
+  vecT const *sposptr = tree.pos.data();
+  T const *smssptr = tree.mss.data();
+  FMMCoef const *coefptr = tables.coefs.data();
+  FMMTerm const *termptr = tables.terms.data();
+  double *mulptr = multipoles.data();
+  double *locptr = locals.data();
+  double *radptr = radius.data();
+  vecT *saccptr = sorted_acc.data();
+
+  // P2M, M2M and cell radii
+  for (int l = num_levels - 1; l >= 0; l--) {
+    std::for_each(std::execution::par_unseq, nodeptr + tree.level_start[l],
+                  nodeptr + tree.level_start[l + 1], [=](const Node &node) {
+                    const int a = &node - nodeptr;
+                    double *mul = mulptr + size_t(a) * nc;
+                    double mono[max_nc];
+                    double rad{0.0};
+                    if (node.first_child < 0) {
+                      for (int j = node.begin; j < node.end; j++) {
+                        const FMMOffset<vecT> w(sposptr[j], node.com);
+                        rad = std::max(rad, w.magnitude());
+                        fmm_monomials(-w.x, -w.y, -w.z, nc, coefptr, mono);
+                        for (int k = 0; k < nc; k++)
+                          mul[k] += smssptr[j] * mono[k];
+                      }
+                    } else {
+                      for (int ch = node.first_child; ch < node.child_end; ch++) {
+                        const FMMOffset<vecT> d(nodeptr[ch].com, node.com);
+                        rad = std::max(rad, d.magnitude() + radptr[ch]);
+                        // M_{k+e} += C(k+e, k) M_k(child) (-d)^e
+                        const double *cmul = mulptr + size_t(ch) * nc;
+                        fmm_monomials(-d.x, -d.y, -d.z, nc, coefptr, mono);
+                        for (int t = 0; t < num_terms; t++) {
+                          const FMMTerm &term = termptr[t];
+                          mul[term.nm] += term.c * cmul[term.n] * mono[term.m];
+                        }
+                      }
+                    }
+                    radptr[a] = rad;
+                  });
+  }
+
+  // M2L and P2P
+  const double theta_sq = double(theta) * theta;
+  std::for_each(
+      std::execution::par_unseq, nodeptr, nodeptr + num_nodes,
+      [=](const Node &node) {
+        const int a = &node - nodeptr;
+        // ancestors of a, anc[d] sits at depth d
+        int anc[bh_max_depth + 1];
+        int depth = 0;
+        for (int n = a; n >= 0; n = nodeptr[n].parent)
+          anc[depth++] = n;
+        std::reverse(anc, anc + depth);
+        depth--;
+
+        const bool leaf = node.first_child < 0;
+        double *loc = locptr + size_t(a) * nc;
+        double taylor[max_nc];
+        int stack_node[fmm_stack_size];
+        int stack_depth[fmm_stack_size];
+        int sp = 0;
+        stack_node[sp] = 0;
+        stack_depth[sp++] = 0;
+        while (sp > 0) {
+          const int b = stack_node[--sp];
+          const int d = stack_depth[sp];
+          const Node &target = nodeptr[anc[d]];
+          const Node &source = nodeptr[b];
+          const double rx = double(target.com.x) - source.com.x;
+          const double ry = double(target.com.y) - source.com.y;
+          const double rz = double(target.com.z) - source.com.z;
+          const double rsum = radptr[anc[d]] + radptr[b];
+          if (rsum * rsum < theta_sq * (rx * rx + ry * ry + rz * rz)) {
+            // ancestors above depth already translated source
+            if (d < depth)
+              continue;
+            // L_n += C(n+m, m) a_{n+m}(R) M_m
+            const double *mul = mulptr + size_t(b) * nc;
+            fmm_taylor(rx, ry, rz, nc, coefptr, taylor);
+            for (int t = 0; t < num_terms; t++) {
+              const FMMTerm &term = termptr[t];
+              loc[term.n] += term.c * taylor[term.nm] * mul[term.m];
+            }
+            continue;
+          }
+          if (d < depth || leaf) {
+            // leaf targets keep descending the source tree only
+            const int next = d < depth ? d + 1 : d;
+            if (source.first_child < 0) {
+              if (d < depth) {
+                stack_node[sp] = b;
+                stack_depth[sp++] = next;
+              } else {
+                for (int i = node.begin; i < node.end; i++) {
+                  double acc[3] = {0.0, 0.0, 0.0};
+                  for (int j = source.begin; j < source.end; j++)
+                    fmm_p2p(sposptr[i], sposptr[j], smssptr[j], acc);
+                  saccptr[i] += vecT(T(acc[0]), T(acc[1]), T(acc[2]));
+                }
+              }
+            } else {
+              for (int ch = source.first_child; ch < source.child_end; ch++) {
+                stack_node[sp] = ch;
+                stack_depth[sp++] = next;
+              }
+            }
+          }
+        }
+      });
+
+  // L2L
+  for (int l = 1; l < num_levels; l++) {
+    std::for_each(std::execution::par_unseq, nodeptr + tree.level_start[l],
+                  nodeptr + tree.level_start[l + 1], [=](const Node &node) {
+                    // L_k += C(k+e, k) L_{k+e}(parent) s^e
+                    const double *ploc = locptr + size_t(node.parent) * nc;
+                    double *loc = locptr + size_t(&node - nodeptr) * nc;
+                    const FMMOffset<vecT> s(node.com, nodeptr[node.parent].com);
+                    double mono[max_nc];
+                    fmm_monomials(s.x, s.y, s.z, nc, coefptr, mono);
+                    for (int t = 0; t < num_terms; t++) {
+                      const FMMTerm &term = termptr[t];
+                      loc[term.n] += term.c * ploc[term.nm] * mono[term.m];
+                    }
+                  });
+  }
+
+  // L2P and scatter back into system order
+  vecT *accptr = accel.data();
+  int const *ordptr = tree.order.data();
+  std::for_each(std::execution::par_unseq, nodeptr, nodeptr + num_nodes,
+                [=](const Node &node) {
+                  if (node.first_child >= 0)
+                    return;
+                  const double *loc = locptr + size_t(&node - nodeptr) * nc;
+                  double mono[max_nc];
+                  for (int i = node.begin; i < node.end; i++) {
+                    // acceleration = grad sum_n L_n u^n
+                    const FMMOffset<vecT> u(sposptr[i], node.com);
+                    fmm_monomials(u.x, u.y, u.z, nc, coefptr, mono);
+                    double acc[3] = {0.0, 0.0, 0.0};
+                    for (int k = 0; k < nc; k++) {
+                      const FMMCoef &coef = coefptr[k];
+                      for (int dim = 0; dim < 3; dim++) {
+                        const int n = coef.plus1[dim];
+                        if (n >= 0)
+                          acc[dim] += (coef.exponent[dim] + 1) * mono[k] * loc[n];
+                      }
+                    }
+                    accptr[ordptr[i]] =
+                        saccptr[i] + vecT(T(acc[0]), T(acc[1]), T(acc[2]));
+                  }
+                });
+}
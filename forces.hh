@@ -0,0 +1,29 @@
+
+#pragma once
+
+#include "system.hh"
+#include <vector>
+
+// Calculate forces with the force engine selected in system
+template <class vecT>
+void compute_forces(System<vecT> &system, std::vector<vecT> &accel);
+template <class vecT, typename T>
+void compute_forces(SystemSoA<vecT> &system, Vec3SoA<T> &accel);
+
+// Calculate forces on the particles listed in active only, used by the
+// block time step integrator
+// engines without an active-subset kernel evaluate all particles
+template <class vecT>
+void compute_forces(System<vecT> &system, std::vector<vecT> &accel,
+                    const std::vector<int> &active);
+
+// Calculate forces into sysAcc and kick the velocities by dt in the same
+// pass, Vel += Acc * dt
+// the direct, tiled and Barnes-Hut kernels kick while storing the forces,
+// the other engines and MPI runs use a separate kick pass
+template <class vecT, typename T>
+void compute_forces_kick(System<vecT> &system, T dt);
+template <class vecT, typename T>
+void compute_forces_kick(SystemSoA<vecT> &system, T dt);
+
+#include "forces_impl.hh"
@@ -0,0 +1,167 @@
+
+#pragma once
+
+#include <vector>
+#include "barnes_hut.hh"
+#include "distributed.hh"
+#include "fmm.hh"
+#include "forces.hh"
+#include "instrumentation.hh"
+#include "mixed_precision.hh"
+#include "particle_mesh.hh"
+#include "physics.hh"
+#include "simd_kernels.hh"
+
+// Calculate forces with the force engine selected in system
+// mixed and kahan sums only exist as a direct kernel, setup switches other
+// engines to direct or to single precision sums
+inline bool use_mixed_precision(ForceEngine engine, Precision precision) {
+  return precision != Precision::single && engine == ForceEngine::direct;
+}
+
+// engines that evaluate every pair
+inline bool all_pairs(ForceEngine engine) {
+  return engine != ForceEngine::barnes_hut && engine != ForceEngine::fmm &&
+         engine != ForceEngine::pm && engine != ForceEngine::p3m;
+}
+
+// potential buffer of the force pass if diagnostics asked for one, only the
+// direct kernel stores potentials, see diagnostics.hh
+template <class vecT>
+typename vecT::value_type *potential_target(System<vecT> &system) {
+  if (!system.want_potential)
+    return nullptr;
+  system.workspace.output.potential.resize(system.sysPos.size());
+  system.has_potential = true;
+  return system.workspace.output.potential.data();
+}
+
+template <class vecT>
+void compute_forces(System<vecT> &system, std::vector<vecT> &accel) {
+#ifdef ENABLE_MPI
+  if (system.num_ranks > 1) {
+    NBODY_COUNT("force_targets", system.sysPos.size());
+    NBODY_COUNT("interactions", uint64_t(system.sysPos.size()) * system.num_bodies);
+    accumulate_forces_ring(system, accel);
+    return;
+  }
+#endif
+  // tree and mesh engines only count targets, their interactions depend on
+  // theta and on the mesh
+  NBODY_COUNT("force_targets", system.sysPos.size());
+  // the symmetric kernel evaluates each pair once
+  [[maybe_unused]] const uint64_t n = system.sysPos.size();
+  if (system.engine == ForceEngine::symmetric)
+    NBODY_COUNT("interactions", n * (n - 1) / 2);
+  else if (all_pairs(system.engine))
+    NBODY_COUNT("interactions", n * n);
+  if (use_mixed_precision(system.engine, system.precision)) {
+    accumulate_forces_mixed(system, accel, system.precision);
+    return;
+  }
+  switch (system.engine) {
+  case ForceEngine::barnes_hut:
+    accumulate_forces_bh(system, accel, system.theta);
+    break;
+  case ForceEngine::fmm:
+    accumulate_forces_fmm(system, accel, system.theta, system.fmm_order);
+    break;
+  case ForceEngine::pm:
+  case ForceEngine::p3m:
+    accumulate_forces_pm(system, accel, system.pm_grid, system.pm_assignment,
+                         system.pm_split, system.engine == ForceEngine::p3m);
+    break;
+  case ForceEngine::tiled:
+    accumulate_forces_tiled(system, accel, system.tile_i, system.tile_j);
+    break;
+  case ForceEngine::simd:
+    accumulate_forces_simd(system, accel, system.simd_isa);
+    break;
+  case ForceEngine::symmetric:
+    accumulate_forces_symmetric(system, accel);
+    break;
+  case ForceEngine::direct:
+  default:
+    accumulate_forces(system, accel, {}, potential_target(system));
+    break;
+  }
+}
+
+// SoA layout only has the direct and SIMD engines
+template <class vecT, typename T>
+void compute_forces(SystemSoA<vecT> &system, Vec3SoA<T> &accel) {
+  NBODY_COUNT("force_targets", system.sysMss.size());
+  NBODY_COUNT("interactions", uint64_t(system.sysMss.size()) * system.sysMss.size());
+  if (system.engine == ForceEngine::simd)
+    accumulate_forces_simd(system, accel, system.simd_isa);
+  else
+    accumulate_forces(system, accel);
+}
+
+template <class vecT>
+void compute_forces(System<vecT> &system, std::vector<vecT> &accel,
+                    const std::vector<int> &active) {
+  NBODY_COUNT("force_targets", active.size());
+  if (all_pairs(system.engine))
+    NBODY_COUNT("interactions", uint64_t(active.size()) * system.sysPos.size());
+  if (use_mixed_precision(system.engine, system.precision)) {
+    accumulate_forces_mixed(system, accel, system.precision, active);
+    return;
+  }
+  switch (system.engine) {
+  case ForceEngine::barnes_hut:
+    accumulate_forces_bh(system, accel, system.theta, active);
+    break;
+  case ForceEngine::simd:
+    accumulate_forces_simd(system, accel, system.simd_isa, active);
+    break;
+  case ForceEngine::tiled:
+    accumulate_forces_tiled(system, accel, system.tile_i, system.tile_j, active);
+    break;
+  case ForceEngine::direct:
+    accumulate_forces(system, accel, active);
+    break;
+  default:
+    compute_forces(system, accel);
+    break;
+  }
+}
+
+template <class vecT, typename T>
+void compute_forces_kick(System<vecT> &system, T dt) {
+  const FusedKick<vecT> kick{system.sysVel.data(), static_cast<float>(dt)};
+  const bool fused = system.num_ranks == 1 &&
+                     !use_mixed_precision(system.engine, system.precision) &&
+                     (system.engine == ForceEngine::direct ||
+                      system.engine == ForceEngine::tiled ||
+                      system.engine == ForceEngine::barnes_hut);
+  if (!fused) {
+    compute_forces(system, system.sysAcc);
+    update_velocities(system, dt);
+    return;
+  }
+  NBODY_COUNT("force_targets", system.sysPos.size());
+  if (system.engine != ForceEngine::barnes_hut)
+    NBODY_COUNT("interactions", uint64_t(system.sysPos.size()) * system.sysPos.size());
+  if (system.engine == ForceEngine::barnes_hut)
+    accumulate_forces_bh(system, system.sysAcc, system.theta, kick);
+  else if (system.engine == ForceEngine::tiled)
+    accumulate_forces_tiled(system, system.sysAcc, system.tile_i, system.tile_j,
+                            -1, kick);
+  else
+    accumulate_forces(system, system.sysAcc, kick, potential_target(system));
+}
+
+template <class vecT, typename T>
+void compute_forces_kick(SystemSoA<vecT> &system, T dt) {
+  using U = typename vecT::value_type;
+  if (system.engine == ForceEngine::simd) {
+    compute_forces(system, system.sysAcc);
+    update_velocities(system, dt);
+    return;
+  }
+  NBODY_COUNT("force_targets", system.sysMss.size());
+  NBODY_COUNT("interactions", uint64_t(system.sysMss.size()) * system.sysMss.size());
+  accumulate_forces(system, system.sysAcc,
+                    FusedKick<Vec3SoA<U>>{&system.sysVel, static_cast<float>(dt)});
+}
@@ -0,0 +1,62 @@
+
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Hot path instrumentation
+// build with -DENABLE_INSTRUMENTATION:BOOL=ON (defines NBODY_INSTRUMENT) to
+// record scoped phase timers and counters, the macros expand to nothing
+// otherwise
+//   NBODY_TIMER("phase")          times the enclosing scope
+//   NBODY_COUNT("counter", value) adds value to a counter
+// phases are aggregated per run into a summary table and every timed scope
+// becomes an event of a Chrome trace (chrome://tracing, ui.perfetto.dev)
+// timers and counters record into buffers of their thread without locking,
+// the report merges them and must run while no timer does
+// hardware counters (cycles, instructions, cache misses) come from
+// perf_event_open and count the thread that runs the timed scope
+
+#ifdef NBODY_INSTRUMENT
+
+#include <chrono>
+
+// Times the enclosing scope, records it as phase name on destruction
+class ScopedTimer {
+public:
+  explicit ScopedTimer(const char *name);
+  ~ScopedTimer();
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+  uint64_t hw_start[3];
+};
+
+#define NBODY_CONCAT_(a, b) a##b
+#define NBODY_CONCAT(a, b) NBODY_CONCAT_(a, b)
+#define NBODY_TIMER(name) ScopedTimer NBODY_CONCAT(nbody_timer_, __LINE__)(name)
+#define NBODY_COUNT(name, value) instrumentation_count(name, value)
+
+// Add value to counter name
+void instrumentation_count(const char *name, uint64_t value);
+
+#else
+
+#define NBODY_TIMER(name) ((void)0)
+#define NBODY_COUNT(name, value) ((void)0)
+
+#endif
+
+// Start counting hardware events for the timed phases, returns false if
+// perf_event_open is unavailable or instrumentation is disabled
+bool instrumentation_enable_hw_counters();
+
+// Print the summary table to out and write the Chrome trace to trace_file
+// (skipped if empty), does nothing if instrumentation is disabled
+void instrumentation_report(std::ostream &out, const std::string &trace_file);
+
+#include "instrumentation_impl.hh"
@@ -0,0 +1,276 @@
+
+#pragma once
+
+#include "instrumentation.hh"
+
+#ifdef NBODY_INSTRUMENT
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+// trace events of a thread beyond this are dropped, the summary keeps
+// counting
+static constexpr size_t max_trace_events = 1 << 20;
+static constexpr int num_hw_counters = 3;
+static constexpr const char *hw_counter_names[num_hw_counters] = {
+    "cycles", "instructions", "cache_misses"};
+
+struct PhaseStats {
+  uint64_t calls{0};
+  double total_us{0.0};
+  double min_us{0.0};
+  double max_us{0.0};
+  uint64_t hw[num_hw_counters]{};
+};
+
+struct TraceEvent {
+  const char *name;
+  int tid;
+  double ts_us;
+  double dur_us;
+};
+
+// record of the timers and counters of one thread, only written by its
+// thread; phases are keyed by the address of their name literal
+struct ThreadRecord {
+  int tid{0};
+  std::map<const char *, PhaseStats> phases;
+  std::map<const char *, uint64_t> counters;
+  std::vector<TraceEvent> events;
+};
+
+// records of all threads of a run, the registry lock is only taken when a
+// thread records its first timer and by the report
+struct Instrumentation {
+  std::mutex mutex;
+  std::chrono::steady_clock::time_point origin{std::chrono::steady_clock::now()};
+  std::vector<std::unique_ptr<ThreadRecord>> threads;
+  bool hw_enabled{false};
+};
+
+inline Instrumentation &instrumentation() {
+  static Instrumentation inst;
+  return inst;
+}
+
+// record of the calling thread, owned by the registry so that it outlives
+// the thread
+inline ThreadRecord &thread_record() {
+  thread_local ThreadRecord *record = [] {
+    Instrumentation &inst = instrumentation();
+    std::lock_guard<std::mutex> lock(inst.mutex);
+    inst.threads.push_back(std::make_unique<ThreadRecord>());
+    inst.threads.back()->tid = inst.threads.size() - 1;
+    return inst.threads.back().get();
+  }();
+  return *record;
+}
+
+#if defined(__linux__)
+// perf event file descriptors of the calling thread, -1 if not opened
+struct HwCounters {
+  int fd[num_hw_counters]{-1, -1, -1};
+  HwCounters() {
+    if (!instrumentation().hw_enabled)
+      return;
+    const uint64_t configs[num_hw_counters] = {PERF_COUNT_HW_CPU_CYCLES,
+                                               PERF_COUNT_HW_INSTRUCTIONS,
+                                               PERF_COUNT_HW_CACHE_MISSES};
+    for (int c = 0; c < num_hw_counters; c++) {
+      perf_event_attr attr{};
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = configs[c];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+  }
+  ~HwCounters() {
+    for (int c = 0; c < num_hw_counters; c++)
+      if (fd[c] >= 0)
+        close(fd[c]);
+  }
+  void read_all(uint64_t *values) const {
+    for (int c = 0; c < num_hw_counters; c++) {
+      values[c] = 0;
+      if (fd[c] >= 0 && read(fd[c], &values[c], sizeof(uint64_t)) != sizeof(uint64_t))
+        values[c] = 0;
+    }
+  }
+};
+
+inline const HwCounters &thread_hw_counters() {
+  thread_local HwCounters counters;
+  return counters;
+}
+#endif
+
+inline void read_hw_counters(uint64_t *values) {
+#if defined(__linux__)
+  if (instrumentation().hw_enabled) {
+    thread_hw_counters().read_all(values);
+    return;
+  }
+#endif
+  std::fill(values, values + num_hw_counters, 0);
+}
+
+inline std::string json_escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out;
+}
+}
+
+inline ScopedTimer::ScopedTimer(const char *name)
+    : name(name), start(std::chrono::steady_clock::now()) {
+  read_hw_counters(hw_start);
+}
+
+inline ScopedTimer::~ScopedTimer() {
+  uint64_t hw_end[num_hw_counters];
+  read_hw_counters(hw_end);
+  const auto stop = std::chrono::steady_clock::now();
+  Instrumentation &inst = instrumentation();
+  const double dur_us =
+      std::chrono::duration<double, std::micro>(stop - start).count();
+  const double ts_us =
+      std::chrono::duration<double, std::micro>(start - inst.origin).count();
+
+  ThreadRecord &record = thread_record();
+  PhaseStats &stats = record.phases[name];
+  stats.min_us = stats.calls ? std::min(stats.min_us, dur_us) : dur_us;
+  stats.max_us = std::max(stats.max_us, dur_us);
+  stats.total_us += dur_us;
+  stats.calls++;
+  for (int c = 0; c < num_hw_counters; c++)
+    stats.hw[c] += hw_end[c] - hw_start[c];
+
+  if (record.events.size() < max_trace_events)
+    record.events.push_back({name, record.tid, ts_us, dur_us});
+}
+
+inline void instrumentation_count(const char *name, uint64_t value) {
+  thread_record().counters[name] += value;
+}
+
+inline bool instrumentation_enable_hw_counters() {
+#if defined(__linux__)
+  Instrumentation &inst = instrumentation();
+  inst.hw_enabled = true;
+  if (thread_hw_counters().fd[0] >= 0)
+    return true;
+  inst.hw_enabled = false;
+  std::cout << "WARNING: perf_event_open failed, hardware counters disabled\n";
+#endif
+  return false;
+}
+
+inline void instrumentation_report(std::ostream &out,
+                                   const std::string &trace_file) {
+  Instrumentation &inst = instrumentation();
+  std::lock_guard<std::mutex> lock(inst.mutex);
+
+  // merge the records of all threads by name
+  std::map<std::string, PhaseStats> merged;
+  std::map<std::string, uint64_t> counters;
+  std::vector<TraceEvent> events;
+  for (const auto &record : inst.threads) {
+    for (const auto &[name, stats] : record->phases) {
+      PhaseStats &total = merged[name];
+      total.min_us = total.calls ? std::min(total.min_us, stats.min_us) : stats.min_us;
+      total.max_us = std::max(total.max_us, stats.max_us);
+      total.total_us += stats.total_us;
+      total.calls += stats.calls;
+      for (int c = 0; c < num_hw_counters; c++)
+        total.hw[c] += stats.hw[c];
+    }
+    for (const auto &[name, value] : record->counters)
+      counters[name] += value;
+    events.insert(events.end(), record->events.begin(), record->events.end());
+  }
+  std::sort(events.begin(), events.end(),
+            [](const TraceEvent &a, const TraceEvent &b) { return a.ts_us < b.ts_us; });
+
+  // phases by total time, percentages of the longest (usually advance)
+  std::vector<std::pair<std::string, PhaseStats>> phases(merged.begin(),
+                                                         merged.end());
+  std::sort(phases.begin(), phases.end(), [](const auto &a, const auto &b) {
+    return a.second.total_us > b.second.total_us;
+  });
+  const double reference = phases.empty() ? 1.0 : phases[0].second.total_us;
+
+  out << "\nphase                     calls    total ms     mean ms      max ms      %";
+  if (inst.hw_enabled)
+    out << "        cycles  instructions    IPC  cache_misses";
+  out << "\n" << std::fixed;
+  for (const auto &[name, stats] : phases) {
+    out << std::left << std::setw(22) << name << std::right << std::setw(10)
+        << stats.calls << std::setprecision(3) << std::setw(12)
+        << stats.total_us * 1e-3 << std::setw(12)
+        << stats.total_us * 1e-3 / stats.calls << std::setw(12)
+        << stats.max_us * 1e-3 << std::setprecision(1) << std::setw(7)
+        << 100.0 * stats.total_us / reference;
+    if (inst.hw_enabled)
+      out << std::setw(14) << stats.hw[0] << std::setw(14) << stats.hw[1]
+          << std::setprecision(2) << std::setw(7)
+          << (stats.hw[0] ? double(stats.hw[1]) / stats.hw[0] : 0.0)
+          << std::setw(14) << stats.hw[2];
+    out << "\n";
+  }
+  out << std::defaultfloat;
+  for (const auto &[name, value] : counters)
+    out << std::left << std::setw(22) << name << std::right << std::setw(22)
+        << value << "\n";
+
+  if (trace_file.empty())
+    return;
+  std::ofstream trace(trace_file);
+  trace << std::setprecision(15);
+  trace << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (size_t e = 0; e < events.size(); e++) {
+    const TraceEvent &event = events[e];
+    trace << (e ? ",\n" : "\n") << "{\"name\": \"" << json_escape(event.name)
+          << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.tid
+          << ", \"ts\": " << event.ts_us << ", \"dur\": " << event.dur_us << "}";
+  }
+  trace << "\n], \"otherData\": {";
+  bool first = true;
+  for (const auto &[name, value] : counters) {
+    trace << (first ? "" : ", ") << "\"" << json_escape(name) << "\": " << value;
+    first = false;
+  }
+  for (const auto &[name, stats] : merged)
+    for (int c = 0; inst.hw_enabled && c < num_hw_counters; c++) {
+      trace << (first ? "" : ", ") << "\"" << json_escape(name) << "."
+            << hw_counter_names[c] << "\": " << stats.hw[c];
+      first = false;
+    }
+  trace << "}}\n";
+  out << "trace written to " << trace_file << "\n";
+}
+
+#else
+
+inline bool instrumentation_enable_hw_counters() { return false; }
+
+inline void instrumentation_report(std::ostream &, const std::string &) {}
+
+#endif
@@ -1,17 +1,302 @@
 
 #include <chrono>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "distributed.hh"
+#include "ensemble.hh"
+#include "instrumentation.hh"
+#include "numa.hh"
 #include "system.hh"
 #include "vec.hh"
 
 template <typename T> using vecT = Vec3<T>;
 
+// Parse --key=value options into config
+// returns false if a non-option argument is found
+bool parse_options(int argc, char *argv[], Config &config) {
+  bool options_only = true;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg(argv[i]);
+    const auto eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      options_only = false;
+      continue;
+    }
+    const std::string key = arg.substr(2, eq - 2);
+    const std::string value = arg.substr(eq + 1);
+    if (key == "engine") {
+      if (value == "direct")
+        config.engine = ForceEngine::direct;
+      else if (value == "bh" || value == "barnes-hut")
+        config.engine = ForceEngine::barnes_hut;
+      else if (value == "fmm")
+        config.engine = ForceEngine::fmm;
+      else if (value == "tiled")
+        config.engine = ForceEngine::tiled;
+      else if (value == "simd")
+        config.engine = ForceEngine::simd;
+      else if (value == "symmetric")
+        config.engine = ForceEngine::symmetric;
+      else if (value == "pm")
+        config.engine = ForceEngine::pm;
+      else if (value == "p3m")
+        config.engine = ForceEngine::p3m;
+      else
+        std::cout << "WARNING: unknown force engine " << value << "\n";
+    } else if (key == "precision") {
+      if (value == "single")
+        config.precision = Precision::single;
+      else if (value == "mixed")
+        config.precision = Precision::mixed;
+      else if (value == "kahan")
+        config.precision = Precision::kahan;
+      else
+        std::cout << "WARNING: unknown precision " << value << "\n";
+    } else if (key == "positions") {
+      if (value == "float")
+        config.double_positions = false;
+      else if (value == "double")
+        config.double_positions = true;
+      else
+        std::cout << "WARNING: unknown position precision " << value << "\n";
+    } else if (key == "integrator") {
+      if (value == "verlet")
+        config.integrator = Integrator::verlet;
+      else if (value == "block")
+        config.integrator = Integrator::block;
+      else if (value == "fused")
+        config.integrator = Integrator::fused;
+      else if (value == "hermite")
+        config.integrator = Integrator::hermite;
+      else if (value == "yoshida" || value == "forest-ruth")
+        config.integrator = Integrator::yoshida;
+      else
+        std::cout << "WARNING: unknown integrator " << value << "\n";
+    } else if (key == "block-levels") {
+      config.block_levels = std::stoi(value);
+    } else if (key == "block-eta") {
+      config.block_eta = std::stof(value);
+    } else if (key == "theta") {
+      config.theta = std::stof(value);
+    } else if (key == "fmm-order") {
+      config.fmm_order = std::stoi(value);
+    } else if (key == "pm-grid") {
+      config.pm_grid = std::stoi(value);
+    } else if (key == "pm-assignment") {
+      if (value == "cic")
+        config.pm_assignment = MassAssignment::cic;
+      else if (value == "tsc")
+        config.pm_assignment = MassAssignment::tsc;
+      else
+        std::cout << "WARNING: unknown mass assignment " << value << "\n";
+    } else if (key == "pm-split") {
+      config.pm_split = std::stof(value);
+    } else if (key == "tile-i") {
+      config.tile_i = std::stoi(value);
+    } else if (key == "tile-j") {
+      config.tile_j = std::stoi(value);
+    } else if (key == "simd") {
+      if (value == "auto")
+        config.simd_isa = SimdIsa::automatic;
+      else if (value == "scalar")
+        config.simd_isa = SimdIsa::scalar;
+      else if (value == "sse")
+        config.simd_isa = SimdIsa::sse;
+      else if (value == "avx2")
+        config.simd_isa = SimdIsa::avx2;
+      else if (value == "avx512")
+        config.simd_isa = SimdIsa::avx512;
+      else
+        std::cout << "WARNING: unknown SIMD instruction set " << value << "\n";
+    } else if (key == "output") {
+      if (value == "none")
+        config.output = OutputFormat::none;
+      else if (value == "text")
+        config.output = OutputFormat::text;
+      else if (value == "binary")
+        config.output = OutputFormat::binary;
+      else if (value == "both")
+        config.output = OutputFormat::both;
+      else
+        std::cout << "WARNING: unknown output format " << value << "\n";
+    } else if (key == "output-queue") {
+      config.output_queue = std::stoi(value);
+    } else if (key == "checkpoint-interval") {
+      config.checkpoint_interval = std::stoi(value);
+    } else if (key == "checkpoint-file") {
+      config.checkpoint_file = value;
+    } else if (key == "restart") {
+      config.restart_file = value;
+    } else if (key == "trace-file" || key == "trace") {
+      config.trace_file = value;
+    } else if (key == "diagnostics") {
+      config.diagnostics = value == "1" || value == "on";
+    } else if (key == "hw-counters") {
+      config.hw_counters = value == "1" || value == "on";
+    } else if (key == "seed") {
+      config.seed = std::stoll(value);
+    } else if (key == "nbodies") {
+      config.nbodies = std::stoi(value);
+    } else if (key == "end-time") {
+      config.end_time = std::stof(value);
+    } else if (key == "timestep") {
+      config.timestep = std::stof(value);
+    } else if (key == "timestep-control") {
+      if (value == "fixed")
+        config.timestep_control = TimestepControl::fixed;
+      else if (value == "acceleration")
+        config.timestep_control = TimestepControl::acceleration;
+      else if (value == "aarseth")
+        config.timestep_control = TimestepControl::aarseth;
+      else
+        std::cout << "WARNING: unknown time step control " << value << "\n";
+    } else if (key == "timestep-eta") {
+      config.timestep_eta = std::stof(value);
+    } else if (key == "timestep-length") {
+      config.timestep_length = std::stof(value);
+    } else if (key == "min-timestep") {
+      config.min_timestep = std::stof(value);
+    } else if (key == "output-interval") {
+      config.output_interval = std::stof(value);
+    } else if (key == "galaxy-mass") {
+      config.galaxy_mass = std::stof(value);
+    } else if (key == "central-mass") {
+      config.central_mass = std::stof(value);
+    } else if (key == "output-prefix") {
+      config.output_prefix = value;
+    } else if (key == "ensemble") {
+      config.ensemble_file = value;
+    } else if (key == "numa") {
+      if (value == "off")
+        config.numa = NumaMode::off;
+      else if (value == "first-touch")
+        config.numa = NumaMode::first_touch;
+      else if (value == "replicate")
+        config.numa = NumaMode::replicate;
+      else
+        std::cout << "WARNING: unknown NUMA mode " << value << "\n";
+    } else if (key == "pin") {
+      if (value == "none")
+        config.pin = ThreadPinning::none;
+      else if (value == "compact")
+        config.pin = ThreadPinning::compact;
+      else if (value == "scatter")
+        config.pin = ThreadPinning::scatter;
+      else
+        std::cout << "WARNING: unknown thread pinning " << value << "\n";
+    } else if (key == "sort") {
+      if (value == "none")
+        config.sort_curve = SortCurve::none;
+      else if (value == "morton")
+        config.sort_curve = SortCurve::morton;
+      else if (value == "hilbert")
+        config.sort_curve = SortCurve::hilbert;
+      else
+        std::cout << "WARNING: unknown sort curve " << value << "\n";
+    } else if (key == "sort-interval") {
+      config.sort_interval = std::stoi(value);
+    } else if (key == "merge-radius") {
+      config.merge_radius = std::stof(value);
+    } else if (key == "layout") {
+      if (value == "aos")
+        config.layout = Layout::aos;
+      else if (value == "soa")
+        config.layout = Layout::soa;
+      else
+        std::cout << "WARNING: unknown layout " << value << "\n";
+    } else {
+      std::cout << "WARNING: unknown option " << arg << "\n";
+    }
+  }
+  return options_only;
+}
+
+// Set up (or restart) and advance a system of type SystemT
+template <class SystemT> void run(Config &config) {
+  // before setup, so that first-touch runs on the pinned threads
+  ThreadPinner pinner(config.pin);
+  SystemT system;
+  if (config.hw_counters)
+    instrumentation_enable_hw_counters();
+  if (config.restart_file.empty())
+    system.setup(config);
+  else
+    system.restart(config);
+  std::cout << "setup done\n";
+
+  auto start = std::chrono::high_resolution_clock::now();
+  system.advance();
+  auto stop = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double, std::milli> fp_ms = stop - start;
+  std::cout << "system.advance() duration (ms): " << fp_ms.count() << std::endl;
+  instrumentation_report(std::cout, config.trace_file);
+}
+
+// Member configs of an ensemble file, one member per line of --key=value
+// options on top of base, # starts a comment
+// members without --output-prefix write to <prefix>member<k>.<file>
+std::vector<Config> read_ensemble(const Config &base) {
+  std::ifstream file(base.ensemble_file);
+  if (!file) {
+    std::cout << "ERROR: cannot open " << base.ensemble_file << ", exiting.\n";
+    exit(1);
+  }
+  std::vector<Config> configs;
+  std::string line;
+  while (std::getline(file, line)) {
+    line = line.substr(0, line.find('#'));
+    std::vector<std::string> args{"grav"};
+    std::stringstream ss(line);
+    for (std::string arg; ss >> arg;)
+      args.push_back(arg);
+    if (args.size() == 1)
+      continue;
+    std::vector<char *> argv;
+    for (std::string &arg : args)
+      argv.push_back(arg.data());
+    Config config = base;
+    config.ensemble_file.clear();
+    parse_options(argv.size(), argv.data(), config);
+    if (config.output_prefix == base.output_prefix)
+      config.output_prefix += "member" + std::to_string(configs.size()) + ".";
+    configs.push_back(config);
+  }
+  if (configs.empty()) {
+    std::cout << "ERROR: " << base.ensemble_file << " lists no members, exiting.\n";
+    exit(1);
+  }
+  return configs;
+}
+
+// Set up and advance the members of config.ensemble_file together
+template <class vecT> void run_ensemble(Config &config) {
+  ThreadPinner pinner(config.pin);
+  std::vector<Config> configs = read_ensemble(config);
+  Ensemble<vecT> ensemble;
+  ensemble.setup(configs);
+  std::cout << "setup done, " << ensemble.members.size() << " members, "
+            << ensemble.num_particles << " particles\n";
+
+  auto start = std::chrono::high_resolution_clock::now();
+  ensemble.advance();
+  auto stop = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double, std::milli> fp_ms = stop - start;
+  std::cout << "ensemble.advance() duration (ms): " << fp_ms.count() << std::endl;
+  instrumentation_report(std::cout, config.trace_file);
+}
+
 int main(int argc, char *argv[]) {
+  distributed_init(argc, argv);
   Config config;
   config.end_time = 10000.0;
   config.timestep = 1.0;
 
-  if (argc > 1) {
+  if (!parse_options(argc, argv, config) && distributed_rank() == 0) {
     std::cout << "Manual parameter entry mode\n";
     std::cout << "Please enter the number of particles you want to simulate (min 64): ";
     std::cin >> config.nbodies;
@@ -25,15 +310,30 @@ int main(int argc, char *argv[]) {
     std::cout << "Please enter the integration timestep (should be a divisor of duration): ";
     std::cin >> config.timestep;
   }
+  distributed_config(config);
+  if (distributed_size() > 1 && config.layout == Layout::soa) {
+    std::cout << "WARNING: MPI runs only support the AoS layout, using aos\n";
+    config.layout = Layout::aos;
+  }
 
-  System<vecT<float>> system;
-  system.setup(config);
-  std::cout << "setup done\n";
-
-  auto start = std::chrono::high_resolution_clock::now();
-  system.advance();
-  auto stop = std::chrono::high_resolution_clock::now();
-
-  std::chrono::duration<double, std::milli> fp_ms = stop - start;
-  std::cout << "system.advance() duration (ms): " << fp_ms.count() << std::endl;
+  if (!config.ensemble_file.empty()) {
+    if (distributed_size() > 1) {
+      std::cout << "ERROR: ensemble runs do not support MPI, exiting.\n";
+      exit(1);
+    }
+    if (config.layout == Layout::soa)
+      std::cout << "WARNING: ensemble runs only support the AoS layout, using aos\n";
+    if (config.double_positions)
+      run_ensemble<vecT<double>>(config);
+    else
+      run_ensemble<vecT<float>>(config);
+  } else if (config.layout == Layout::soa && config.double_positions)
+    run<SystemSoA<vecT<double>>>(config);
+  else if (config.layout == Layout::soa)
+    run<SystemSoA<vecT<float>>>(config);
+  else if (config.double_positions)
+    run<System<vecT<double>>>(config);
+  else
+    run<System<vecT<float>>>(config);
+  distributed_finalize();
 }
\ No newline at end of file
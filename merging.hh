@@ -0,0 +1,54 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "reorder.hh"
+
+// Close encounter merging
+// a pair closer than the capture radius is replaced by one particle at its
+// center of mass with the total mass and momentum, accelerations and jerks
+// are mass weighted (the mutual terms cancel), so the pair no longer caps
+// the time step and N shrinks over a merger run. Neighbours come from a
+// spatial hash of cells two capture radii wide: cell coordinates are hashed
+// into 2^k >= N buckets, the particles are radix sorted by bucket and each
+// one scans the 2^3 cells on its side of its cell, which hold everything
+// inside the radius. A particle merges with its nearest neighbour inside the
+// radius if it is that neighbour's nearest as well, so pairs are disjoint
+// and found without atomics; a cluster of several close particles merges
+// over consecutive steps. The arrays are compacted in order, sysId of a
+// reordered system is renumbered to the rank of the original index among
+// the survivors
+
+template <class vecT> struct System;
+template <class vecT> struct SystemSoA;
+
+// Scratch of the close pair search and the merge
+template <class vecT> struct MergeBuffers {
+  std::vector<uint64_t> hash_keys; // spatial hash bucket of each particle,
+  std::vector<int> hash_order;     // particles sorted by bucket
+  std::vector<int> hash_start;     // first slot of each bucket, then end
+  std::vector<vecT> hash_pos;      // positions in bucket order
+  std::vector<int> partner;        // nearest neighbour inside the capture radius
+  std::vector<int> survivors;      // particles kept by a merge
+  std::vector<int> id_flag;        // surviving ids and their new numbers
+  std::vector<int> id_rank;
+  RadixSortBuffers radix;
+};
+
+// bucket of cell (x, y, z) in a table of mask + 1 buckets, the spatial hash
+// of Teschner et al. (VMV 2003)
+uint64_t cell_hash(int64_t x, int64_t y, int64_t z, uint64_t mask);
+
+// nearest neighbour of every particle closer than radius into
+// workspace.merge.partner (-1 if none), returns the number of mutual pairs
+template <class vecT, typename T>
+int find_close_pairs(System<vecT> &system, T radius);
+
+// merge the mutual pairs closer than system.merge_radius and compact the
+// particle arrays, returns the number of merged pairs; SoA systems do not
+// merge
+template <class vecT> int merge_close_pairs(System<vecT> &system);
+template <class vecT> int merge_close_pairs(SystemSoA<vecT> &system);
+
+#include "merging_impl.hh"
@@ -0,0 +1,180 @@
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <execution>
+#include <numeric>
+#include "instrumentation.hh"
+#include "merging.hh"
+#include "reorder.hh"
+#include "system.hh"
+#include "workspace.hh"
+
+inline uint64_t cell_hash(int64_t x, int64_t y, int64_t z, uint64_t mask) {
+  return (uint64_t(x) * 73856093u ^ uint64_t(y) * 19349663u ^
+          uint64_t(z) * 83492791u) & mask;
+}
+
+template <class vecT, typename T>
+int find_close_pairs(System<vecT> &system, T radius) {
+  using U = typename vecT::value_type;
+  auto &work = system.workspace.merge;
+  const int sys_size = system.sysPos.size();
+  const IndexRange sys_i = index_range(sys_size);
+  const uint64_t mask = std::bit_ceil(unsigned(std::max(sys_size, 1))) - 1;
+  // cells two radii wide, the neighbours inside radius are in the cell of a
+  // particle and the next one towards the nearer face in each dimension
+  const U inv_width = U(0.5) / U(radius);
+  const U radius_sq = U(radius) * U(radius);
+  vecT const *posptr = system.sysPos.data();
+  auto cell = [=](U x) { return int64_t(std::floor(x * inv_width)); };
+  auto side = [=](U x, int64_t c) { return x * inv_width - U(c) < U(0.5) ? -1 : 1; };
+
+  work.hash_keys.resize(sys_size);
+  uint64_t *keyptr = work.hash_keys.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  const vecT p = posptr[i];
+                  keyptr[i] = cell_hash(cell(p.x), cell(p.y), cell(p.z), mask);
+                });
+  radix_sort(work.hash_keys, work.hash_order, work.radix);
+  keyptr = work.hash_keys.data(); // radix_sort may swap the buffers
+  // slot s starts the buckets after the one of slot s - 1 up to its own
+  work.hash_start.resize(mask + 2);
+  int *startptr = work.hash_start.data();
+  const IndexRange slots = index_range(sys_size + 1);
+  std::for_each(std::execution::par_unseq, std::begin(slots), std::end(slots),
+                [=](int s) {
+                  const uint64_t first = s == 0 ? 0 : keyptr[s - 1] + 1;
+                  const uint64_t last = s == sys_size ? mask + 1 : keyptr[s];
+                  for (uint64_t b = first; b <= last; b++)
+                    startptr[b] = s;
+                });
+  // positions in bucket order, a bucket is a contiguous run
+  work.hash_pos.resize(sys_size);
+  vecT *hposptr = work.hash_pos.data();
+  int const *ordptr = work.hash_order.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int s) { hposptr[s] = posptr[ordptr[s]]; });
+
+  // nearest neighbour inside radius, ties go to the lower index
+  work.partner.resize(sys_size);
+  int *partptr = work.partner.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  const vecT p = posptr[i];
+                  const int64_t cx = cell(p.x), cy = cell(p.y), cz = cell(p.z);
+                  const int sx = side(p.x, cx), sy = side(p.y, cy), sz = side(p.z, cz);
+                  U best_sq = radius_sq;
+                  int best = -1;
+                  for (int dx = 0; dx < 2; dx++)
+                    for (int dy = 0; dy < 2; dy++)
+                      for (int dz = 0; dz < 2; dz++) {
+                        // buckets also hold particles of colliding cells
+                        const uint64_t b = cell_hash(cx + dx * sx, cy + dy * sy,
+                                                     cz + dz * sz, mask);
+                        for (int s = startptr[b]; s < startptr[b + 1]; s++) {
+                          const vecT d = hposptr[s] - p;
+                          const U r_sq = dot_product(d);
+                          const int j = ordptr[s];
+                          if (j != i && (r_sq < best_sq || (r_sq == best_sq && j < best))) {
+                            best_sq = r_sq;
+                            best = j;
+                          }
+                        }
+                      }
+                  partptr[i] = best;
+                });
+  return std::transform_reduce(
+      std::execution::par_unseq, std::begin(sys_i), std::end(sys_i), 0,
+      std::plus<>(), [=](int i) {
+        const int j = partptr[i];
+        return int(j > i && partptr[j] == i);
+      });
+}
+
+template <class vecT> int merge_close_pairs(System<vecT> &system) {
+  using T = typename vecT::value_type;
+  const int sys_size = system.sysPos.size();
+  if (system.merge_radius <= 0 || sys_size < 2)
+    return 0;
+  NBODY_TIMER("merge");
+  const int pairs = find_close_pairs(system, system.merge_radius);
+  if (pairs == 0)
+    return 0;
+  auto &work = system.workspace.merge;
+  const IndexRange sys_i = index_range(sys_size);
+  int const *partptr = work.partner.data();
+  // the lower index of a pair survives
+  auto survives = [=](int i) {
+    const int j = partptr[i];
+    return j < 0 || j > i || partptr[j] != i;
+  };
+
+  // combine each pair into its survivor, which only reads its partner
+  vecT *posptr = system.sysPos.data();
+  vecT *velptr = system.sysVel.data();
+  vecT *accptr = system.sysAcc.data();
+  T *mssptr = system.sysMss.data();
+  vecT *jrkptr = system.sysJerk.size() == std::size_t(sys_size) ? system.sysJerk.data() : nullptr;
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  const int j = partptr[i];
+                  if (j <= i || partptr[j] != i)
+                    return;
+                  const T mass = mssptr[i] + mssptr[j];
+                  if (mass <= T(0))
+                    return;
+                  const T wi = mssptr[i] / mass, wj = mssptr[j] / mass;
+                  posptr[i] = posptr[i] * wi + posptr[j] * wj;
+                  velptr[i] = velptr[i] * wi + velptr[j] * wj;
+                  accptr[i] = accptr[i] * wi + accptr[j] * wj;
+                  if (jrkptr)
+                    jrkptr[i] = jrkptr[i] * wi + jrkptr[j] * wj;
+                  mssptr[i] = mass;
+                });
+
+  work.survivors.resize(sys_size);
+  auto survivors_end =
+      std::copy_if(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                   std::begin(work.survivors), survives);
+  work.survivors.resize(survivors_end - std::begin(work.survivors));
+  const int new_size = work.survivors.size();
+
+  // ids stay a permutation of 0 .. new_size - 1 in the original order
+  if (!system.sysId.empty()) {
+    int *idptr = system.sysId.data();
+    work.id_flag.resize(sys_size);
+    work.id_rank.resize(sys_size);
+    int *flagptr = work.id_flag.data();
+    std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                  [=](int i) { flagptr[idptr[i]] = int(survives(i)); });
+    std::exclusive_scan(std::execution::par_unseq, std::begin(work.id_flag),
+                        std::end(work.id_flag), std::begin(work.id_rank), 0);
+    int const *rankptr = work.id_rank.data();
+    std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                  [=](int i) { idptr[i] = rankptr[idptr[i]]; });
+  }
+
+  auto &targets = system.workspace.reorder;
+  const bool numa = system.numa != NumaMode::off;
+  auto compact = [&](auto &values, auto &scratch) {
+    permute(values, work.survivors, scratch, numa);
+    values.resize(new_size);
+  };
+  compact(system.sysPos, targets.sorted_vec);
+  compact(system.sysVel, targets.sorted_vec);
+  compact(system.sysAcc, targets.sorted_vec);
+  if (jrkptr)
+    compact(system.sysJerk, targets.sorted_vec);
+  compact(system.sysMss, targets.sorted_mss);
+  if (!system.sysId.empty())
+    compact(system.sysId, targets.sorted_id);
+  system.num_bodies = new_size;
+  system.has_potential = false; // potentials of the old arrays
+  return pairs;
+}
+
+template <class vecT> int merge_close_pairs(SystemSoA<vecT> &) { return 0; }
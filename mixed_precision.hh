@@ -0,0 +1,27 @@
+
+#pragma once
+
+#include <vector>
+#include "system.hh"
+
+// Mixed precision all-pairs kernel
+// pair distances are taken in the storage precision of the system and
+// rounded to float, the pairwise terms are evaluated in float and summed
+// per target in double (Precision::mixed) or in Kahan compensated float
+// (Precision::kahan)
+// with double positions this keeps the relative distances of particles far
+// from the origin exact while the expensive part stays in float
+
+// Calculate all-pairs forces with the accumulation selected by precision
+template <class vecT>
+void accumulate_forces_mixed(System<vecT> &system, std::vector<vecT> &accel,
+                             Precision precision);
+
+// Calculate forces on the particles listed in active only, the other
+// entries of accel are left unchanged
+template <class vecT>
+void accumulate_forces_mixed(System<vecT> &system, std::vector<vecT> &accel,
+                             Precision precision,
+                             const std::vector<int> &active);
+
+#include "mixed_precision_impl.hh"
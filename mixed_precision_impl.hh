@@ -0,0 +1,159 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <execution>
+#include <numeric>
+#include <vector>
+#include "mixed_precision.hh"
+
+// -ffast-math allows the compiler to reassociate sums, which removes the
+// compensation term of Kahan summation; the Release flags keep strict math
+// (see CMakeLists.txt), the attribute keeps it for the compensated kernel in
+// builds that add -ffast-math themselves
+// GCC does not inline across the attribute, so the pairwise term is written
+// out in both kernels
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__NVCOMPILER)
+#define NBODY_STRICT_SUM __attribute__((optimize("no-associative-math")))
+#else
+#define NBODY_STRICT_SUM
+#endif
+
+namespace {
+// targets summed together, the inner loop is vectorized over them
+static constexpr int mixed_lanes = 16;
+
+// forces on up to mixed_lanes targets, double sums
+template <class vecT, typename T>
+void mixed_block_double(const vecT *posptr, const T *mssptr, int n,
+                        const T *__restrict tx, const T *__restrict ty,
+                        const T *__restrict tz, double *__restrict ax,
+                        double *__restrict ay, double *__restrict az) {
+  for (int b = 0; b < mixed_lanes; b++)
+    ax[b] = ay[b] = az[b] = 0.0;
+  for (int j = 0; j < n; j++) {
+    const T xj = posptr[j].x;
+    const T yj = posptr[j].y;
+    const T zj = posptr[j].z;
+    const float mj = mssptr[j];
+    for (int b = 0; b < mixed_lanes; b++) {
+      // distance in storage precision, rounded to float
+      float fx = static_cast<float>(xj - tx[b]);
+      float fy = static_cast<float>(yj - ty[b]);
+      float fz = static_cast<float>(zj - tz[b]);
+      const float rd_sq = 0.00001f + fx * fx + fy * fy + fz * fz;
+      const float rd_mag = 1.f / std::sqrt(rd_sq);
+      const float impulse = mj * rd_mag * rd_mag * rd_mag;
+      fx *= impulse;
+      fy *= impulse;
+      fz *= impulse;
+      ax[b] += fx;
+      ay[b] += fy;
+      az[b] += fz;
+    }
+  }
+}
+
+// forces on up to mixed_lanes targets, Kahan compensated float sums
+template <class vecT, typename T>
+NBODY_STRICT_SUM void
+mixed_block_kahan(const vecT *posptr, const T *mssptr, int n, const T *tx,
+                  const T *ty, const T *tz, double *ax, double *ay,
+                  double *az) {
+#if defined(__clang__)
+#pragma clang fp reassociate(off)
+#endif
+  float sx[mixed_lanes] = {}, sy[mixed_lanes] = {}, sz[mixed_lanes] = {};
+  float cx[mixed_lanes] = {}, cy[mixed_lanes] = {}, cz[mixed_lanes] = {};
+  for (int j = 0; j < n; j++) {
+    const T xj = posptr[j].x;
+    const T yj = posptr[j].y;
+    const T zj = posptr[j].z;
+    const float mj = mssptr[j];
+    for (int b = 0; b < mixed_lanes; b++) {
+      // distance in storage precision, rounded to float
+      float fx = static_cast<float>(xj - tx[b]);
+      float fy = static_cast<float>(yj - ty[b]);
+      float fz = static_cast<float>(zj - tz[b]);
+      const float rd_sq = 0.00001f + fx * fx + fy * fy + fz * fz;
+      const float rd_mag = 1.f / sqrtf(rd_sq); // std::sqrt is not inlined here
+      const float impulse = mj * rd_mag * rd_mag * rd_mag;
+      fx *= impulse;
+      fy *= impulse;
+      fz *= impulse;
+      // sum += term, c keeps the low order bits lost by the addition
+      const float yx = fx - cx[b];
+      const float yy = fy - cy[b];
+      const float yz = fz - cz[b];
+      const float tsx = sx[b] + yx;
+      const float tsy = sy[b] + yy;
+      const float tsz = sz[b] + yz;
+      cx[b] = (tsx - sx[b]) - yx;
+      cy[b] = (tsy - sy[b]) - yy;
+      cz[b] = (tsz - sz[b]) - yz;
+      sx[b] = tsx;
+      sy[b] = tsy;
+      sz[b] = tsz;
+    }
+  }
+  for (int b = 0; b < mixed_lanes; b++) {
+    ax[b] = sx[b];
+    ay[b] = sy[b];
+    az[b] = sz[b];
+  }
+}
+
+// forces on num_targets targets, particle indices of the targets come from
+// targets, nullptr for 0..num_targets-1
+// use for_each over blocks of mixed_lanes targets to parallelize, a short
+// last block repeats its final target in the unused lanes
+template <class vecT>
+void mixed_forces(System<vecT> &system, std::vector<vecT> &accel,
+                  Precision precision, const int *targets, int num_targets) {
+  using T = typename vecT::value_type;
+  const int sys_size = system.sysPos.size();
+  const IndexRange blocks = index_range((num_targets + mixed_lanes - 1) / mixed_lanes);
+
+  vecT const *posptr = system.sysPos.data();
+  T const *mssptr = system.sysMss.data();
+  vecT *accptr = accel.data();
+  const bool kahan = precision == Precision::kahan;
+  std::for_each(std::execution::par_unseq, std::begin(blocks),
+                std::end(blocks), [=](int blk) {
+                  const int kbegin = blk * mixed_lanes;
+                  const int kend = std::min(kbegin + mixed_lanes, num_targets);
+                  int idx[mixed_lanes];
+                  T tx[mixed_lanes], ty[mixed_lanes], tz[mixed_lanes];
+                  for (int b = 0; b < mixed_lanes; b++) {
+                    const int k = std::min(kbegin + b, kend - 1);
+                    idx[b] = targets ? targets[k] : k;
+                    tx[b] = posptr[idx[b]].x;
+                    ty[b] = posptr[idx[b]].y;
+                    tz[b] = posptr[idx[b]].z;
+                  }
+                  double ax[mixed_lanes], ay[mixed_lanes], az[mixed_lanes];
+                  if (kahan)
+                    mixed_block_kahan(posptr, mssptr, sys_size, tx, ty, tz,
+                                      ax, ay, az);
+                  else
+                    mixed_block_double(posptr, mssptr, sys_size, tx, ty, tz,
+                                       ax, ay, az);
+                  for (int b = 0; b < kend - kbegin; b++)
+                    accptr[idx[b]] = vecT(T(ax[b]), T(ay[b]), T(az[b]));
+                });
+}
+}
+
+template <class vecT>
+void accumulate_forces_mixed(System<vecT> &system, std::vector<vecT> &accel,
+                             Precision precision) {
+  mixed_forces(system, accel, precision, nullptr, system.sysPos.size());
+}
+
+template <class vecT>
+void accumulate_forces_mixed(System<vecT> &system, std::vector<vecT> &accel,
+                             Precision precision,
+                             const std::vector<int> &active) {
+  mixed_forces(system, accel, precision, active.data(), active.size());
+}
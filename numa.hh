@@ -0,0 +1,96 @@
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// NUMA placement of the particle arrays and thread pinning
+// Linux places a page on the node of the thread that touches it first, so
+// arrays filled on the main thread all land on one socket. first_touch
+// reallocates them with the pages touched by a parallel loop over particles,
+// the same shape as the force and update loops, and replication gives the
+// all-pairs kernels a copy of the read-only positions and masses on every
+// node. The topology comes from sysfs and placement from mbind(2), so there
+// is no libnuma dependency
+
+// NUMA placement of the particle arrays
+enum class NumaMode : int {
+  off = 0,         // pages on the node of the thread that set them up
+  first_touch = 1, // pages touched by the threads of the particle loops
+  replicate = 2,   // first_touch, plus per node copies of positions and
+                   // masses for the all-pairs engines
+};
+
+// Placement of the threads of the parallel algorithms
+enum class ThreadPinning : int {
+  none = 0,
+  compact = 1, // fill the cpus node by node
+  scatter = 2, // round robin over the nodes
+};
+
+template <class vecT> struct System;
+template <class vecT> struct SystemSoA;
+
+// nodes and their cpus, a single node with all cpus if sysfs has no nodes
+struct NumaTopology {
+  std::vector<std::vector<int>> node_cpus;
+  std::vector<int> cpu_node; // node of each cpu id
+  int num_nodes() const { return node_cpus.size(); }
+};
+
+const NumaTopology &numa_topology();
+
+// node of the cpu the calling thread runs on
+int numa_current_node();
+
+// bind the whole pages of [addr, addr + bytes) to node, pages that are not
+// yet touched are then allocated there whichever thread touches them
+bool numa_bind(void *addr, std::size_t bytes, int node);
+
+// reallocate values, pages touched by a parallel loop over the elements
+template <typename U, class Alloc> void first_touch(std::vector<U, Alloc> &values);
+
+// first_touch the particle arrays of system
+template <class vecT> void first_touch(System<vecT> &system);
+template <class vecT> void first_touch(SystemSoA<vecT> &system);
+
+// Source arrays of the all-pairs kernels
+// pos[node] and mss[node] are the copies on node if the system is
+// replicated, otherwise pos[0] and mss[0] are sysPos and sysMss
+template <class vecT> struct NodeSources {
+  using T = typename vecT::value_type;
+  vecT const *const *pos;
+  T const *const *mss;
+  bool replicated;
+  int node() const { return replicated ? numa_current_node() : 0; }
+};
+
+// per node copies of the positions and masses and the source arrays of
+// each node
+template <class vecT> struct NumaReplicas {
+  using T = typename vecT::value_type;
+  std::vector<std::vector<vecT>> replica_pos;
+  std::vector<std::vector<T>> replica_mss;
+  std::vector<const vecT *> node_pos;
+  std::vector<const T *> node_mss;
+};
+
+// refresh the replicas of system if it is replicated, once per force pass
+template <class vecT> NodeSources<vecT> node_sources(System<vecT> &system);
+
+// Pins the threads of the parallel algorithms to cpus while alive
+// compact fills the cpus node by node, scatter takes one cpu of each node
+// in turn; TBB backend only
+class ThreadPinner {
+public:
+  explicit ThreadPinner(ThreadPinning policy);
+  ~ThreadPinner();
+  ThreadPinner(const ThreadPinner &) = delete;
+  ThreadPinner &operator=(const ThreadPinner &) = delete;
+
+private:
+  struct Observer;
+  Observer *observer{nullptr};
+};
+
+#include "numa_impl.hh"
@@ -0,0 +1,263 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <execution>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "instrumentation.hh"
+#include "numa.hh"
+#include "workspace.hh"
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if !defined(ENABLE_CUDA) && !defined(ENABLE_ACPP)
+#include <tbb/task_scheduler_observer.h>
+#endif
+
+namespace {
+// ids in a sysfs list such as "0-3,8-11"
+inline std::vector<int> parse_id_list(const std::string &list) {
+  std::vector<int> ids;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.empty() || item == "\n")
+      continue;
+    const auto dash = item.find('-');
+    const int first = std::stoi(item.substr(0, dash));
+    const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+    for (int id = first; id <= last; id++)
+      ids.push_back(id);
+  }
+  return ids;
+}
+
+inline std::string read_sysfs(const std::string &path) {
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+inline NumaTopology read_numa_topology() {
+  NumaTopology topology;
+  const std::string root = "/sys/devices/system/node/";
+  for (int node : parse_id_list(read_sysfs(root + "online"))) {
+    if (node >= int(topology.node_cpus.size()))
+      topology.node_cpus.resize(node + 1);
+    topology.node_cpus[node] =
+        parse_id_list(read_sysfs(root + "node" + std::to_string(node) + "/cpulist"));
+  }
+  if (topology.node_cpus.empty()) {
+    topology.node_cpus.resize(1);
+    const int num_cpus = std::max(1u, std::thread::hardware_concurrency());
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+      topology.node_cpus[0].push_back(cpu);
+  }
+  for (int node = 0; node < topology.num_nodes(); node++)
+    for (int cpu : topology.node_cpus[node]) {
+      if (cpu >= int(topology.cpu_node.size()))
+        topology.cpu_node.resize(cpu + 1, 0);
+      topology.cpu_node[cpu] = node;
+    }
+  return topology;
+}
+
+// copy src into replica, a new replica buffer is bound to node before its
+// pages are touched
+template <typename U>
+void replicate_on_node(const std::vector<U> &src, std::vector<U> &replica,
+                       int node) {
+  if (replica.capacity() < src.size()) {
+    std::vector<U>().swap(replica);
+    replica.reserve(src.size());
+    numa_bind(replica.data(), src.size() * sizeof(U), node);
+  }
+  replica.resize(src.size());
+  std::copy(std::execution::par_unseq, std::begin(src), std::end(src),
+            std::begin(replica));
+}
+}
+
+inline const NumaTopology &numa_topology() {
+  static const NumaTopology topology = read_numa_topology();
+  return topology;
+}
+
+inline int numa_current_node() {
+#if defined(__linux__)
+  const std::vector<int> &cpu_node = numa_topology().cpu_node;
+  const int cpu = sched_getcpu();
+  return cpu >= 0 && cpu < int(cpu_node.size()) ? cpu_node[cpu] : 0;
+#else
+  return 0;
+#endif
+}
+
+inline bool numa_bind(void *addr, std::size_t bytes, int node) {
+#if defined(__linux__)
+  // mbind needs whole pages, the partial pages at both ends keep the
+  // default policy
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = (uintptr_t(addr) + page - 1) & ~(page - 1);
+  const uintptr_t end = (uintptr_t(addr) + bytes) & ~(page - 1);
+  if (end <= begin)
+    return true;
+  if (node < 0 || node >= int(8 * sizeof(unsigned long)))
+    return false;
+  const unsigned long mask = 1ul << node;
+  return syscall(SYS_mbind, begin, end - begin, MPOL_BIND, &mask,
+                 8 * sizeof(mask), 0) == 0;
+#else
+  return false;
+#endif
+}
+
+template <typename U, class Alloc> void first_touch(std::vector<U, Alloc> &values) {
+  const int n = values.size();
+  std::vector<U, Alloc> fresh;
+  fresh.reserve(n);
+  // write the first byte of every page of the still unconstructed storage
+  // from the element that contains it
+  const uintptr_t base = reinterpret_cast<uintptr_t>(fresh.data());
+#if defined(__linux__)
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+#else
+  const uintptr_t page = 4096;
+#endif
+  const IndexRange elements = index_range(n);
+  std::for_each(std::execution::par_unseq, std::begin(elements),
+                std::end(elements), [=](int i) {
+                  const uintptr_t begin = base + uintptr_t(i) * sizeof(U);
+                  const uintptr_t start = (begin + page - 1) & ~(page - 1);
+                  if (start < begin + sizeof(U))
+                    *reinterpret_cast<volatile char *>(start) = 0;
+                });
+  fresh.resize(n);
+  std::copy(std::execution::par_unseq, std::begin(values), std::end(values),
+            std::begin(fresh));
+  values.swap(fresh);
+}
+
+template <class vecT> void first_touch(System<vecT> &system) {
+  NBODY_TIMER("first_touch");
+  first_touch(system.sysPos);
+  first_touch(system.sysVel);
+  first_touch(system.sysAcc);
+  first_touch(system.sysMss);
+}
+
+template <class vecT> void first_touch(SystemSoA<vecT> &system) {
+  NBODY_TIMER("first_touch");
+  for (auto *array : {&system.sysPos, &system.sysVel, &system.sysAcc}) {
+    first_touch(array->x);
+    first_touch(array->y);
+    first_touch(array->z);
+  }
+  first_touch(system.sysMss);
+}
+
+template <class vecT> NodeSources<vecT> node_sources(System<vecT> &system) {
+  NumaReplicas<vecT> &work = system.workspace.numa;
+  const NumaTopology &topology = numa_topology();
+  const int num_nodes = topology.num_nodes();
+  if (system.numa != NumaMode::replicate || num_nodes == 1) {
+    work.node_pos.assign(1, system.sysPos.data());
+    work.node_mss.assign(1, system.sysMss.data());
+    return {work.node_pos.data(), work.node_mss.data(), false};
+  }
+
+  NBODY_TIMER("replicate");
+  work.replica_pos.resize(num_nodes);
+  work.replica_mss.resize(num_nodes);
+  work.node_pos.resize(num_nodes);
+  work.node_mss.resize(num_nodes);
+  for (int node = 0; node < num_nodes; node++) {
+    // memory only nodes never run a kernel thread
+    if (topology.node_cpus[node].empty()) {
+      work.node_pos[node] = system.sysPos.data();
+      work.node_mss[node] = system.sysMss.data();
+      continue;
+    }
+    replicate_on_node(system.sysPos, work.replica_pos[node], node);
+    replicate_on_node(system.sysMss, work.replica_mss[node], node);
+    work.node_pos[node] = work.replica_pos[node].data();
+    work.node_mss[node] = work.replica_mss[node].data();
+  }
+  return {work.node_pos.data(), work.node_mss.data(), true};
+}
+
+#if !defined(ENABLE_CUDA) && !defined(ENABLE_ACPP)
+
+// pins every thread entering the default arena to the next cpu of cpus
+struct ThreadPinner::Observer : public tbb::task_scheduler_observer {
+  std::vector<int> cpus;
+  std::atomic<int> next{0};
+
+  explicit Observer(std::vector<int> cpus) : cpus(std::move(cpus)) {
+    observe(true);
+  }
+  ~Observer() { observe(false); }
+
+  void on_scheduler_entry(bool) override {
+    // threads enter again after idling, keep their first cpu
+    thread_local const Observer *pinned_by = nullptr;
+    if (pinned_by == this)
+      return;
+    pinned_by = this;
+#if defined(__linux__)
+    const int cpu = cpus[next.fetch_add(1) % cpus.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+  }
+};
+
+inline ThreadPinner::ThreadPinner(ThreadPinning policy) {
+  if (policy == ThreadPinning::none)
+    return;
+  const NumaTopology &topology = numa_topology();
+  std::vector<int> cpus;
+  if (policy == ThreadPinning::compact) {
+    for (const std::vector<int> &node_cpus : topology.node_cpus)
+      cpus.insert(cpus.end(), node_cpus.begin(), node_cpus.end());
+  } else {
+    for (size_t k = 0; cpus.size() < topology.cpu_node.size(); k++) {
+      const size_t before = cpus.size();
+      for (const std::vector<int> &node_cpus : topology.node_cpus)
+        if (k < node_cpus.size())
+          cpus.push_back(node_cpus[k]);
+      if (cpus.size() == before)
+        break;
+    }
+  }
+  if (!cpus.empty())
+    observer = new Observer(std::move(cpus));
+}
+
+inline ThreadPinner::~ThreadPinner() { delete observer; }
+
+#else
+
+struct ThreadPinner::Observer {};
+
+inline ThreadPinner::ThreadPinner(ThreadPinning policy) {
+  if (policy != ThreadPinning::none)
+    std::cout << "WARNING: thread pinning needs the TBB backend\n";
+}
+
+inline ThreadPinner::~ThreadPinner() {}
+
+#endif
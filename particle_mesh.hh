@@ -0,0 +1,57 @@
+
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+#include "system.hh"
+#include "workspace.hh"
+
+// Particle-mesh gravity with isolated boundaries
+// masses are assigned to the nodes of an n^3 mesh over the bounding cube
+// (cloud in cell or triangular shaped cloud), the potential is their
+// convolution with Green's function on the zero-padded (2n)^3 mesh, done
+// with radix-2 FFTs that skip the lines of the padding, and the mesh
+// accelerations are 4-point differences of the potential, interpolated back
+// to the particles with the assignment weights
+// gravity is split at r_s = split mesh cells (Hockney & Eastwood, as in
+// TreePM codes): the mesh carries the long-range part, Green's function
+// -erf(r / 2r_s) / r, and p3m adds the short-range rest of the pairs closer
+// than p3m_cutoff r_s, the acceleration() term times
+// erfc(r / 2r_s) + r / (r_s sqrt(pi)) exp(-r^2 / 4r_s^2),
+// found on a chaining mesh of cells at least that wide. Without the
+// short-range part forces are smoothed over a few mesh cells
+
+// Mesh sizes, cells per dimension
+static constexpr int pm_min_grid = 16;
+static constexpr int pm_max_grid = 256;
+
+// short-range cutoff in units of r_s, erfc(p3m_cutoff / 2) = 1.5e-3
+static constexpr double p3m_cutoff = 4.5;
+
+// Mesh and scratch of the particle-mesh engines
+template <class vecT> struct PMMesh {
+  using T = typename vecT::value_type;
+  int n{0};        // cells per dimension, split scale and assignment
+  double split{0}; // green was built for
+  MassAssignment assignment{MassAssignment::cic};
+  std::vector<std::complex<double>> grid;    // zero-padded density, potential
+  std::vector<double> green;                 // transformed Green's function
+  std::vector<std::complex<double>> twiddle; // exp(-2 pi i k / 2n)
+  std::vector<vecT> force;                   // mesh accelerations, n^3
+  std::vector<uint64_t> keys;  // slab or chaining cell of each particle
+  std::vector<int> order;      // sorted slot -> particle index
+  std::vector<int> start;      // first slot of each slab or cell, then end
+  std::vector<vecT> pos;       // positions and masses in chaining cell order
+  std::vector<T> mss;
+  RadixSortBuffers radix;
+};
+
+// Calculate particle-mesh forces on an n^3 mesh (n a power of 2 in
+// [pm_min_grid, pm_max_grid]) with split scale split mesh cells, the
+// short-range pairs are added if short_range (P3M)
+template <class vecT, typename T>
+void accumulate_forces_pm(System<vecT> &system, std::vector<vecT> &accel, int n,
+                          MassAssignment assignment, T split, bool short_range);
+
+#include "particle_mesh_impl.hh"
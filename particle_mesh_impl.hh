@@ -0,0 +1,384 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <execution>
+#include <vector>
+#include "particle_mesh.hh"
+#include "physics.hh"
+#include "reorder.hh"
+
+namespace {
+// mesh nodes kept free at each face, the stencils of the particles and of
+// the 4-point differences stay inside the mesh
+static constexpr int pm_margin = 3;
+// adjacent lines transformed together, the rows of strided lines share
+// cache lines
+static constexpr int pm_fft_batch = 8;
+
+// nodes and weights of the assignment of one coordinate u, in mesh cells
+struct PMWeights {
+  int first;   // first node
+  double w[3]; // weights of nodes first, first + 1, first + 2
+};
+
+inline PMWeights pm_weights(double u, bool tsc) {
+  PMWeights s;
+  if (tsc) {
+    const double c = std::round(u); // nearest node
+    const double d = u - c;
+    s.first = int(c) - 1;
+    s.w[0] = 0.5 * (0.5 - d) * (0.5 - d);
+    s.w[1] = 0.75 - d * d;
+    s.w[2] = 0.5 * (0.5 + d) * (0.5 + d);
+  } else {
+    const double f = std::floor(u);
+    s.first = int(f);
+    s.w[1] = u - f;
+    s.w[0] = 1.0 - s.w[1];
+    s.w[2] = 0.0;
+  }
+  return s;
+}
+
+// in-place radix-2 FFT of count adjacent lines of length len, element e of
+// line l is data[e * stride + l]; inverse transforms are not normalized
+inline void fft_lines(std::complex<double> *data, int count, size_t stride,
+                      int len, const std::complex<double> *twiddle, bool inverse) {
+  for (int i = 1, j = 0; i < len; i++) {
+    int bit = len >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      for (int l = 0; l < count; l++)
+        std::swap(data[i * stride + l], data[j * stride + l]);
+  }
+  for (int half = 1; half < len; half *= 2) {
+    const int step = len / (2 * half);
+    for (int begin = 0; begin < len; begin += 2 * half)
+      for (int k = 0; k < half; k++) {
+        const std::complex<double> w =
+            inverse ? std::conj(twiddle[k * step]) : twiddle[k * step];
+        std::complex<double> *a = data + (begin + k) * stride;
+        std::complex<double> *b = a + half * stride;
+        for (int l = 0; l < count; l++) {
+          const std::complex<double> t = b[l] * w;
+          b[l] = a[l] - t;
+          a[l] += t;
+        }
+      }
+  }
+}
+
+// 3D FFT of the (len)^3 grid, index (x * len + y) * len + z, whose nonzero
+// input (forward) or needed output (inverse) is the corner x, y, z < m;
+// lines that only see zeros, or only feed unused output, are skipped
+inline void fft_3d(std::vector<std::complex<double>> &grid, int len, int m,
+                   const std::vector<std::complex<double>> &twiddles, bool inverse) {
+  std::complex<double> *gridptr = grid.data();
+  std::complex<double> const *twptr = twiddles.data();
+  const size_t plane = size_t(len) * len;
+  const int groups = len / pm_fft_batch;
+  auto z_lines = [=]() {
+    const IndexRange lines = index_range(m * m);
+    std::for_each(std::execution::par_unseq, std::begin(lines), std::end(lines),
+                  [=](int l) {
+                    const int x = l / m, y = l % m;
+                    fft_lines(gridptr + x * plane + size_t(y) * len, 1, 1, len,
+                              twptr, inverse);
+                  });
+  };
+  auto y_lines = [=]() {
+    const IndexRange lines = index_range(m * groups);
+    std::for_each(std::execution::par_unseq, std::begin(lines), std::end(lines),
+                  [=](int l) {
+                    const int x = l / groups, g = l % groups;
+                    fft_lines(gridptr + x * plane + g * pm_fft_batch, pm_fft_batch,
+                              len, len, twptr, inverse);
+                  });
+  };
+  auto x_lines = [=]() {
+    const IndexRange lines = index_range(len * groups);
+    std::for_each(std::execution::par_unseq, std::begin(lines), std::end(lines),
+                  [=](int l) {
+                    const int y = l / groups, g = l % groups;
+                    fft_lines(gridptr + size_t(y) * len + g * pm_fft_batch,
+                              pm_fft_batch, plane, len, twptr, inverse);
+                  });
+  };
+  if (!inverse) {
+    z_lines();
+    y_lines();
+    x_lines();
+  } else {
+    x_lines();
+    y_lines();
+    z_lines();
+  }
+}
+
+// transform of the long-range Green's function -erf(d / 2s) / d of the
+// (2n)^3 mesh with unit spacing, distances wrap around, divided by (2n)^3 so
+// the inverse transform comes out normalized; real since it is even
+// it is also divided by the square of the assignment window, which the
+// deposit and the interpolation both apply, sinc^2 (CIC) or sinc^3 (TSC) per
+// dimension; the Gaussian of the split keeps that finite at high k
+template <class vecT>
+void build_green(PMMesh<vecT> &mesh, int n, double split, MassAssignment assignment) {
+  const int len = 2 * n;
+  const size_t size = size_t(len) * len * len;
+  mesh.twiddle.resize(len / 2);
+  for (int k = 0; k < len / 2; k++)
+    mesh.twiddle[k] = std::polar(1.0, -2.0 * M_PI * k / len);
+  mesh.grid.resize(size);
+  mesh.green.resize(size);
+  std::complex<double> *gridptr = mesh.grid.data();
+  const IndexRange nodes = index_range(size);
+  std::for_each(std::execution::par_unseq, std::begin(nodes), std::end(nodes),
+                [=](int i) {
+                  auto wrap = [=](int k) { return double(std::min(k, len - k)); };
+                  const double dx = wrap(i / (len * len));
+                  const double dy = wrap(i / len % len);
+                  const double dz = wrap(i % len);
+                  const double d = std::sqrt(dx * dx + dy * dy + dz * dz);
+                  gridptr[i] = d > 0.0 ? -std::erf(d / (2.0 * split)) / d
+                                       : -1.0 / (split * std::sqrt(M_PI));
+                });
+  fft_3d(mesh.grid, len, len, mesh.twiddle, false);
+  const double norm = 1.0 / double(size);
+  double *greenptr = mesh.green.data();
+  const int order = assignment == MassAssignment::tsc ? 3 : 2;
+  std::for_each(std::execution::par_unseq, std::begin(nodes), std::end(nodes),
+                [=](int i) {
+                  auto window = [=](int k) {
+                    const double x = M_PI * std::min(k, len - k) / len;
+                    return k == 0 ? 1.0 : std::pow(std::sin(x) / x, order);
+                  };
+                  const double w = window(i / (len * len)) * window(i / len % len) *
+                                   window(i % len);
+                  greenptr[i] = gridptr[i].real() * norm / (w * w);
+                });
+  mesh.n = n;
+  mesh.split = split;
+  mesh.assignment = assignment;
+}
+
+// sort the particles by key into mesh.order, mesh.start[k] is the first
+// slot of key k for k <= num_keys
+template <class vecT> void sort_by_key(PMMesh<vecT> &mesh, int num_keys) {
+  radix_sort(mesh.keys, mesh.order, mesh.radix);
+  mesh.start.resize(num_keys + 1);
+  uint64_t const *keyptr = mesh.keys.data();
+  const int num = mesh.keys.size();
+  int *startptr = mesh.start.data();
+  const IndexRange keys = index_range(num_keys + 1);
+  std::for_each(std::execution::par_unseq, std::begin(keys), std::end(keys),
+                [=](int k) {
+                  startptr[k] = std::lower_bound(keyptr, keyptr + num, uint64_t(k)) -
+                                keyptr;
+                });
+}
+
+// short-range accelerations of the pairs closer than cutoff, added to accel
+template <class vecT>
+void accumulate_short_range(System<vecT> &system, std::vector<vecT> &accel,
+                            const CurveFrame<vecT> &frame, double r_s) {
+  using T = typename vecT::value_type;
+  PMMesh<vecT> &mesh = system.workspace.mesh;
+  const int sys_size = system.sysPos.size();
+  const IndexRange sys_i = index_range(sys_size);
+  const double cutoff = p3m_cutoff * r_s;
+  // cells at least cutoff wide, neighbours are in the 27 surrounding cells
+  const int nc = std::clamp(int(frame.size / cutoff), 1, pm_max_grid);
+  const double cell_scale = nc / double(frame.size);
+  const vecT lo = frame.lo;
+
+  vecT const *posptr = system.sysPos.data();
+  T const *mssptr = system.sysMss.data();
+  mesh.keys.resize(sys_size);
+  uint64_t *keyptr = mesh.keys.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  auto cell = [=](T x, T x0) {
+                    return std::min(nc - 1, int((x - x0) * cell_scale));
+                  };
+                  const vecT p = posptr[i];
+                  keyptr[i] = (uint64_t(cell(p.x, lo.x)) * nc + cell(p.y, lo.y)) * nc +
+                              cell(p.z, lo.z);
+                });
+  sort_by_key(mesh, nc * nc * nc);
+  keyptr = mesh.keys.data(); // radix_sort may swap the buffers
+  mesh.pos.resize(sys_size);
+  mesh.mss.resize(sys_size);
+  int const *ordptr = mesh.order.data();
+  vecT *sposptr = mesh.pos.data();
+  T *smssptr = mesh.mss.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int k) {
+                  sposptr[k] = posptr[ordptr[k]];
+                  smssptr[k] = mssptr[ordptr[k]];
+                });
+
+  int const *startptr = mesh.start.data();
+  vecT *accptr = accel.data();
+  const T cutoff_sq = T(cutoff * cutoff);
+  const T inv_2rs = T(0.5 / r_s);
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int k) {
+                  const vecT p = sposptr[k];
+                  const int key = keyptr[k];
+                  const int cx = key / (nc * nc), cy = key / nc % nc, cz = key % nc;
+                  vecT acc;
+                  for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, nc - 1); x++)
+                    for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, nc - 1); y++) {
+                      // cells cz - 1 .. cz + 1 are contiguous slots
+                      const int row = (x * nc + y) * nc;
+                      const int begin = startptr[row + std::max(cz - 1, 0)];
+                      const int end = startptr[row + std::min(cz + 1, nc - 1) + 1];
+                      for (int j = begin; j < end; j++) {
+                        const vecT d = sposptr[j] - p;
+                        const T r_sq = dot_product(d);
+                        if (r_sq >= cutoff_sq)
+                          continue;
+                        const T x_s = std::sqrt(r_sq) * inv_2rs; // r / 2r_s
+                        const T g = std::erfc(x_s) +
+                                    T(M_2_SQRTPI) * x_s * std::exp(-x_s * x_s);
+                        acc += acceleration(p, sposptr[j], smssptr[j]) * g;
+                      }
+                    }
+                  accptr[ordptr[k]] += acc;
+                });
+}
+}
+
+template <class vecT, typename T>
+void accumulate_forces_pm(System<vecT> &system, std::vector<vecT> &accel, int n,
+                          MassAssignment assignment, T split, bool short_range) {
+  using U = typename vecT::value_type;
+  PMMesh<vecT> &mesh = system.workspace.mesh;
+  const int sys_size = system.sysPos.size();
+  const IndexRange sys_i = index_range(sys_size);
+  if (mesh.n != n || mesh.split != double(split) || mesh.assignment != assignment)
+    build_green(mesh, n, double(split), assignment);
+  const int len = 2 * n;
+  const size_t plane = size_t(len) * len;
+  const bool tsc = assignment == MassAssignment::tsc;
+
+  // node i is at lo + (i - pm_margin) * h
+  const CurveFrame<vecT> frame = curve_frame(system.sysPos);
+  const double h = double(frame.size) / (n - 1 - 2 * pm_margin);
+  const double inv_h = 1.0 / h;
+  const vecT lo = frame.lo;
+  vecT const *posptr = system.sysPos.data();
+  U const *mssptr = system.sysMss.data();
+  auto weights = [=](const vecT &p, PMWeights s[3]) {
+    s[0] = pm_weights((p.x - lo.x) * inv_h + pm_margin, tsc);
+    s[1] = pm_weights((p.y - lo.y) * inv_h + pm_margin, tsc);
+    s[2] = pm_weights((p.z - lo.z) * inv_h + pm_margin, tsc);
+  };
+  const int width = tsc ? 3 : 2;
+
+  // deposit slab by slab, a particle writes the slabs first .. first + 2 of
+  // its stencil, so slabs 3 apart run in parallel without atomics
+  mesh.keys.resize(sys_size);
+  uint64_t *keyptr = mesh.keys.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  PMWeights s[3];
+                  weights(posptr[i], s);
+                  keyptr[i] = s[0].first;
+                });
+  sort_by_key(mesh, n);
+  std::complex<double> *gridptr = mesh.grid.data();
+  std::fill(std::execution::par_unseq, mesh.grid.begin(), mesh.grid.end(),
+            std::complex<double>());
+  int const *ordptr = mesh.order.data();
+  int const *startptr = mesh.start.data();
+  for (int color = 0; color < 3; color++) {
+    const IndexRange slabs = index_range((n - color + 2) / 3);
+    std::for_each(std::execution::par_unseq, std::begin(slabs), std::end(slabs),
+                  [=](int k) {
+                    const int slab = color + 3 * k;
+                    for (int j = startptr[slab]; j < startptr[slab + 1]; j++) {
+                      const int i = ordptr[j];
+                      PMWeights s[3];
+                      weights(posptr[i], s);
+                      const double m = mssptr[i];
+                      for (int a = 0; a < width; a++)
+                        for (int b = 0; b < width; b++) {
+                          std::complex<double> *row =
+                              gridptr + (s[0].first + a) * plane +
+                              size_t(s[1].first + b) * len + s[2].first;
+                          const double wab = m * s[0].w[a] * s[1].w[b];
+                          for (int c = 0; c < width; c++)
+                            row[c] += wab * s[2].w[c];
+                        }
+                    }
+                  });
+  }
+
+  // potential = density * Green's function
+  fft_3d(mesh.grid, len, n, mesh.twiddle, false);
+  double const *greenptr = mesh.green.data();
+  const IndexRange nodes = index_range(plane * len);
+  std::for_each(std::execution::par_unseq, std::begin(nodes), std::end(nodes),
+                [=](int i) { gridptr[i] *= greenptr[i]; });
+  fft_3d(mesh.grid, len, n, mesh.twiddle, true);
+
+  // mesh accelerations -grad potential, Green's function had unit spacing
+  mesh.force.resize(size_t(n) * n * n);
+  vecT *forceptr = mesh.force.data();
+  const double diff_scale = -1.0 / (12.0 * h * h);
+  const IndexRange rows = index_range(n * n);
+  std::for_each(std::execution::par_unseq, std::begin(rows), std::end(rows),
+                [=](int r) {
+                  const int x = r / n, y = r % n;
+                  vecT *out = forceptr + size_t(r) * n;
+                  const bool inside = x >= 2 && x < n - 2 && y >= 2 && y < n - 2;
+                  for (int z = 0; z < n; z++) {
+                    if (!inside || z < 2 || z >= n - 2) {
+                      out[z] = vecT();
+                      continue;
+                    }
+                    auto phi = [=](int dx, int dy, int dz) {
+                      return gridptr[(x + dx) * plane + size_t(y + dy) * len + z + dz]
+                          .real();
+                    };
+                    auto diff = [](double m2, double m1, double p1, double p2) {
+                      return 8.0 * (p1 - m1) - (p2 - m2);
+                    };
+                    out[z] = vecT(
+                        U(diff_scale * diff(phi(-2, 0, 0), phi(-1, 0, 0), phi(1, 0, 0),
+                                            phi(2, 0, 0))),
+                        U(diff_scale * diff(phi(0, -2, 0), phi(0, -1, 0), phi(0, 1, 0),
+                                            phi(0, 2, 0))),
+                        U(diff_scale * diff(phi(0, 0, -2), phi(0, 0, -1), phi(0, 0, 1),
+                                            phi(0, 0, 2))));
+                  }
+                });
+
+  // interpolate with the assignment weights
+  vecT *accptr = accel.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  PMWeights s[3];
+                  weights(posptr[i], s);
+                  vecT acc;
+                  for (int a = 0; a < width; a++)
+                    for (int b = 0; b < width; b++) {
+                      vecT const *row = forceptr +
+                                        (size_t(s[0].first + a) * n + s[1].first + b) * n +
+                                        s[2].first;
+                      const U wab = U(s[0].w[a] * s[1].w[b]);
+                      for (int c = 0; c < width; c++)
+                        acc += row[c] * U(wab * s[2].w[c]);
+                    }
+                  accptr[i] = acc;
+                });
+
+  if (short_range)
+    accumulate_short_range(system, accel, frame, double(split) * h);
+}
@@ -4,29 +4,101 @@
 #include "system.hh"
 #include <vector>
 
+// Half kick fused into the write-back of a force kernel, the kernel adds
+// acc * dt to vel of every particle whose acceleration it stores
+// no kick if vel is null, for the SoA layout vel points to the velocity arrays
+template <class V> struct FusedKick {
+  V *vel{nullptr};
+  float dt{0.0f};
+};
 
 // Calculate all-pairs forces
-template <class vecT> void accumulate_forces(System<vecT> &system);
+// with potential, the potential of every particle due to all others is
+// stored there as well, see diagnostics.hh
+template <class vecT>
+void accumulate_forces(System<vecT> &system, std::vector<vecT> &accel,
+                       FusedKick<vecT> kick = {},
+                       typename vecT::value_type *potential = nullptr);
+template <class vecT, typename T>
+void accumulate_forces(SystemSoA<vecT> &system, Vec3SoA<T> &accel,
+                       FusedKick<Vec3SoA<T>> kick = {});
+
+// Calculate forces on the particles listed in active only, the other
+// entries of accel are left unchanged
+template <class vecT>
+void accumulate_forces(System<vecT> &system, std::vector<vecT> &accel,
+                       const std::vector<int> &active);
+
+// Calculate all-pairs forces, blocks of tile_i particles against
+// cache resident tiles of tile_j particles
+// only the first num_targets particles are updated if num_targets >= 0
+template <class vecT>
+void accumulate_forces_tiled(System<vecT> &system, std::vector<vecT> &accel,
+                             int tile_i, int tile_j, int num_targets = -1,
+                             FusedKick<vecT> kick = {});
+
+// Calculate tiled forces on the particles listed in active only, blocks of
+// tile_i active particles, the other entries of accel are left unchanged
+template <class vecT>
+void accumulate_forces_tiled(System<vecT> &system, std::vector<vecT> &accel,
+                             int tile_i, int tile_j, const std::vector<int> &active);
+
+// Calculate all-pairs forces, each pair is evaluated once and applied to
+// both particles with opposite signs
+template <class vecT>
+void accumulate_forces_symmetric(System<vecT> &system, std::vector<vecT> &accel);
+
+// Calculate all-pairs accelerations and jerks (their time derivatives) of
+// particles at pos moving with vel, masses come from system
+template <class vecT>
+void accumulate_forces_jerk(System<vecT> &system, const std::vector<vecT> &pos,
+                            const std::vector<vecT> &vel, std::vector<vecT> &accel,
+                            std::vector<vecT> &jerk);
+
+// Time tiled kernel for a few tile sizes, store fastest in system
+template <class vecT> void tune_tile_sizes(System<vecT> &system);
 
 // Calculates acceleration on particle pos1 due to interaction with particle
 // pos2
 template <class vecT, typename T>
 vecT acceleration(const vecT &pos1, const vecT &pos2, const T mass2);
 
+// acceleration() that also adds the potential -mass2 / |r| of the pair,
+// softened like the force, to pot
+template <class vecT, typename T>
+vecT acceleration(const vecT &pos1, const vecT &pos2, const T mass2, T &pot);
+
+// acceleration on particle pos1, vel1 due to particle pos2, vel2, its time
+// derivative is added to jerk
+// J_i = m_j (v_ij / |r_ij|^3 - 3 (r_ij . v_ij) r_ij / |r_ij|^5)
+template <class vecT, typename T>
+vecT acceleration_jerk(const vecT &pos1, const vecT &vel1, const vecT &pos2,
+                       const vecT &vel2, const T mass2, vecT &jerk);
+
 // Update system velocities
 template <class vecT, typename T>
 void update_velocities(System<vecT> &system, T timestep);
+template <class vecT, typename T>
+void update_velocities(SystemSoA<vecT> &system, T timestep);
 
 // Update system positions
 template <class vecT, typename T>
 void update_positions(System<vecT> &system, T timestep);
+template <class vecT, typename T>
+void update_positions(SystemSoA<vecT> &system, T timestep);
 
 // Calculate momentum from system velocity and mass
+// the result lives in the system workspace until the next call
 template <class vecT>
-std::vector<vecT> calculate_momentum(System<vecT> &system);
+const std::vector<vecT> &calculate_momentum(System<vecT> &system);
 
 // Calculate magnitude of vector velocities
+// the result lives in the system workspace until the next call
+template <class vecT>
+const std::vector<typename vecT::value_type> &
+calculate_velocity_mag(System<vecT> &system);
 template <class vecT>
-auto calculate_velocity_mag(System<vecT> &system);
+const std::vector<typename vecT::value_type> &
+calculate_velocity_mag(SystemSoA<vecT> &system);
 
 #include "physics_impl.hh"
@@ -2,9 +2,16 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
+#include <chrono>
 #include <execution>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <thread>
 #include <vector>
 #include "math_functions.hh"
+#include "numa.hh"
 #include "physics.hh"
 
 namespace {
@@ -21,22 +28,61 @@ inline T inv_sqrt(const T x)
   __m128 y = _mm_set_ss(x); y = _mm_rsqrt_ss(y); return _mm_cvtss_f32(y);
 #endif
 }
+
+// largest block of particles accumulated per thread in the tiled kernel
+static constexpr int max_tile_i = 256;
 }
 
 // Calculate all-pairs forces
 // use transform to parallelize outer loop
 // each thread_i runs a sequential inner loop
 // over all particles, summing forces on particle_i
+// with a fused kick or a potential the loop runs over indices to also
+// update velocities or store potentials, the self pair gets zero mass so
+// that it adds nothing to either sum
+// sources are read from the copy on the node of the thread, see numa.hh
 template <class vecT>
-void accumulate_forces(System<vecT> &system, std::vector<vecT> &accel) {
+void accumulate_forces(System<vecT> &system, std::vector<vecT> &accel,
+                       FusedKick<vecT> kick, typename vecT::value_type *potential) {
   using T = typename vecT::value_type;
   const size_t sys_size{system.sysPos.size()};
 
-  T const *mssptr = system.sysMss.data();
-  vecT const *posptr = system.sysPos.data();
+  const NodeSources<vecT> src = node_sources(system);
+  if (kick.vel || potential) {
+    const IndexRange sys_i = index_range(sys_size);
+    vecT *accptr = accel.data();
+    vecT *velptr = kick.vel;
+    T *potptr = potential;
+    const float dt = kick.dt;
+    std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                  std::end(sys_i), [=](int i) {
+                    const int node = src.node();
+                    vecT const *posptr = src.pos[node];
+                    T const *mssptr = src.mss[node];
+                    const vecT pos = posptr[i];
+                    vecT acc;
+                    if (potptr) {
+                      T pot{0.0};
+                      for (size_t j = 0; j < sys_size; j++)
+                        acc += acceleration(pos, posptr[j],
+                                            j == size_t(i) ? T(0.0) : mssptr[j], pot);
+                      potptr[i] = pot;
+                    } else {
+                      for (size_t j = 0; j < sys_size; j++)
+                        acc += acceleration(pos, posptr[j], mssptr[j]);
+                    }
+                    accptr[i] = acc;
+                    if (velptr)
+                      velptr[i] += acc * dt;
+                  });
+    return;
+  }
   std::transform(std::execution::par_unseq, std::begin(system.sysPos),
                  std::end(system.sysPos), std::begin(accel),
                  [=](const vecT &pos) {
+                   const int node = src.node();
+                   vecT const *posptr = src.pos[node];
+                   T const *mssptr = src.mss[node];
                    vecT acc;
                    for (size_t j = 0; j < sys_size; j++)
                      acc += acceleration(pos, posptr[j], mssptr[j]);
@@ -44,6 +90,300 @@ void accumulate_forces(System<vecT> &system, std::vector<vecT> &accel) {
                  });
 }
 
+// Calculate forces on the active particles only
+// use for_each over the active list, each thread sums over all particles
+template <class vecT>
+void accumulate_forces(System<vecT> &system, std::vector<vecT> &accel,
+                       const std::vector<int> &active) {
+  using T = typename vecT::value_type;
+  const size_t sys_size{system.sysPos.size()};
+
+  const NodeSources<vecT> src = node_sources(system);
+  vecT *accptr = accel.data();
+  std::for_each(std::execution::par_unseq, std::begin(active),
+                std::end(active), [=](int i) {
+                  const int node = src.node();
+                  vecT const *posptr = src.pos[node];
+                  T const *mssptr = src.mss[node];
+                  const vecT pos = posptr[i];
+                  vecT acc;
+                  for (size_t j = 0; j < sys_size; j++)
+                    acc += acceleration(pos, posptr[j], mssptr[j]);
+                  accptr[i] = acc;
+                });
+}
+
+// Calculate all-pairs forces, tiled
+// use for_each over blocks of tile_i particles to parallelize, each block
+// sweeps the particles in tiles of tile_j that stay in cache while all
+// particles of the block are summed against them
+// every particle still sums j = 0..N-1 in order, as in accumulate_forces
+template <class vecT>
+void accumulate_forces_tiled(System<vecT> &system, std::vector<vecT> &accel,
+                             int tile_i, int tile_j, int num_targets,
+                             FusedKick<vecT> kick) {
+  using T = typename vecT::value_type;
+  const int sys_size = system.sysPos.size();
+  if (num_targets < 0)
+    num_targets = sys_size;
+  tile_i = std::clamp(tile_i, 1, max_tile_i);
+  tile_j = std::max(tile_j, 1);
+
+  const IndexRange blocks = index_range((num_targets + tile_i - 1) / tile_i);
+
+  const NodeSources<vecT> src = node_sources(system);
+  vecT *accptr = accel.data();
+  vecT *velptr = kick.vel;
+  const float dt = kick.dt;
+  std::for_each(std::execution::par_unseq, std::begin(blocks),
+                std::end(blocks), [=](int b) {
+                  const int node = src.node();
+                  vecT const *posptr = src.pos[node];
+                  T const *mssptr = src.mss[node];
+                  const int ibegin = b * tile_i;
+                  const int iend = std::min(ibegin + tile_i, num_targets);
+                  vecT acc[max_tile_i];
+                  for (int jbegin = 0; jbegin < sys_size; jbegin += tile_j) {
+                    const int jend = std::min(jbegin + tile_j, sys_size);
+                    for (int i = ibegin; i < iend; i++) {
+                      const vecT pos = posptr[i];
+                      vecT a = acc[i - ibegin];
+                      for (int j = jbegin; j < jend; j++)
+                        a += acceleration(pos, posptr[j], mssptr[j]);
+                      acc[i - ibegin] = a;
+                    }
+                  }
+                  for (int i = ibegin; i < iend; i++)
+                    accptr[i] = acc[i - ibegin];
+                  if (velptr)
+                    for (int i = ibegin; i < iend; i++)
+                      velptr[i] += acc[i - ibegin] * dt;
+                });
+}
+
+// Calculate tiled forces on the active particles only
+// same blocking as the all-pairs kernel over the entries of active
+template <class vecT>
+void accumulate_forces_tiled(System<vecT> &system, std::vector<vecT> &accel,
+                             int tile_i, int tile_j, const std::vector<int> &active) {
+  using T = typename vecT::value_type;
+  const int sys_size = system.sysPos.size();
+  const int num_active = active.size();
+  tile_i = std::clamp(tile_i, 1, max_tile_i);
+  tile_j = std::max(tile_j, 1);
+
+  const IndexRange blocks = index_range((num_active + tile_i - 1) / tile_i);
+
+  const NodeSources<vecT> src = node_sources(system);
+  vecT *accptr = accel.data();
+  int const *actptr = active.data();
+  std::for_each(std::execution::par_unseq, std::begin(blocks),
+                std::end(blocks), [=](int b) {
+                  const int node = src.node();
+                  vecT const *posptr = src.pos[node];
+                  T const *mssptr = src.mss[node];
+                  const int kbegin = b * tile_i;
+                  const int kend = std::min(kbegin + tile_i, num_active);
+                  vecT pos[max_tile_i];
+                  vecT acc[max_tile_i];
+                  for (int k = kbegin; k < kend; k++)
+                    pos[k - kbegin] = posptr[actptr[k]];
+                  for (int jbegin = 0; jbegin < sys_size; jbegin += tile_j) {
+                    const int jend = std::min(jbegin + tile_j, sys_size);
+                    for (int k = 0; k < kend - kbegin; k++) {
+                      vecT a = acc[k];
+                      for (int j = jbegin; j < jend; j++)
+                        a += acceleration(pos[k], posptr[j], mssptr[j]);
+                      acc[k] = a;
+                    }
+                  }
+                  for (int k = kbegin; k < kend; k++)
+                    accptr[actptr[k]] = acc[k - kbegin];
+                });
+}
+
+// Calculate all-pairs accelerations and jerks
+// same scheme as accumulate_forces, each thread sums over all particles
+template <class vecT>
+void accumulate_forces_jerk(System<vecT> &system, const std::vector<vecT> &pos,
+                            const std::vector<vecT> &vel, std::vector<vecT> &accel,
+                            std::vector<vecT> &jerk) {
+  using T = typename vecT::value_type;
+  const size_t sys_size{pos.size()};
+  const IndexRange sys_i = index_range(sys_size);
+  vecT const *posptr = pos.data();
+  vecT const *velptr = vel.data();
+  T const *mssptr = system.sysMss.data();
+  vecT *accptr = accel.data();
+  vecT *jrkptr = jerk.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) {
+                  const vecT p = posptr[i];
+                  const vecT v = velptr[i];
+                  vecT acc, jrk;
+                  for (size_t j = 0; j < sys_size; j++)
+                    acc += acceleration_jerk(p, v, posptr[j], velptr[j],
+                                             mssptr[j], jrk);
+                  accptr[i] = acc;
+                  jrkptr[i] = jrk;
+                });
+}
+
+// Calculate all-pairs forces, symmetric
+// particles are split into an even number of blocks, block pairs are
+// scheduled round robin so that every block appears in exactly one pair per
+// round; the pairs of a round write disjoint parts of accel and run in
+// parallel without atomics, a final round handles pairs inside each block
+// acceleration() with unit mass gives the shared r_ij / |r_ij|^3 term
+template <class vecT>
+void accumulate_forces_symmetric(System<vecT> &system, std::vector<vecT> &accel) {
+  using T = typename vecT::value_type;
+  const int sys_size = system.sysPos.size();
+  const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+  int num_blocks = std::clamp(sys_size / 64, 2, 8 * num_threads);
+  num_blocks += num_blocks % 2;
+  const int block_size = (sys_size + num_blocks - 1) / num_blocks;
+
+  std::fill(std::execution::par_unseq, std::begin(accel), std::end(accel), vecT());
+  const IndexRange pairs = index_range(num_blocks / 2);
+  const IndexRange blocks = index_range(num_blocks);
+
+  T const *mssptr = system.sysMss.data();
+  vecT const *posptr = system.sysPos.data();
+  vecT *accptr = accel.data();
+  auto block_range = [=](int b) {
+    return std::make_pair(std::min(b * block_size, sys_size),
+                          std::min((b + 1) * block_size, sys_size));
+  };
+
+  // pairs of distinct blocks, circle method: block num_blocks-1 stays fixed
+  // and the others rotate
+  for (int round = 0; round < num_blocks - 1; round++) {
+    std::for_each(std::execution::par_unseq, std::begin(pairs),
+                  std::end(pairs), [=](int k) {
+                    const int n = num_blocks - 1;
+                    const int bi = k == 0 ? n : (round + k) % n;
+                    const int bj = k == 0 ? round : (round - k + n) % n;
+                    const auto [ibegin, iend] = block_range(bi);
+                    const auto [jbegin, jend] = block_range(bj);
+                    for (int i = ibegin; i < iend; i++) {
+                      const vecT pos = posptr[i];
+                      const T mss = mssptr[i];
+                      vecT acc;
+                      for (int j = jbegin; j < jend; j++) {
+                        const vecT rel = acceleration(pos, posptr[j], T(1.0f));
+                        acc += rel * mssptr[j];
+                        accptr[j] -= rel * mss;
+                      }
+                      accptr[i] += acc;
+                    }
+                  });
+  }
+
+  // pairs inside each block
+  std::for_each(std::execution::par_unseq, std::begin(blocks), std::end(blocks),
+                [=](int b) {
+                  const auto [ibegin, iend] = block_range(b);
+                  for (int i = ibegin; i < iend; i++) {
+                    const vecT pos = posptr[i];
+                    const T mss = mssptr[i];
+                    vecT acc;
+                    for (int j = i + 1; j < iend; j++) {
+                      const vecT rel = acceleration(pos, posptr[j], T(1.0f));
+                      acc += rel * mssptr[j];
+                      accptr[j] -= rel * mss;
+                    }
+                    accptr[i] += acc;
+                  }
+                });
+}
+
+// Time tiled kernel for a few tile sizes, store fastest in system
+// the candidates only compute forces on a prefix of the particles, which
+// still sweeps all j tiles like a full pass
+template <class vecT> void tune_tile_sizes(System<vecT> &system) {
+  const int sys_size = system.sysPos.size();
+  const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+  const int num_targets = std::min(sys_size, std::max(4096, 128 * num_threads));
+
+  std::vector<vecT> accel(num_targets, vecT());
+
+  double best = std::numeric_limits<double>::max();
+  for (int tile_i : {8, 32, 128}) {
+    for (int tile_j : {512, 2048, 8192}) {
+      auto start = std::chrono::steady_clock::now();
+      accumulate_forces_tiled(system, accel, tile_i, tile_j, num_targets);
+      auto stop = std::chrono::steady_clock::now();
+      const double t = std::chrono::duration<double>(stop - start).count();
+      if (t < best) {
+        best = t;
+        system.tile_i = tile_i;
+        system.tile_j = tile_j;
+      }
+    }
+  }
+  std::cout << "tuned tile sizes: " << system.tile_i << " x " << system.tile_j
+            << "\n";
+}
+
+namespace {
+// all-pairs forces from SoA positions and masses, shared by the SoA layout
+// and the AoS SIMD engine for types without a SIMD kernel
+template <typename T>
+void soa_forces(const Vec3SoA<T> &pos, const aligned_vector<T> &mss,
+                Vec3SoA<T> &accel, FusedKick<Vec3SoA<T>> kick) {
+  const size_t sys_size{mss.size()};
+  const IndexRange sys_i = index_range(sys_size);
+
+  T const *xptr = pos.x.data();
+  T const *yptr = pos.y.data();
+  T const *zptr = pos.z.data();
+  T const *mssptr = mss.data();
+  T *axptr = accel.x.data();
+  T *ayptr = accel.y.data();
+  T *azptr = accel.z.data();
+  T *vxptr = kick.vel ? kick.vel->x.data() : nullptr;
+  T *vyptr = kick.vel ? kick.vel->y.data() : nullptr;
+  T *vzptr = kick.vel ? kick.vel->z.data() : nullptr;
+  const float dt = kick.dt;
+  std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                std::end(sys_i), [=](int i) {
+                  const T xi = xptr[i];
+                  const T yi = yptr[i];
+                  const T zi = zptr[i];
+                  T ax{0.0}, ay{0.0}, az{0.0};
+                  for (size_t j = 0; j < sys_size; j++) {
+                    const T dx = xptr[j] - xi;
+                    const T dy = yptr[j] - yi;
+                    const T dz = zptr[j] - zi;
+                    const T rd_sq = T(0.00001f) + dx * dx + dy * dy + dz * dz;
+                    const T rd_mag = T(1.0f) / std::sqrt(rd_sq);
+                    const T impulse = mssptr[j] * rd_mag * rd_mag * rd_mag;
+                    ax += dx * impulse;
+                    ay += dy * impulse;
+                    az += dz * impulse;
+                  }
+                  axptr[i] = ax;
+                  ayptr[i] = ay;
+                  azptr[i] = az;
+                  if (vxptr) {
+                    vxptr[i] += ax * dt;
+                    vyptr[i] += ay * dt;
+                    vzptr[i] += az * dt;
+                  }
+                });
+}
+}
+
+// Calculate all-pairs forces, SoA layout
+// same scheme as above, the inner loop reads the x/y/z/m arrays with
+// unit stride, so it vectorizes across j
+template <class vecT, typename T>
+void accumulate_forces(SystemSoA<vecT> &system, Vec3SoA<T> &accel,
+                       FusedKick<Vec3SoA<T>> kick) {
+  soa_forces(system.sysPos, system.sysMss, accel, kick);
+}
+
 // Calculates acceleration on particle i
 // due to interaction with particle j
 // Force equation
@@ -61,6 +401,36 @@ vecT acceleration(const vecT &pos1, const vecT &pos2, const T mass2) {
   return rel_dist;
 }
 
+template <class vecT, typename T>
+vecT acceleration(const vecT &pos1, const vecT &pos2, const T mass2, T &pot) {
+  vecT rel_dist = pos2 - pos1;
+  T rd_sq{0.00001f};
+  rd_sq += dot_product(rel_dist);
+  const T rd_mag = inv_sqrt(rd_sq);
+  pot -= mass2 * rd_mag; // -m_j / |rel_dist|
+  const T impulse = mass2 * rd_mag * rd_mag * rd_mag;
+  rel_dist *= impulse;
+  return rel_dist;
+}
+
+// the jerk has to be the derivative of the acceleration for the Hermite
+// corrector to be 4th order, so this pair term takes the exact inverse
+// square root instead of the rsqrt estimate of inv_sqrt
+template <class vecT, typename T>
+vecT acceleration_jerk(const vecT &pos1, const vecT &vel1, const vecT &pos2,
+                       const vecT &vel2, const T mass2, vecT &jerk) {
+  vecT rel_dist = pos2 - pos1;
+  const vecT rel_vel = vel2 - vel1;
+  T rd_sq{0.00001f};
+  rd_sq += dot_product(rel_dist);
+  const T rd_mag = T(1) / std::sqrt(rd_sq);
+  const T impulse = mass2 * rd_mag * rd_mag * rd_mag;
+  const T rv = T(3) * dot_product(rel_dist, rel_vel) * rd_mag * rd_mag;
+  jerk += (rel_vel - rel_dist * rv) * impulse;
+  rel_dist *= impulse;
+  return rel_dist;
+}
+
 template <class vecT, typename T>
 void update_velocities(System<vecT> &system, T timestep) {
   const float dt{timestep};
@@ -83,9 +453,48 @@ void update_positions(System<vecT> &system, T timestep) {
                  });
 }
 
+template <class vecT, typename T>
+void update_velocities(SystemSoA<vecT> &system, T timestep) {
+  using U = typename vecT::value_type;
+  const float dt{timestep};
+  U const *axptr = system.sysAcc.x.data();
+  U const *ayptr = system.sysAcc.y.data();
+  U const *azptr = system.sysAcc.z.data();
+  U *vxptr = system.sysVel.x.data();
+  U *vyptr = system.sysVel.y.data();
+  U *vzptr = system.sysVel.z.data();
+  const IndexRange sys_i = index_range(system.sysMss.size());
+  std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                std::end(sys_i), [=](int i) {
+                  vxptr[i] += axptr[i] * dt;
+                  vyptr[i] += ayptr[i] * dt;
+                  vzptr[i] += azptr[i] * dt;
+                });
+}
+
+template <class vecT, typename T>
+void update_positions(SystemSoA<vecT> &system, T timestep) {
+  using U = typename vecT::value_type;
+  const float dt{static_cast<float>(timestep)};
+  U const *vxptr = system.sysVel.x.data();
+  U const *vyptr = system.sysVel.y.data();
+  U const *vzptr = system.sysVel.z.data();
+  U *xptr = system.sysPos.x.data();
+  U *yptr = system.sysPos.y.data();
+  U *zptr = system.sysPos.z.data();
+  const IndexRange sys_i = index_range(system.sysMss.size());
+  std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                std::end(sys_i), [=](int i) {
+                  xptr[i] += vxptr[i] * dt;
+                  yptr[i] += vyptr[i] * dt;
+                  zptr[i] += vzptr[i] * dt;
+                });
+}
+
 template <class vecT>
-std::vector<vecT> calculate_momentum(System<vecT> &system) {
-  std::vector<vecT> momentum(system.sysVel.size(), vecT());
+const std::vector<vecT> &calculate_momentum(System<vecT> &system) {
+  std::vector<vecT> &momentum = system.workspace.output.momentum;
+  momentum.resize(system.sysVel.size());
   std::transform(std::execution::par_unseq, std::begin(system.sysVel),
                  std::end(system.sysVel), std::begin(system.sysMss),
                  std::begin(momentum),
@@ -94,12 +503,32 @@ std::vector<vecT> calculate_momentum(System<vecT> &system) {
 }
 
 template <class vecT>
-auto calculate_velocity_mag(System<vecT> &system) {
+const std::vector<typename vecT::value_type> &
+calculate_velocity_mag(System<vecT> &system) {
   using T = typename vecT::value_type;
-  std::vector<T> vel_mag(system.sysVel.size(), 0.0f);
+  std::vector<T> &vel_mag = system.workspace.output.velocity_mag;
+  vel_mag.resize(system.sysVel.size());
   std::transform(std::execution::par_unseq,
                  std::begin(system.sysVel), std::end(system.sysVel),
                  std::begin(vel_mag),
                  [=](const vecT &vel) { return magnitude(vel); });
   return vel_mag;
 }
+
+template <class vecT>
+const std::vector<typename vecT::value_type> &
+calculate_velocity_mag(SystemSoA<vecT> &system) {
+  using T = typename vecT::value_type;
+  std::vector<T> &vel_mag = system.workspace.output.velocity_mag;
+  vel_mag.resize(system.sysMss.size());
+  T const *vxptr = system.sysVel.x.data();
+  T const *vyptr = system.sysVel.y.data();
+  T const *vzptr = system.sysVel.z.data();
+  const IndexRange sys_i = index_range(system.sysMss.size());
+  std::transform(std::execution::par_unseq, std::begin(sys_i),
+                 std::end(sys_i), std::begin(vel_mag), [=](int i) {
+                   return sqrtf(vxptr[i] * vxptr[i] + vyptr[i] * vyptr[i] +
+                                vzptr[i] * vzptr[i]);
+                 });
+  return vel_mag;
+}
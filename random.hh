@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Counter-based random numbers, Philox4x32-10 (Salmon et al., SC'11)
+// a block of 4 random words is a pure function of a 128 bit counter and a
+// 64 bit key, so particle i of a generator draws the same numbers no matter
+// which thread computes it or in which order
+
+using PhiloxBlock = std::array<uint32_t, 4>;
+
+// 10 rounds of Philox4x32 on counter with key
+PhiloxBlock philox4x32(PhiloxBlock counter, uint64_t key);
+
+// Random stream of one generator call, keyed by the run seed
+// block(i, n) is the n-th block of 4 words of particle i
+struct CounterRng {
+  uint64_t seed{0};
+  uint32_t stream{0};
+  PhiloxBlock block(uint32_t i, uint32_t n = 0) const;
+};
+
+// uniform float in [-1, 1) from 32 random bits
+float uniform_pm1(uint32_t bits);
+
+// standard normal float from 64 random bits, Box-Muller
+float normal(uint32_t bits1, uint32_t bits2);
+
+#include "random_impl.hh"
@@ -0,0 +1,42 @@
+
+#pragma once
+
+#include <cmath>
+#include "random.hh"
+
+namespace {
+static constexpr uint32_t philox_m0 = 0xD2511F53;
+static constexpr uint32_t philox_m1 = 0xCD9E8D57;
+static constexpr uint32_t philox_w0 = 0x9E3779B9; // golden ratio
+static constexpr uint32_t philox_w1 = 0xBB67AE85; // sqrt(3) - 1
+}
+
+inline PhiloxBlock philox4x32(PhiloxBlock c, uint64_t key) {
+  uint32_t k0 = uint32_t(key);
+  uint32_t k1 = uint32_t(key >> 32);
+  for (int round = 0; round < 10; round++) {
+    const uint64_t p0 = uint64_t(philox_m0) * c[0];
+    const uint64_t p1 = uint64_t(philox_m1) * c[2];
+    c = {uint32_t(p1 >> 32) ^ c[1] ^ k0, uint32_t(p1),
+         uint32_t(p0 >> 32) ^ c[3] ^ k1, uint32_t(p0)};
+    k0 += philox_w0;
+    k1 += philox_w1;
+  }
+  return c;
+}
+
+inline PhiloxBlock CounterRng::block(uint32_t i, uint32_t n) const {
+  return philox4x32({i, n, stream, 0}, seed);
+}
+
+inline float uniform_pm1(uint32_t bits) {
+  // upper 24 bits fill the float mantissa exactly
+  return float(bits >> 8) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+inline float normal(uint32_t bits1, uint32_t bits2) {
+  // u1 in (0, 1] keeps the log finite
+  const float u1 = (float(bits1 >> 8) + 1.0f) * (1.0f / 16777216.0f);
+  const float u2 = float(bits2 >> 8) * (1.0f / 16777216.0f);
+  return std::sqrt(-2.0f * std::log(u1)) * std::cos(6.2831853f * u2);
+}
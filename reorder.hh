@@ -0,0 +1,91 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "workspace.hh"
+
+// Space-filling curve order of the particle arrays
+// particles that are close in space are then close in memory, so the
+// neighbours a tree walk visits one after the other share cache lines and
+// pages. Keys hold 21 bits per dimension of the position in the bounding
+// cube and are sorted with a parallel LSD radix sort. sysId follows the
+// particles, snapshots, text output and checkpoints still list them in
+// their original order
+
+// Space-filling curves of the particle order
+enum class SortCurve : int {
+  none = 0,    // particles keep their order
+  morton = 1,  // Z-order, bit interleaved cell coordinates
+  hilbert = 2, // Hilbert curve, consecutive cells are always face neighbours
+};
+
+// bits per dimension of the curve keys, one octree level per 3 key bits
+static constexpr int curve_bits = 21;
+
+template <class vecT> struct System;
+template <class vecT> struct SystemSoA;
+
+// Bounding cube of the positions, cell coordinates are
+// (p - lo) * scale, clamped to [0, 2^curve_bits)
+template <class vecT> struct CurveFrame {
+  using T = typename vecT::value_type;
+  vecT lo;
+  T size{0.0}; // edge length, slightly larger than the extent
+  T scale{0.0};
+};
+
+template <class vecT> CurveFrame<vecT> curve_frame(const std::vector<vecT> &pos);
+
+// Z-order key of cell coordinates below 2^curve_bits
+uint64_t morton_key(uint64_t x, uint64_t y, uint64_t z);
+
+// Hilbert key of cell coordinates below 2^curve_bits, Skilling's transpose
+// algorithm (AIP Conf. Proc. 707, 381 (2004))
+uint64_t hilbert_key(uint64_t x, uint64_t y, uint64_t z);
+
+// key of every position in frame along curve
+template <class vecT>
+void curve_keys(const std::vector<vecT> &pos, const CurveFrame<vecT> &frame,
+                SortCurve curve, std::vector<uint64_t> &keys);
+
+// ping-pong buffers of radix_sort, kept so that sorts reuse their capacity
+struct RadixSortBuffers {
+  std::vector<uint64_t> keys;
+  std::vector<int> order;
+  std::vector<int> counts; // digit counts, then offsets, of every chunk
+};
+
+// Scratch of reorder_particles, also the compaction targets of a merge
+template <class vecT> struct ReorderBuffers {
+  using T = typename vecT::value_type;
+  std::vector<uint64_t> sort_keys; // curve keys of reorder_particles
+  std::vector<int> sort_order;     // sorted slot -> particle index
+  RadixSortBuffers radix;
+  std::vector<vecT> sorted_vec;    // reorder targets, then the old arrays
+  std::vector<T> sorted_mss;
+  std::vector<int> sorted_id;
+  std::vector<int> id_slot;        // slot of each particle id, text output
+};
+
+// Stable parallel LSD radix sort with 8 bit digits
+// on return keys are sorted and order[i] is the original index of keys[i],
+// digits above the largest key and digits that all keys share are skipped
+void radix_sort(std::vector<uint64_t> &keys, std::vector<int> &order,
+                RadixSortBuffers &buffers);
+
+// Sort the particle arrays of system along curve
+// sysId is set to the identity on the first call and permuted with the
+// particles
+template <class vecT> void reorder_particles(System<vecT> &system, SortCurve curve);
+
+// put the particles of a reordered system back in their original order and
+// clear sysId
+template <class vecT> void restore_particle_order(System<vecT> &system);
+
+// reorder_particles with system.sort_curve if the completed step is a
+// multiple of system.sort_interval; SoA systems keep their order
+template <class vecT> void reorder_if_due(System<vecT> &system);
+template <class vecT> void reorder_if_due(SystemSoA<vecT> &system);
+
+#include "reorder_impl.hh"
@@ -0,0 +1,256 @@
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <execution>
+#include "instrumentation.hh"
+#include "numa.hh"
+#include "reorder.hh"
+#include "workspace.hh"
+
+namespace {
+// at least this many keys per chunk of the radix sort
+static constexpr int radix_chunk = 1 << 14;
+static constexpr int radix_max_chunks = 256;
+static constexpr int radix_buckets = 256;
+
+// spread lower 21 bits of v so that there are two zero bits between each
+inline uint64_t spread_bits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffff;
+  v = (v | v << 16) & 0x1f0000ff0000ff;
+  v = (v | v << 8) & 0x100f00f00f00f00f;
+  v = (v | v << 4) & 0x10c30c30c30c30c3;
+  v = (v | v << 2) & 0x1249249249249249;
+  return v;
+}
+
+// gather values in order through scratch, which then holds the old array
+// a new scratch buffer is first touched like the particle arrays
+template <typename U>
+void permute(std::vector<U> &values, const std::vector<int> &order,
+             std::vector<U> &scratch, bool numa) {
+  if (scratch.size() != values.size()) {
+    scratch.resize(values.size());
+    if (numa)
+      first_touch(scratch);
+  }
+  U const *src = values.data();
+  std::transform(std::execution::par_unseq, std::begin(order), std::end(order),
+                 std::begin(scratch), [=](int p) { return src[p]; });
+  values.swap(scratch);
+}
+}
+
+template <class vecT> CurveFrame<vecT> curve_frame(const std::vector<vecT> &pos) {
+  using T = typename vecT::value_type;
+  // a unit cube at the origin frames no particles
+  if (pos.empty())
+    return CurveFrame<vecT>{vecT(), T(1), T(1 << curve_bits)};
+  struct Box {
+    vecT lo, hi;
+  };
+  const Box box = std::transform_reduce(
+      std::execution::par_unseq, std::begin(pos), std::end(pos),
+      Box{pos[0], pos[0]},
+      [](const Box &a, const Box &b) {
+        return Box{vecT(std::min(a.lo.x, b.lo.x), std::min(a.lo.y, b.lo.y),
+                        std::min(a.lo.z, b.lo.z)),
+                   vecT(std::max(a.hi.x, b.hi.x), std::max(a.hi.y, b.hi.y),
+                        std::max(a.hi.z, b.hi.z))};
+      },
+      [](const vecT &p) { return Box{p, p}; });
+  CurveFrame<vecT> frame;
+  frame.lo = box.lo;
+  frame.size = std::max({box.hi.x - box.lo.x, box.hi.y - box.lo.y,
+                         box.hi.z - box.lo.z});
+  frame.size = frame.size * T(1.0001f) + T(1e-6f); // keep the upper corner inside
+  frame.scale = T(1 << curve_bits) / frame.size;
+  return frame;
+}
+
+inline uint64_t morton_key(uint64_t x, uint64_t y, uint64_t z) {
+  return spread_bits(x) << 2 | spread_bits(y) << 1 | spread_bits(z);
+}
+
+inline uint64_t hilbert_key(uint64_t x, uint64_t y, uint64_t z) {
+  uint64_t X[3] = {x, y, z};
+  const uint64_t M = uint64_t(1) << (curve_bits - 1);
+  // undo the excess work of the inverse transform
+  for (uint64_t Q = M; Q > 1; Q >>= 1) {
+    const uint64_t P = Q - 1;
+    for (int i = 0; i < 3; i++) {
+      if (X[i] & Q) {
+        X[0] ^= P;
+      } else {
+        const uint64_t t = (X[0] ^ X[i]) & P;
+        X[0] ^= t;
+        X[i] ^= t;
+      }
+    }
+  }
+  // Gray encode
+  X[1] ^= X[0];
+  X[2] ^= X[1];
+  uint64_t t = 0;
+  for (uint64_t Q = M; Q > 1; Q >>= 1)
+    if (X[2] & Q)
+      t ^= Q - 1;
+  for (int i = 0; i < 3; i++)
+    X[i] ^= t;
+  // the transposed key, bit b of X[0] is the most significant of level b
+  return morton_key(X[0], X[1], X[2]);
+}
+
+template <class vecT>
+void curve_keys(const std::vector<vecT> &pos, const CurveFrame<vecT> &frame,
+                SortCurve curve, std::vector<uint64_t> &keys) {
+  using T = typename vecT::value_type;
+  const vecT lo = frame.lo;
+  const T scale = frame.scale;
+  const bool hilbert = curve == SortCurve::hilbert;
+  keys.resize(pos.size());
+  std::transform(std::execution::par_unseq, std::begin(pos), std::end(pos),
+                 std::begin(keys), [=](const vecT &p) {
+                   const uint64_t cmax = (1 << curve_bits) - 1;
+                   const uint64_t cx = std::min(cmax, uint64_t((p.x - lo.x) * scale));
+                   const uint64_t cy = std::min(cmax, uint64_t((p.y - lo.y) * scale));
+                   const uint64_t cz = std::min(cmax, uint64_t((p.z - lo.z) * scale));
+                   return hilbert ? hilbert_key(cx, cy, cz) : morton_key(cx, cy, cz);
+                 });
+}
+
+// each pass counts the digits of every chunk, turns the counts into the
+// first output slot of each digit and chunk, digit major so that equal
+// digits keep the chunk order, and scatters every chunk in order
+inline void radix_sort(std::vector<uint64_t> &keys, std::vector<int> &order,
+                       RadixSortBuffers &buffers) {
+  const int n = keys.size();
+  const IndexRange sys_i = index_range(n);
+  order.resize(n);
+  std::copy(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+            std::begin(order));
+  if (n == 0)
+    return;
+  buffers.keys.resize(n);
+  buffers.order.resize(n);
+
+  const uint64_t max_key = std::reduce(
+      std::execution::par_unseq, std::begin(keys), std::end(keys), uint64_t(0),
+      [](uint64_t a, uint64_t b) { return std::max(a, b); });
+  const int num_digits = (std::bit_width(max_key) + 7) / 8;
+  const int num_chunks = std::clamp(n / radix_chunk, 1, radix_max_chunks);
+  buffers.counts.resize(num_chunks * radix_buckets);
+  const IndexRange chunks = index_range(num_chunks);
+
+  uint64_t *src_key = keys.data();
+  uint64_t *dst_key = buffers.keys.data();
+  int *src_ord = order.data();
+  int *dst_ord = buffers.order.data();
+  int *cntptr = buffers.counts.data();
+  bool swapped = false;
+  for (int d = 0; d < num_digits; d++) {
+    const int shift = 8 * d;
+    std::for_each(std::execution::par_unseq, std::begin(chunks),
+                  std::end(chunks), [=](int c) {
+                    int *count = cntptr + c * radix_buckets;
+                    std::fill(count, count + radix_buckets, 0);
+                    const int begin = int64_t(n) * c / num_chunks;
+                    const int end = int64_t(n) * (c + 1) / num_chunks;
+                    for (int i = begin; i < end; i++)
+                      count[(src_key[i] >> shift) & 0xff]++;
+                  });
+    int total = 0;
+    bool shared = false;
+    for (int b = 0; b < radix_buckets; b++) {
+      int digit_total = 0;
+      for (int c = 0; c < num_chunks; c++) {
+        const int k = cntptr[c * radix_buckets + b];
+        cntptr[c * radix_buckets + b] = total;
+        total += k;
+        digit_total += k;
+      }
+      shared |= digit_total == n;
+    }
+    if (shared)
+      continue;
+    std::for_each(std::execution::par_unseq, std::begin(chunks),
+                  std::end(chunks), [=](int c) {
+                    int *offset = cntptr + c * radix_buckets;
+                    const int begin = int64_t(n) * c / num_chunks;
+                    const int end = int64_t(n) * (c + 1) / num_chunks;
+                    for (int i = begin; i < end; i++) {
+                      const uint64_t key = src_key[i];
+                      const int slot = offset[(key >> shift) & 0xff]++;
+                      dst_key[slot] = key;
+                      dst_ord[slot] = src_ord[i];
+                    }
+                  });
+    std::swap(src_key, dst_key);
+    std::swap(src_ord, dst_ord);
+    swapped = !swapped;
+  }
+  if (swapped) {
+    keys.swap(buffers.keys);
+    order.swap(buffers.order);
+  }
+}
+
+template <class vecT> void reorder_particles(System<vecT> &system, SortCurve curve) {
+  const int sys_size = system.sysPos.size();
+  if (curve == SortCurve::none || sys_size == 0)
+    return;
+  NBODY_TIMER("reorder");
+  auto &work = system.workspace.reorder;
+  if (system.sysId.size() != std::size_t(sys_size)) {
+    const IndexRange sys_i = index_range(sys_size);
+    system.sysId.resize(sys_size);
+    std::copy(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+              std::begin(system.sysId));
+  }
+  curve_keys(system.sysPos, curve_frame(system.sysPos), curve, work.sort_keys);
+  radix_sort(work.sort_keys, work.sort_order, work.radix);
+
+  const bool numa = system.numa != NumaMode::off;
+  permute(system.sysPos, work.sort_order, work.sorted_vec, numa);
+  permute(system.sysVel, work.sort_order, work.sorted_vec, numa);
+  permute(system.sysAcc, work.sort_order, work.sorted_vec, numa);
+  if (system.sysJerk.size() == std::size_t(sys_size))
+    permute(system.sysJerk, work.sort_order, work.sorted_vec, numa);
+  permute(system.sysMss, work.sort_order, work.sorted_mss, numa);
+  permute(system.sysId, work.sort_order, work.sorted_id, numa);
+  // potentials of the last force pass go with their particles
+  if (system.has_potential)
+    permute(system.workspace.output.potential, work.sort_order, work.sorted_mss, numa);
+}
+
+template <class vecT> void restore_particle_order(System<vecT> &system) {
+  if (system.sysId.empty())
+    return;
+  auto &work = system.workspace.reorder;
+  const IndexRange sys_i = index_range(system.sysId.size());
+  work.id_slot.resize(system.sysId.size());
+  int const *idptr = system.sysId.data();
+  int *slotptr = work.id_slot.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) { slotptr[idptr[i]] = i; });
+  const bool numa = system.numa != NumaMode::off;
+  permute(system.sysPos, work.id_slot, work.sorted_vec, numa);
+  permute(system.sysVel, work.id_slot, work.sorted_vec, numa);
+  permute(system.sysAcc, work.id_slot, work.sorted_vec, numa);
+  if (system.sysJerk.size() == system.sysId.size())
+    permute(system.sysJerk, work.id_slot, work.sorted_vec, numa);
+  permute(system.sysMss, work.id_slot, work.sorted_mss, numa);
+  if (system.has_potential)
+    permute(system.workspace.output.potential, work.id_slot, work.sorted_mss, numa);
+  system.sysId.clear();
+}
+
+template <class vecT> void reorder_if_due(System<vecT> &system) {
+  if (system.sort_curve != SortCurve::none && system.sort_interval > 0 &&
+      system.step % system.sort_interval == 0)
+    reorder_particles(system, system.sort_curve);
+}
+
+template <class vecT> void reorder_if_due(SystemSoA<vecT> &) {}
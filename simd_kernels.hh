@@ -0,0 +1,46 @@
+
+#pragma once
+
+#include <vector>
+#include "system.hh"
+#include "vec_soa.hh"
+
+// Explicit SIMD all-pairs kernels
+// each target particle is summed against 4 (SSE), 8 (AVX2) or 16 (AVX-512)
+// sources at once, 1/r comes from packed rsqrt refined by one Newton step
+// kernels are compiled with per-function target attributes and picked at
+// runtime from CPUID, so the binary does not depend on -march
+
+// SoA copies of the AoS positions and masses, the sources of the SIMD
+// kernels on the AoS layout
+template <class vecT> struct SimdBuffers {
+  using T = typename vecT::value_type;
+  Vec3SoA<T> soa_pos;
+  aligned_vector<T> soa_mss;
+};
+
+// Best instruction set supported by this CPU
+SimdIsa detect_simd_isa();
+
+// Requested instruction set, or the best supported one if unavailable
+SimdIsa resolve_simd_isa(SimdIsa requested);
+
+// Printable name of isa
+const char *simd_isa_name(SimdIsa isa);
+
+// Calculate all-pairs forces with the SIMD kernel for isa
+// the AoS layout is transposed into SoA scratch arrays first
+template <class vecT>
+void accumulate_forces_simd(System<vecT> &system, std::vector<vecT> &accel,
+                            SimdIsa isa);
+template <class vecT, typename T>
+void accumulate_forces_simd(SystemSoA<vecT> &system, Vec3SoA<T> &accel,
+                            SimdIsa isa);
+
+// Calculate forces on the particles listed in active only, the other
+// entries of accel are left unchanged
+template <class vecT>
+void accumulate_forces_simd(System<vecT> &system, std::vector<vecT> &accel,
+                            SimdIsa isa, const std::vector<int> &active);
+
+#include "simd_kernels_impl.hh"
@@ -0,0 +1,379 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <execution>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+#include "simd_kernels.hh"
+
+#if defined(__x86_64__) && !defined(ENABLE_CUDA) && !defined(ENABLE_ACPP)
+#define NBODY_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+// target particles per parallel work item
+static constexpr int simd_block_size = 64;
+
+// softened pairwise term as in acceleration(), used for the scalar kernel
+// and the remainder of the vector loops
+inline void force_tail(const float *x, const float *y, const float *z,
+                       const float *m, int jbegin, int jend, float xi,
+                       float yi, float zi, float &ax, float &ay, float &az) {
+  for (int j = jbegin; j < jend; j++) {
+    const float dx = x[j] - xi;
+    const float dy = y[j] - yi;
+    const float dz = z[j] - zi;
+    const float rd_sq = 0.00001f + dx * dx + dy * dy + dz * dz;
+    const float rd_mag = 1.f / std::sqrt(rd_sq);
+    const float impulse = m[j] * rd_mag * rd_mag * rd_mag;
+    ax += dx * impulse;
+    ay += dy * impulse;
+    az += dz * impulse;
+  }
+}
+
+// forces on targets [ibegin, iend) from all n sources, portable version
+// targets maps k to a particle index, nullptr for the identity
+inline void force_block_scalar(const float *x, const float *y, const float *z,
+                               const float *m, int n, const int *targets,
+                               int ibegin, int iend, float *ax, float *ay,
+                               float *az) {
+  for (int k = ibegin; k < iend; k++) {
+    const int i = targets ? targets[k] : k;
+    float sx{0.f}, sy{0.f}, sz{0.f};
+    force_tail(x, y, z, m, 0, n, x[i], y[i], z[i], sx, sy, sz);
+    ax[i] = sx;
+    ay[i] = sy;
+    az[i] = sz;
+  }
+}
+
+#ifdef NBODY_X86_SIMD
+// 4 sources per step, SSE is part of the x86-64 baseline
+inline void force_block_sse(const float *x, const float *y, const float *z,
+                            const float *m, int n, const int *targets,
+                            int ibegin, int iend, float *ax, float *ay,
+                            float *az) {
+  const int nvec = n - n % 4;
+  const __m128 eps = _mm_set1_ps(0.00001f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 three_half = _mm_set1_ps(1.5f);
+  for (int k = ibegin; k < iend; k++) {
+    const int i = targets ? targets[k] : k;
+    const __m128 xi = _mm_set1_ps(x[i]);
+    const __m128 yi = _mm_set1_ps(y[i]);
+    const __m128 zi = _mm_set1_ps(z[i]);
+    __m128 sx = _mm_setzero_ps();
+    __m128 sy = _mm_setzero_ps();
+    __m128 sz = _mm_setzero_ps();
+    for (int j = 0; j < nvec; j += 4) {
+      const __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), xi);
+      const __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), yi);
+      const __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), zi);
+      __m128 rd_sq = _mm_add_ps(eps, _mm_mul_ps(dx, dx));
+      rd_sq = _mm_add_ps(rd_sq, _mm_mul_ps(dy, dy));
+      rd_sq = _mm_add_ps(rd_sq, _mm_mul_ps(dz, dz));
+      // y = rsqrt(x), y *= 1.5 - 0.5 * x * y * y
+      __m128 rd_mag = _mm_rsqrt_ps(rd_sq);
+      rd_mag = _mm_mul_ps(rd_mag,
+                          _mm_sub_ps(three_half,
+                                     _mm_mul_ps(_mm_mul_ps(half, rd_sq),
+                                                _mm_mul_ps(rd_mag, rd_mag))));
+      const __m128 impulse = _mm_mul_ps(
+          _mm_loadu_ps(m + j), _mm_mul_ps(rd_mag, _mm_mul_ps(rd_mag, rd_mag)));
+      sx = _mm_add_ps(sx, _mm_mul_ps(dx, impulse));
+      sy = _mm_add_ps(sy, _mm_mul_ps(dy, impulse));
+      sz = _mm_add_ps(sz, _mm_mul_ps(dz, impulse));
+    }
+    alignas(16) float rx[4], ry[4], rz[4];
+    _mm_store_ps(rx, sx);
+    _mm_store_ps(ry, sy);
+    _mm_store_ps(rz, sz);
+    float fx = rx[0] + rx[1] + rx[2] + rx[3];
+    float fy = ry[0] + ry[1] + ry[2] + ry[3];
+    float fz = rz[0] + rz[1] + rz[2] + rz[3];
+    force_tail(x, y, z, m, nvec, n, x[i], y[i], z[i], fx, fy, fz);
+    ax[i] = fx;
+    ay[i] = fy;
+    az[i] = fz;
+  }
+}
+
+// 8 sources per step
+__attribute__((target("avx2,fma"))) inline float hsum_avx2(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_hadd_ps(s, s);
+  s = _mm_hadd_ps(s, s);
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+force_block_avx2(const float *x, const float *y, const float *z,
+                 const float *m, int n, const int *targets, int ibegin,
+                 int iend, float *ax, float *ay, float *az) {
+  const int nvec = n - n % 8;
+  const __m256 eps = _mm256_set1_ps(0.00001f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 three_half = _mm256_set1_ps(1.5f);
+  for (int k = ibegin; k < iend; k++) {
+    const int i = targets ? targets[k] : k;
+    const __m256 xi = _mm256_set1_ps(x[i]);
+    const __m256 yi = _mm256_set1_ps(y[i]);
+    const __m256 zi = _mm256_set1_ps(z[i]);
+    __m256 sx = _mm256_setzero_ps();
+    __m256 sy = _mm256_setzero_ps();
+    __m256 sz = _mm256_setzero_ps();
+    for (int j = 0; j < nvec; j += 8) {
+      const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), xi);
+      const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), yi);
+      const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + j), zi);
+      __m256 rd_sq = _mm256_fmadd_ps(dx, dx, eps);
+      rd_sq = _mm256_fmadd_ps(dy, dy, rd_sq);
+      rd_sq = _mm256_fmadd_ps(dz, dz, rd_sq);
+      __m256 rd_mag = _mm256_rsqrt_ps(rd_sq);
+      rd_mag = _mm256_mul_ps(
+          rd_mag, _mm256_fnmadd_ps(_mm256_mul_ps(half, rd_sq),
+                                   _mm256_mul_ps(rd_mag, rd_mag), three_half));
+      const __m256 impulse =
+          _mm256_mul_ps(_mm256_loadu_ps(m + j),
+                        _mm256_mul_ps(rd_mag, _mm256_mul_ps(rd_mag, rd_mag)));
+      sx = _mm256_fmadd_ps(dx, impulse, sx);
+      sy = _mm256_fmadd_ps(dy, impulse, sy);
+      sz = _mm256_fmadd_ps(dz, impulse, sz);
+    }
+    float fx = hsum_avx2(sx);
+    float fy = hsum_avx2(sy);
+    float fz = hsum_avx2(sz);
+    force_tail(x, y, z, m, nvec, n, x[i], y[i], z[i], fx, fy, fz);
+    ax[i] = fx;
+    ay[i] = fy;
+    az[i] = fz;
+  }
+}
+
+// 16 sources per step, rsqrt14 has 14 bits before the Newton step
+__attribute__((target("avx512f"))) inline void
+force_block_avx512(const float *x, const float *y, const float *z,
+                   const float *m, int n, const int *targets, int ibegin,
+                   int iend, float *ax, float *ay, float *az) {
+  const int nvec = n - n % 16;
+  const __m512 eps = _mm512_set1_ps(0.00001f);
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512 three_half = _mm512_set1_ps(1.5f);
+  for (int k = ibegin; k < iend; k++) {
+    const int i = targets ? targets[k] : k;
+    const __m512 xi = _mm512_set1_ps(x[i]);
+    const __m512 yi = _mm512_set1_ps(y[i]);
+    const __m512 zi = _mm512_set1_ps(z[i]);
+    __m512 sx = _mm512_setzero_ps();
+    __m512 sy = _mm512_setzero_ps();
+    __m512 sz = _mm512_setzero_ps();
+    for (int j = 0; j < nvec; j += 16) {
+      const __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + j), xi);
+      const __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + j), yi);
+      const __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(z + j), zi);
+      __m512 rd_sq = _mm512_fmadd_ps(dx, dx, eps);
+      rd_sq = _mm512_fmadd_ps(dy, dy, rd_sq);
+      rd_sq = _mm512_fmadd_ps(dz, dz, rd_sq);
+      __m512 rd_mag = _mm512_rsqrt14_ps(rd_sq);
+      rd_mag = _mm512_mul_ps(
+          rd_mag, _mm512_fnmadd_ps(_mm512_mul_ps(half, rd_sq),
+                                   _mm512_mul_ps(rd_mag, rd_mag), three_half));
+      const __m512 impulse =
+          _mm512_mul_ps(_mm512_loadu_ps(m + j),
+                        _mm512_mul_ps(rd_mag, _mm512_mul_ps(rd_mag, rd_mag)));
+      sx = _mm512_fmadd_ps(dx, impulse, sx);
+      sy = _mm512_fmadd_ps(dy, impulse, sy);
+      sz = _mm512_fmadd_ps(dz, impulse, sz);
+    }
+    float fx = _mm512_reduce_add_ps(sx);
+    float fy = _mm512_reduce_add_ps(sy);
+    float fz = _mm512_reduce_add_ps(sz);
+    force_tail(x, y, z, m, nvec, n, x[i], y[i], z[i], fx, fy, fz);
+    ax[i] = fx;
+    ay[i] = fy;
+    az[i] = fz;
+  }
+}
+#endif
+
+// forces on targets [ibegin, iend) with the kernel for isa
+inline void force_block(SimdIsa isa, const float *x, const float *y,
+                        const float *z, const float *m, int n,
+                        const int *targets, int ibegin, int iend, float *ax,
+                        float *ay, float *az) {
+  switch (isa) {
+#ifdef NBODY_X86_SIMD
+  case SimdIsa::avx512:
+    force_block_avx512(x, y, z, m, n, targets, ibegin, iend, ax, ay, az);
+    break;
+  case SimdIsa::avx2:
+    force_block_avx2(x, y, z, m, n, targets, ibegin, iend, ax, ay, az);
+    break;
+  case SimdIsa::sse:
+    force_block_sse(x, y, z, m, n, targets, ibegin, iend, ax, ay, az);
+    break;
+#endif
+  default:
+    force_block_scalar(x, y, z, m, n, targets, ibegin, iend, ax, ay, az);
+    break;
+  }
+}
+}
+
+inline SimdIsa detect_simd_isa() {
+#ifdef NBODY_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return SimdIsa::avx512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return SimdIsa::avx2;
+  return SimdIsa::sse;
+#else
+  return SimdIsa::scalar;
+#endif
+}
+
+inline SimdIsa resolve_simd_isa(SimdIsa requested) {
+  const SimdIsa best = detect_simd_isa();
+  if (requested == SimdIsa::automatic)
+    return best;
+  if (static_cast<int>(requested) > static_cast<int>(best))
+    return best;
+  return requested;
+}
+
+inline const char *simd_isa_name(SimdIsa isa) {
+  switch (isa) {
+  case SimdIsa::scalar:
+    return "scalar";
+  case SimdIsa::sse:
+    return "sse";
+  case SimdIsa::avx2:
+    return "avx2";
+  case SimdIsa::avx512:
+    return "avx512";
+  default:
+    return "auto";
+  }
+}
+
+namespace {
+// forces on num_targets targets from all particles at pos with masses mss,
+// particle indices of the targets come from targets, nullptr for
+// 0..num_targets-1
+// use for_each over blocks of targets to parallelize
+inline void simd_forces(const Vec3SoA<float> &pos, const aligned_vector<float> &mss,
+                        Vec3SoA<float> &accel, SimdIsa isa, const int *targets,
+                        int num_targets) {
+  const int sys_size = mss.size();
+  const IndexRange blocks =
+      index_range((num_targets + simd_block_size - 1) / simd_block_size);
+
+  float const *xptr = pos.x.data();
+  float const *yptr = pos.y.data();
+  float const *zptr = pos.z.data();
+  float const *mssptr = mss.data();
+  float *axptr = accel.x.data();
+  float *ayptr = accel.y.data();
+  float *azptr = accel.z.data();
+  std::for_each(std::execution::par_unseq, std::begin(blocks),
+                std::end(blocks), [=](int b) {
+                  const int kbegin = b * simd_block_size;
+                  const int kend = std::min(kbegin + simd_block_size, num_targets);
+                  force_block(isa, xptr, yptr, zptr, mssptr, sys_size, targets,
+                              kbegin, kend, axptr, ayptr, azptr);
+                });
+}
+
+// SoA copy of the positions and masses of an AoS system into the soa_pos
+// and soa_mss buffers of its workspace
+template <class vecT> void transpose_system(System<vecT> &system) {
+  using T = typename vecT::value_type;
+  const IndexRange sys_i = index_range(system.sysPos.size());
+  SimdBuffers<vecT> &work = system.workspace.simd;
+  work.soa_pos.resize(system.sysPos.size());
+  work.soa_mss.resize(system.sysPos.size());
+
+  T *xptr = work.soa_pos.x.data();
+  T *yptr = work.soa_pos.y.data();
+  T *zptr = work.soa_pos.z.data();
+  T *mssptr = work.soa_mss.data();
+  vecT const *posptr = system.sysPos.data();
+  T const *aos_mssptr = system.sysMss.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                std::end(sys_i), [=](int i) {
+                  xptr[i] = posptr[i].x;
+                  yptr[i] = posptr[i].y;
+                  zptr[i] = posptr[i].z;
+                  mssptr[i] = aos_mssptr[i];
+                });
+}
+}
+
+// Calculate all-pairs forces with the SIMD kernel for isa
+// the kernels are single precision, other types use the portable kernel
+template <class vecT, typename T>
+void accumulate_forces_simd(SystemSoA<vecT> &system, Vec3SoA<T> &accel,
+                            SimdIsa isa) {
+  if constexpr (!std::is_same_v<T, float>)
+    accumulate_forces(system, accel);
+  else
+    simd_forces(system.sysPos, system.sysMss, accel, isa, nullptr,
+                system.sysMss.size());
+}
+
+template <class vecT>
+void accumulate_forces_simd(System<vecT> &system, std::vector<vecT> &accel,
+                            SimdIsa isa) {
+  using T = typename vecT::value_type;
+  transpose_system(system);
+  SimdBuffers<vecT> &work = system.workspace.simd;
+  Vec3SoA<T> &soa_acc = system.workspace.integrator.accel_soa;
+  soa_acc.resize(work.soa_mss.size());
+
+  if constexpr (!std::is_same_v<T, float>)
+    soa_forces(work.soa_pos, work.soa_mss, soa_acc, {});
+  else
+    simd_forces(work.soa_pos, work.soa_mss, soa_acc, isa, nullptr,
+                work.soa_mss.size());
+
+  const IndexRange sys_i = index_range(work.soa_mss.size());
+  T const *axptr = soa_acc.x.data();
+  T const *ayptr = soa_acc.y.data();
+  T const *azptr = soa_acc.z.data();
+  std::transform(std::execution::par_unseq, std::begin(sys_i),
+                 std::end(sys_i), std::begin(accel), [=](int i) {
+                   return vecT(axptr[i], ayptr[i], azptr[i]);
+                 });
+}
+
+template <class vecT>
+void accumulate_forces_simd(System<vecT> &system, std::vector<vecT> &accel,
+                            SimdIsa isa, const std::vector<int> &active) {
+  using T = typename vecT::value_type;
+  if constexpr (!std::is_same_v<T, float>) {
+    accumulate_forces(system, accel, active);
+  } else {
+    transpose_system(system);
+    SimdBuffers<vecT> &work = system.workspace.simd;
+    Vec3SoA<T> &soa_acc = system.workspace.integrator.accel_soa;
+    soa_acc.resize(work.soa_mss.size());
+
+    simd_forces(work.soa_pos, work.soa_mss, soa_acc, isa, active.data(),
+                active.size());
+
+    T const *axptr = soa_acc.x.data();
+    T const *ayptr = soa_acc.y.data();
+    T const *azptr = soa_acc.z.data();
+    vecT *accptr = accel.data();
+    std::for_each(std::execution::par_unseq, std::begin(active),
+                  std::end(active), [=](int i) {
+                    accptr[i] = vecT(axptr[i], ayptr[i], azptr[i]);
+                  });
+  }
+}
@@ -0,0 +1,65 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "system.hh"
+
+// Binary snapshot file
+// 64 byte header followed by raw arrays, all offsets are multiples of 64:
+//   positions  N x 3 values (x, y, z)
+//   velocities N x 3 values
+//   masses     N values
+// values are stored in native byte order with value_size bytes each
+struct SnapshotHeader {
+  char magic[8];        // "NBODYSNP"
+  uint32_t version;
+  uint32_t value_size;  // sizeof(T)
+  uint64_t step;
+  double time;
+  uint64_t num_bodies;
+  uint64_t pos_offset;  // byte offsets from the start of the file
+  uint64_t vel_offset;
+  uint64_t mss_offset;
+};
+static_assert(sizeof(SnapshotHeader) == 64);
+
+// write snapshot file
+template <class vecT>
+void write_snapshot(const std::string &filename, int step, double time,
+                    System<vecT> &system);
+template <class vecT>
+void write_snapshot(const std::string &filename, int step, double time,
+                    SystemSoA<vecT> &system);
+
+// header of a snapshot of num_bodies particles with values of type T
+template <typename T>
+SnapshotHeader make_snapshot_header(int step, double time, uint64_t num_bodies);
+
+// pack x, y, z of positions and velocities into workspace.output.pack_pos / pack_vel
+// in original particle order, the masses of reordered systems go to pack_mss
+template <class vecT> void pack_snapshot(System<vecT> &system);
+
+// read snapshot file into system, returns the header
+template <class vecT>
+SnapshotHeader read_snapshot(const std::string &filename, System<vecT> &system);
+
+// Read-only memory mapped snapshot, arrays point into the mapping
+template <typename T> class SnapshotView {
+public:
+  SnapshotHeader header;
+  const T *pos{nullptr}; // x, y, z of particle i at pos[3 * i]
+  const T *vel{nullptr};
+  const T *mss{nullptr};
+
+  SnapshotView(const std::string &filename);
+  ~SnapshotView();
+  SnapshotView(const SnapshotView &) = delete;
+  SnapshotView &operator=(const SnapshotView &) = delete;
+
+private:
+  void *data{nullptr};
+  std::size_t length{0};
+};
+
+#include "snapshot_impl.hh"
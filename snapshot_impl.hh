@@ -0,0 +1,254 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <execution>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "distributed.hh"
+#include "instrumentation.hh"
+#include "snapshot.hh"
+
+namespace {
+static constexpr char snapshot_magic[8] = {'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P'};
+static constexpr uint32_t snapshot_version = 1;
+
+// round byte offset up to the next multiple of 64
+inline uint64_t snapshot_align(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+
+inline void check_snapshot_header(const SnapshotHeader &header,
+                                  uint32_t value_size,
+                                  const std::string &filename) {
+  if (std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+      header.version != snapshot_version) {
+    std::cout << "ERROR: " << filename << " is not a snapshot file, exiting.\n";
+    exit(1);
+  }
+  if (header.value_size != value_size) {
+    std::cout << "ERROR: " << filename << " has a different value type, exiting.\n";
+    exit(1);
+  }
+}
+
+// every array of the header lies after the header inside a file of length
+// bytes, at an offset aligned like the writer aligns it; the sizes are
+// checked by division so that a corrupt count cannot overflow
+inline void check_snapshot_arrays(const SnapshotHeader &header, uint64_t length,
+                                  const std::string &filename) {
+  if (header.num_bodies > uint64_t(std::numeric_limits<int>::max())) {
+    std::cout << "ERROR: " << filename << " has too many particles, exiting.\n";
+    exit(1);
+  }
+  // offset and number of values
+  const std::pair<uint64_t, uint64_t> arrays[] = {
+      {header.pos_offset, 3 * header.num_bodies},
+      {header.vel_offset, 3 * header.num_bodies},
+      {header.mss_offset, header.num_bodies}};
+  for (const auto &[offset, count] : arrays) {
+    if (offset < sizeof(SnapshotHeader) || offset != snapshot_align(offset)) {
+      std::cout << "ERROR: " << filename << " has a misaligned array, exiting.\n";
+      exit(1);
+    }
+    if (offset > length || count > (length - offset) / header.value_size) {
+      std::cout << "ERROR: " << filename << " is truncated, exiting.\n";
+      exit(1);
+    }
+  }
+}
+
+// write array at offset, zero padding up to it
+template <typename T>
+void write_snapshot_array(std::ofstream &outfile, uint64_t offset,
+                          const std::vector<T> &values) {
+  static constexpr char zeros[64] = {};
+  const uint64_t pos = outfile.tellp();
+  outfile.write(zeros, offset - pos);
+  outfile.write(reinterpret_cast<const char *>(values.data()),
+                values.size() * sizeof(T));
+}
+
+template <typename T>
+void write_snapshot_file(const std::string &filename,
+                         const SnapshotHeader &header,
+                         const std::vector<T> &pos, const std::vector<T> &vel,
+                         const std::vector<T> &mss) {
+  NBODY_TIMER("write_snapshot");
+  std::ofstream outfile(filename, std::ios::binary);
+  outfile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  write_snapshot_array(outfile, header.pos_offset, pos);
+  write_snapshot_array(outfile, header.vel_offset, vel);
+  write_snapshot_array(outfile, header.mss_offset, mss);
+  NBODY_COUNT("bytes.write_snapshot", uint64_t(outfile.tellp()));
+  if (!outfile)
+    std::cout << "WARNING: failed to write " << filename << "\n";
+}
+}
+
+template <typename T>
+SnapshotHeader make_snapshot_header(int step, double time, uint64_t num_bodies) {
+  SnapshotHeader header;
+  std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  header.version = snapshot_version;
+  header.value_size = sizeof(T);
+  header.step = step;
+  header.time = time;
+  header.num_bodies = num_bodies;
+  header.pos_offset = sizeof(SnapshotHeader);
+  header.vel_offset = snapshot_align(header.pos_offset + 3 * num_bodies * sizeof(T));
+  header.mss_offset = snapshot_align(header.vel_offset + 3 * num_bodies * sizeof(T));
+  return header;
+}
+
+template <class vecT> void pack_snapshot(System<vecT> &system) {
+  using U = typename vecT::value_type;
+  const int sys_size = system.sysPos.size();
+  // pack x, y, z without the padding of Vec3
+  std::vector<U> &pos = system.workspace.output.pack_pos;
+  std::vector<U> &vel = system.workspace.output.pack_vel;
+  pos.resize(3 * sys_size);
+  vel.resize(3 * sys_size);
+  vecT const *posptr = system.sysPos.data();
+  vecT const *velptr = system.sysVel.data();
+  U *ppack = pos.data();
+  U *vpack = vel.data();
+  if (system.sysId.empty()) {
+    std::for_each(std::execution::par_unseq, std::begin(system.sysPos),
+                  std::end(system.sysPos), [=](const vecT &p) {
+                    const size_t i = &p - posptr;
+                    ppack[3 * i] = p.x;
+                    ppack[3 * i + 1] = p.y;
+                    ppack[3 * i + 2] = p.z;
+                    vpack[3 * i] = velptr[i].x;
+                    vpack[3 * i + 1] = velptr[i].y;
+                    vpack[3 * i + 2] = velptr[i].z;
+                  });
+    return;
+  }
+  // reordered particles go back to the slot of their id, masses too
+  std::vector<U> &mss = system.workspace.output.pack_mss;
+  mss.resize(sys_size);
+  U const *mssptr = system.sysMss.data();
+  int const *idptr = system.sysId.data();
+  U *mpack = mss.data();
+  std::for_each(std::execution::par_unseq, std::begin(system.sysPos),
+                std::end(system.sysPos), [=](const vecT &p) {
+                  const size_t i = &p - posptr;
+                  const size_t k = idptr[i];
+                  ppack[3 * k] = p.x;
+                  ppack[3 * k + 1] = p.y;
+                  ppack[3 * k + 2] = p.z;
+                  vpack[3 * k] = velptr[i].x;
+                  vpack[3 * k + 1] = velptr[i].y;
+                  vpack[3 * k + 2] = velptr[i].z;
+                  mpack[k] = mssptr[i];
+                });
+}
+
+template <class vecT>
+void write_snapshot(const std::string &filename, int step, double time,
+                    System<vecT> &system) {
+  using U = typename vecT::value_type;
+#ifdef ENABLE_MPI
+  if (system.num_ranks > 1) {
+    write_snapshot_collective(filename, step, time, system);
+    return;
+  }
+#endif
+  pack_snapshot(system);
+  write_snapshot_file(filename,
+                      make_snapshot_header<U>(step, time, system.sysPos.size()),
+                      system.workspace.output.pack_pos, system.workspace.output.pack_vel,
+                      system.sysId.empty() ? system.sysMss
+                                           : system.workspace.output.pack_mss);
+}
+
+template <class vecT>
+void write_snapshot(const std::string &filename, int step, double time,
+                    SystemSoA<vecT> &system) {
+  using U = typename vecT::value_type;
+  const int sys_size = system.sysMss.size();
+  std::vector<U> &pos = system.workspace.output.pack_pos;
+  std::vector<U> &vel = system.workspace.output.pack_vel;
+  std::vector<U> &mss = system.workspace.output.pack_mss;
+  pos.resize(3 * sys_size);
+  vel.resize(3 * sys_size);
+  mss.assign(system.sysMss.begin(), system.sysMss.end());
+  U const *xptr = system.sysPos.x.data();
+  U const *yptr = system.sysPos.y.data();
+  U const *zptr = system.sysPos.z.data();
+  U const *vxptr = system.sysVel.x.data();
+  U const *vyptr = system.sysVel.y.data();
+  U const *vzptr = system.sysVel.z.data();
+  U *ppack = pos.data();
+  U *vpack = vel.data();
+  const IndexRange sys_i = index_range(system.sysMss.size());
+  std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                std::end(sys_i), [=](int i) {
+                  ppack[3 * i] = xptr[i];
+                  ppack[3 * i + 1] = yptr[i];
+                  ppack[3 * i + 2] = zptr[i];
+                  vpack[3 * i] = vxptr[i];
+                  vpack[3 * i + 1] = vyptr[i];
+                  vpack[3 * i + 2] = vzptr[i];
+                });
+  write_snapshot_file(filename, make_snapshot_header<U>(step, time, sys_size),
+                      pos, vel, mss);
+}
+
+template <class vecT>
+SnapshotHeader read_snapshot(const std::string &filename, System<vecT> &system) {
+  using T = typename vecT::value_type;
+  SnapshotView<T> view(filename);
+  const int sys_size = view.header.num_bodies;
+  system.num_bodies = sys_size;
+  system.sysPos.resize(sys_size);
+  system.sysVel.resize(sys_size);
+  system.sysAcc.assign(sys_size, vecT());
+  system.sysMss.assign(view.mss, view.mss + sys_size);
+  system.sysId.clear();
+  for (int i = 0; i < sys_size; i++) {
+    system.sysPos[i] = vecT(view.pos[3 * i], view.pos[3 * i + 1], view.pos[3 * i + 2]);
+    system.sysVel[i] = vecT(view.vel[3 * i], view.vel[3 * i + 1], view.vel[3 * i + 2]);
+  }
+  return view.header;
+}
+
+template <typename T> SnapshotView<T>::SnapshotView(const std::string &filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cout << "ERROR: cannot open " << filename << ", exiting.\n";
+    exit(1);
+  }
+  length = st.st_size;
+  data = length >= sizeof(SnapshotHeader)
+             ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0)
+             : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cout << "ERROR: cannot map " << filename << ", exiting.\n";
+    exit(1);
+  }
+  std::memcpy(&header, data, sizeof(header));
+  // magic, version and value size, then the ranges of the arrays the
+  // pointers below are cast to
+  check_snapshot_header(header, sizeof(T), filename);
+  check_snapshot_arrays(header, length, filename);
+  const char *bytes = static_cast<const char *>(data);
+  pos = reinterpret_cast<const T *>(bytes + header.pos_offset);
+  vel = reinterpret_cast<const T *>(bytes + header.vel_offset);
+  mss = reinterpret_cast<const T *>(bytes + header.mss_offset);
+}
+
+template <typename T> SnapshotView<T>::~SnapshotView() {
+  if (data)
+    munmap(data, length);
+}
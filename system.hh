@@ -1,7 +1,77 @@
 
 #pragma once
 
+#include <cstdint>
+#include <string>
 #include <vector>
+#include "numa.hh"
+#include "reorder.hh"
+#include "vec_soa.hh"
+#include "workspace.hh"
+
+// Particle storage layouts
+enum class Layout : int {
+  aos = 1, // System, array of Vec3
+  soa = 2, // SystemSoA, separate x/y/z arrays
+};
+
+// Snapshot file formats, combine as bit flags
+enum class OutputFormat : int {
+  none = 0,
+  text = 1,   // velocity_magnitude.<n>.3D
+  binary = 2, // snapshot.<n>.bin, see snapshot.hh
+  both = 3,
+};
+
+// Force calculation engines
+enum class ForceEngine : int {
+  direct = 1,     // all-pairs, O(N^2)
+  barnes_hut = 2, // octree, O(N log N)
+  fmm = 3,        // fast multipole, O(N log N) with the tree build
+  tiled = 4,      // all-pairs, cache blocked
+  simd = 5,       // all-pairs, explicit SIMD
+  symmetric = 6,  // all-pairs, each pair evaluated once
+  pm = 7,         // particle mesh, FFT Poisson solve, O(N + M log M)
+  p3m = 8,        // particle mesh plus direct short-range pairs
+};
+
+// Mass assignment of the particle-mesh engines, see particle_mesh.hh
+enum class MassAssignment : int {
+  cic = 1, // cloud in cell, 2^3 nodes
+  tsc = 2, // triangular shaped cloud, 3^3 nodes
+};
+
+// Instruction sets of the SIMD force kernels
+enum class SimdIsa : int {
+  automatic = 0, // best supported by the CPU
+  scalar = 1,
+  sse = 2,
+  avx2 = 3,
+  avx512 = 4,
+};
+
+// Precision of the force sums, mixed and kahan only with the direct engine
+enum class Precision : int {
+  single = 1, // storage precision for everything
+  mixed = 2,  // float pairwise terms, double sums
+  kahan = 3,  // float pairwise terms, compensated float sums
+};
+
+// Time integrators
+enum class Integrator : int {
+  verlet = 1, // velocity Verlet, shared time step
+  block = 2,  // kick-drift-kick with power-of-two block time steps
+  fused = 3,  // velocity Verlet, kicks fused into the drift and force passes
+  hermite = 4, // 4th order Hermite predictor-corrector, direct forces and jerks
+  yoshida = 5, // 4th order symplectic, three fused Verlet substeps
+};
+
+// Time step control, see timestep.hh
+enum class TimestepControl : int {
+  fixed = 0,        // timestep every step
+  acceleration = 1, // dt_i = eta sqrt(eps / |a_i|), eps = timestep_length
+  aarseth = 2,      // dt_i = eta |a_i| / |j_i|, j_i the jerk of particle i
+};
 
 struct Config {
 #if defined(ENABLE_CUDA) || defined(ENABLE_ACPP)
@@ -11,8 +81,46 @@ struct Config {
 #endif
   int nbodies{-1};
   int shape{-1};
-  float timestep;
+  int64_t seed{-1};   // initial condition seed, -1 draws one from std::random_device
+  float galaxy_mass{1.e10f};  // central mass of each rotating_4 galaxy
+  float central_mass{1.e13f}; // mass at the center of rotating_4
+  float timestep;      // fixed step, largest adaptive step
   float end_time;
+  TimestepControl timestep_control{TimestepControl::fixed};
+  float timestep_eta{0.02f};   // accuracy of the adaptive step criterion
+  float timestep_length{0.0f}; // eps of the acceleration criterion, 0 mean separation
+  float min_timestep{0.0f};    // smallest adaptive step, 0 timestep / 2^20
+  float output_interval{0.0f}; // simulated time between outputs, 0 20 timesteps
+  ForceEngine engine{ForceEngine::direct};
+  float theta{0.5f}; // Barnes-Hut / FMM opening angle
+  int fmm_order{4};   // FMM expansion order
+  int pm_grid{64};    // particle-mesh cells per dimension, power of 2
+  MassAssignment pm_assignment{MassAssignment::tsc};
+  float pm_split{1.25f}; // long/short-range split scale r_s in mesh cells
+  Layout layout{Layout::aos};
+  int tile_i{0};      // tiled engine block sizes, 0 tunes them at setup
+  int tile_j{0};
+  SimdIsa simd_isa{SimdIsa::automatic};
+  Precision precision{Precision::single};
+  bool double_positions{false}; // System<Vec3<double>> instead of float
+  Integrator integrator{Integrator::verlet};
+  int block_levels{6};   // block time steps down to timestep / 2^block_levels
+  float block_eta{0.02f}; // block time step accuracy, dt_i = eta |a_i| / |j_i|
+  OutputFormat output{OutputFormat::binary};
+  int output_queue{2}; // snapshots in flight to the writer thread, 0 writes inline
+  NumaMode numa{NumaMode::off};
+  ThreadPinning pin{ThreadPinning::none};
+  bool diagnostics{false}; // conservation time series, see diagnostics.hh
+  SortCurve sort_curve{SortCurve::none}; // particle order, see reorder.hh
+  int sort_interval{10}; // steps between reorders along sort_curve
+  float merge_radius{0.0f}; // capture radius of close pairs, see merging.hh, 0 off
+  int checkpoint_interval{0}; // steps between checkpoints, 0 disables them
+  std::string checkpoint_file{"checkpoint.bin"};
+  std::string restart_file;   // resume from this checkpoint instead of setup
+  std::string output_prefix;  // prepended to snapshot and checkpoint file names
+  std::string ensemble_file;  // run the members listed here, see ensemble.hh
+  std::string trace_file;     // Chrome trace of an instrumented build, if set
+  bool hw_counters{false};    // instrumented builds only
 };
 
 template <class vecT> struct System {
@@ -21,16 +129,118 @@ template <class vecT> struct System {
   std::vector<vecT> sysVel; // velocities
   std::vector<vecT> sysAcc; // accel
   std::vector<T> sysMss;    // mass
+  std::vector<int> sysId;   // original index, empty until reordered
+  std::vector<vecT> sysJerk; // Hermite or estimated jerk, belongs to step jerk_step
+  Workspace<vecT> workspace; // scratch buffers of the kernels
   int num_bodies{0};
   T end_time{0.0};
-  T timestep{0.0};
-  T elapsed_time{0.0};
+  T timestep{0.0};        // current step
+  double elapsed_time{0.0};
+  int step{0};    // completed time steps
+  int filenum{0}; // next snapshot number
+  TimestepControl timestep_control{TimestepControl::fixed};
+  T max_timestep{0.0};
+  T min_timestep{0.0};
+  T timestep_eta{0.02};
+  T timestep_length{0.0};
+  bool timestep_clamped{false}; // the criterion asked for less than min_timestep
+  double output_interval{0.0};
+  float galaxy_mass{1.e10f}; // rotating_4 masses
+  float central_mass{1.e13f};
+  ForceEngine engine{ForceEngine::direct};
+  T theta{0.5};
+  int fmm_order{4};
+  int pm_grid{64};
+  MassAssignment pm_assignment{MassAssignment::tsc};
+  T pm_split{1.25};
+  int tile_i{0};
+  int tile_j{0};
+  SimdIsa simd_isa{SimdIsa::automatic};
+  Precision precision{Precision::single};
+  Integrator integrator{Integrator::verlet};
+  int block_levels{6};
+  T block_eta{0.02};
+  int jerk_step{-1};
+  OutputFormat output{OutputFormat::binary};
+  int output_queue{2};
+  std::string output_prefix;
+  NumaMode numa{NumaMode::off};
+  SortCurve sort_curve{SortCurve::none};
+  int sort_interval{10};
+  T merge_radius{0.0};
+  bool diagnostics{false};
+  bool want_potential{false}; // next force pass stores workspace.output.potential
+  bool has_potential{false};  // workspace.output.potential is up to date
+  int checkpoint_interval{0};
+  std::string checkpoint_file;
+  int rank{0};      // MPI rank, see distributed.hh
+  int num_ranks{1};
+  int first{0};     // global index of sysPos[0], num_bodies counts all ranks
   System() {}
+  void configure(const Config &config);
   void setup(Config &config);
+  void restart(Config &config);
   void advance();
 };
 
+// Structure of arrays particle storage
+// same interface as System, but each component lives in its own
+// cache line aligned array
+// only the direct and SIMD force engines work on this layout
+template <class vecT> struct SystemSoA {
+  using T = typename vecT::value_type;
+  Vec3SoA<T> sysPos;         // positions
+  Vec3SoA<T> sysVel;         // velocities
+  Vec3SoA<T> sysAcc;         // accel
+  aligned_vector<T> sysMss;  // mass
+  Workspace<vecT> workspace; // scratch buffers of the kernels
+  int num_bodies{0};
+  T end_time{0.0};
+  T timestep{0.0};        // current step
+  double elapsed_time{0.0};
+  int step{0};    // completed time steps
+  int filenum{0}; // next snapshot number
+  TimestepControl timestep_control{TimestepControl::fixed};
+  T max_timestep{0.0};
+  T min_timestep{0.0};
+  T timestep_eta{0.02};
+  T timestep_length{0.0};
+  bool timestep_clamped{false};
+  double output_interval{0.0};
+  ForceEngine engine{ForceEngine::direct};
+  SimdIsa simd_isa{SimdIsa::automatic};
+  Integrator integrator{Integrator::verlet};
+  OutputFormat output{OutputFormat::binary};
+  int output_queue{2};
+  std::string output_prefix;
+  bool diagnostics{false};
+  bool want_potential{false}; // the SoA kernels never store potentials
+  bool has_potential{false};
+  int checkpoint_interval{0};
+  std::string checkpoint_file;
+  SystemSoA() {}
+  void configure(const Config &config);
+  void setup(Config &config);
+  void restart(Config &config);
+  void advance();
+};
+
+// time loop shared by System and SystemSoA
+template <class SystemT> void advance_system(SystemT &system);
+
+// simulated time between snapshots, system.output_interval or 20 of the
+// largest time steps if it is 0
+template <class SystemT> double output_interval(const SystemT &system);
+
+// fixed time steps write a snapshot after every output_steps steps
+template <class SystemT> int output_steps(const SystemT &system);
+
+// write snapshot files selected by system.output
+template <class SystemT>
+void write_output(int filenum, int step, double time, SystemT &system);
+
 // write points.3D file
 template <class vecT> void write_points(int filenum, System<vecT> &system);
+template <class vecT> void write_points(int filenum, SystemSoA<vecT> &system);
 
 #include "system_impl.hh"
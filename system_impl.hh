@@ -1,13 +1,91 @@
 
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <execution>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <numeric>
+#include <optional>
+#include <random>
+#include "async_writer.hh"
+#include "checkpoint.hh"
+#include "diagnostics.hh"
+#include "distributed.hh"
+#include "forces.hh"
+#include "instrumentation.hh"
+#include "merging.hh"
+#include "numa.hh"
+#include "particle_mesh.hh"
+#include "physics.hh"
+#include "reorder.hh"
+#include "simd_kernels.hh"
+#include "snapshot.hh"
 #include "system.hh"
 #include "time_integration.hh"
+#include "timestep.hh"
 #include "utils.hh"
 
+// copy run parameters from config
+template <class vecT> void System<vecT>::configure(const Config &config) {
+  if (config.integrator == Integrator::hermite &&
+      (config.engine != ForceEngine::direct || config.precision != Precision::single))
+    std::cout << "WARNING: the Hermite integrator computes forces and jerks with "
+                 "its own all-pairs kernel\n";
+  const bool mixed_engine = config.precision == Precision::single ||
+                            config.engine == ForceEngine::direct;
+  if (!mixed_engine && all_pairs(config.engine))
+    std::cout << "WARNING: mixed and kahan sums only support the direct force "
+                 "engine, using direct\n";
+  else if (!mixed_engine)
+    std::cout << "WARNING: mixed and kahan sums only support the direct force "
+                 "engine, using single precision sums\n";
+  num_bodies = config.nbodies;
+  end_time = config.end_time;
+  timestep = config.timestep;
+  max_timestep = config.timestep;
+  min_timestep = config.min_timestep;
+  timestep_control = config.timestep_control;
+  timestep_eta = config.timestep_eta;
+  timestep_length = config.timestep_length;
+  output_interval = config.output_interval;
+  galaxy_mass = config.galaxy_mass;
+  central_mass = config.central_mass;
+  engine = mixed_engine || !all_pairs(config.engine) ? config.engine
+                                                    : ForceEngine::direct;
+  theta = config.theta;
+  fmm_order = config.fmm_order;
+  pm_grid = std::clamp(int(std::bit_ceil(unsigned(std::max(config.pm_grid, 1)))),
+                       pm_min_grid, pm_max_grid);
+  if (pm_grid != config.pm_grid &&
+      (engine == ForceEngine::pm || engine == ForceEngine::p3m))
+    std::cout << "WARNING: the particle-mesh grid is a power of 2 in ["
+              << pm_min_grid << ", " << pm_max_grid << "], using " << pm_grid
+              << "\n";
+  pm_assignment = config.pm_assignment;
+  pm_split = config.pm_split;
+  tile_i = config.tile_i;
+  tile_j = config.tile_j;
+  simd_isa = resolve_simd_isa(config.simd_isa);
+  precision = mixed_engine || all_pairs(config.engine) ? config.precision
+                                                       : Precision::single;
+  integrator = config.integrator;
+  block_levels = std::clamp(config.block_levels, 0, 20);
+  block_eta = config.block_eta;
+  output = config.output;
+  output_queue = config.output_queue;
+  output_prefix = config.output_prefix;
+  numa = config.numa;
+  sort_curve = config.sort_curve;
+  sort_interval = config.sort_interval;
+  merge_radius = config.merge_radius;
+  diagnostics = config.diagnostics;
+  checkpoint_interval = config.checkpoint_interval;
+  checkpoint_file = config.output_prefix + config.checkpoint_file;
+}
+
 template <class vecT> void System<vecT>::setup(Config &config) {
   if (config.nbodies == -1) {
     if (config.device == 1) {
@@ -22,43 +100,285 @@ template <class vecT> void System<vecT>::setup(Config &config) {
     config.timestep = 1.0f;
     config.end_time = 10000.0f;
   }
-  num_bodies = config.nbodies;
-  end_time = config.end_time;
-  timestep = config.timestep;
+  configure(config);
+
+  // a drawn seed is printed, so that the run can be repeated
+  if (config.seed < 0) {
+    config.seed = std::random_device()();
+    std::cout << "seed: " << config.seed << "\n";
+  }
+  seed_rng(config.seed);
 
   //rotating_n(*this);
   rotating_4(*this);
 
   // Acceleration vector still neds to be initialized
   sysAcc = std::vector<vecT>(num_bodies, vecT());
+  distribute_particles(*this);
+  if (numa != NumaMode::off)
+    first_touch(*this);
+
+  if (engine == ForceEngine::tiled && (tile_i <= 0 || tile_j <= 0))
+    tune_tile_sizes(*this);
+  if (engine == ForceEngine::simd)
+    std::cout << "SIMD force kernel: " << simd_isa_name(simd_isa) << "\n";
+}
+
+// resume from config.restart_file, skips the initial conditions
+// particle count, time step and end time come from the checkpoint
+template <class vecT> void System<vecT>::restart(Config &config) {
+  configure(config);
+  read_checkpoint(config.restart_file, *this);
+  config.nbodies = num_bodies;
+  config.timestep = timestep;
+  config.end_time = end_time;
+  distribute_particles(*this);
+  if (numa != NumaMode::off)
+    first_touch(*this);
+
+  if (engine == ForceEngine::tiled && (tile_i <= 0 || tile_j <= 0))
+    tune_tile_sizes(*this);
+  std::cout << "restarted at step " << step << ", time " << elapsed_time << "\n";
+}
+
+template <class vecT> void System<vecT>::advance() { advance_system(*this); }
+
+// copy run parameters from config
+template <class vecT> void SystemSoA<vecT>::configure(const Config &config) {
+  if (config.engine != ForceEngine::direct && config.engine != ForceEngine::simd)
+    std::cout << "WARNING: SoA layout only supports the direct and SIMD force "
+                 "engines, using direct\n";
+  if (config.precision != Precision::single)
+    std::cout << "WARNING: SoA layout only supports single precision sums\n";
+  if (config.integrator == Integrator::block ||
+      config.integrator == Integrator::hermite)
+    std::cout << "WARNING: SoA layout does not support block time steps or "
+                 "the Hermite integrator, using verlet\n";
+  if (config.numa == NumaMode::replicate)
+    std::cout << "WARNING: SoA layout does not replicate particles per node, "
+                 "using first-touch\n";
+  if (config.sort_curve != SortCurve::none)
+    std::cout << "WARNING: SoA layout does not reorder particles\n";
+  if (config.merge_radius > 0)
+    std::cout << "WARNING: SoA layout does not merge close pairs\n";
+  if (config.timestep_control == TimestepControl::aarseth)
+    std::cout << "WARNING: SoA layout has no jerks for the aarseth time step "
+                 "criterion, using acceleration\n";
+  num_bodies = config.nbodies;
+  end_time = config.end_time;
+  timestep = config.timestep;
+  max_timestep = config.timestep;
+  min_timestep = config.min_timestep;
+  timestep_control = config.timestep_control == TimestepControl::aarseth
+                         ? TimestepControl::acceleration
+                         : config.timestep_control;
+  timestep_eta = config.timestep_eta;
+  timestep_length = config.timestep_length;
+  output_interval = config.output_interval;
+  engine = config.engine == ForceEngine::simd ? ForceEngine::simd
+                                              : ForceEngine::direct;
+  simd_isa = resolve_simd_isa(config.simd_isa);
+  integrator = config.integrator == Integrator::fused ||
+                       config.integrator == Integrator::yoshida
+                   ? config.integrator
+                   : Integrator::verlet;
+  output = config.output;
+  output_queue = config.output_queue;
+  output_prefix = config.output_prefix;
+  diagnostics = config.diagnostics;
+  checkpoint_interval = config.checkpoint_interval;
+  checkpoint_file = config.output_prefix + config.checkpoint_file;
+}
+
+template <class vecT> void SystemSoA<vecT>::setup(Config &config) {
+  // initial conditions are generated in AoS layout and transposed once
+  System<vecT> aos;
+  aos.setup(config);
+  configure(config);
+
+  sysPos = Vec3SoA<T>(aos.sysPos);
+  sysVel = Vec3SoA<T>(aos.sysVel);
+  sysAcc = Vec3SoA<T>(aos.sysAcc);
+  sysMss = aligned_vector<T>(aos.sysMss.begin(), aos.sysMss.end());
+  if (config.numa != NumaMode::off)
+    first_touch(*this);
 }
 
-template <class vecT> void System<vecT>::advance() {
-  using T = typename vecT::value_type;
-  T time = 0.0f;
-  int cnt = 0;
-  int filenum = 0;
-  write_points(filenum++, *this); // initial
-  while (time <= end_time) {
-    integrate_verlet4(*this);
-    time += timestep;
+template <class vecT> void SystemSoA<vecT>::restart(Config &config) {
+  configure(config);
+  read_checkpoint(config.restart_file, *this);
+  config.nbodies = num_bodies;
+  config.timestep = timestep;
+  config.end_time = end_time;
+  if (config.numa != NumaMode::off)
+    first_touch(*this);
+  std::cout << "restarted at step " << step << ", time " << elapsed_time << "\n";
+}
+
+template <class vecT> void SystemSoA<vecT>::advance() { advance_system(*this); }
+
+// the loop state lives in system, so that a restarted system continues
+// where its checkpoint was taken
+template <class SystemT> void advance_system(SystemT &system) {
+  NBODY_TIMER("advance");
+  using T = typename SystemT::T;
+  double &time = system.elapsed_time;
+  int &cnt = system.step;
+  int &filenum = system.filenum;
+
+  // snapshot filenum is due at filenum * output_interval, fixed steps write
+  // every output_steps steps, adaptive steps land on the output times
+  const bool adaptive = system.timestep_control != TimestepControl::fixed;
+  const double interval = output_interval(system);
+  const int steps = output_steps(system);
+  const double end_time = system.end_time;
+
+  // hand snapshots to a writer thread unless output_queue is 0
+  std::optional<AsyncWriter<SystemT>> writer;
+  if (system.output_queue > 0 && system.output != OutputFormat::none)
+    writer.emplace(system, system.output_queue);
+  // conservation time series at the output cadence
+  std::optional<DiagnosticsLog> diagnostics;
+  if (system.diagnostics)
+    diagnostics.emplace(system.output_prefix + "diagnostics.txt", cnt > 0);
+  auto output = [&](int filenum) {
+    NBODY_TIMER("output");
+    if (diagnostics)
+      diagnostics->write(cnt, time, measure_diagnostics(system));
+    if (writer)
+      writer->submit(filenum, cnt, time, system);
+    else
+      write_output(filenum, cnt, time, system);
+  };
+
+  if (cnt == 0)
+    output(filenum++); // initial
+  // the first step size depends on Acc(0), which setup leaves zero
+  if (adaptive && cnt == 0) {
+    NBODY_TIMER("forces");
+    compute_forces(system, system.sysAcc);
+  }
+  // the aarseth criterion of integrators without jerks uses estimates
+  const bool jerk_estimate = system.timestep_control == TimestepControl::aarseth &&
+                             system.integrator != Integrator::hermite;
+  while (adaptive ? time < end_time : time <= end_time) {
+    bool output_due = (cnt + 1) % steps == 0;
+    double dt = system.timestep;
+    double target = 0.0;
+    if (adaptive) {
+      // a restart with a shorter interval continues at the next multiple
+      const double next_output =
+          std::max(filenum, int(time / interval) + 1) * interval;
+      target = std::min(next_output, end_time);
+      dt = next_timestep(system, target - time);
+      system.timestep = T(dt);
+      output_due = dt == target - time && target == next_output;
+    }
+    // potentials of the last force pass of a step are at the new positions,
+    // the block integrator ends with a pass over the active particles only
+    // and the Hermite pass is at the predicted positions
+    system.want_potential = diagnostics && output_due &&
+                            system.integrator != Integrator::block &&
+                            system.integrator != Integrator::hermite;
+    if (jerk_estimate)
+      save_accelerations(system);
+    integrate(system);
+    system.want_potential = false;
+    // fixed steps sum the time in T, so that runs keep their step count
+    if (!adaptive)
+      time = T(time) + system.timestep;
+    else if (dt == target - time)
+      time = target;
+    else
+      time += dt;
     ++cnt;
-    if (cnt % 20 == 0) {
+    if (jerk_estimate)
+      estimate_jerks(system, dt);
+    // before the output and checkpoint, a restart continues in this order
+    merge_close_pairs(system);
+    reorder_if_due(system);
+    if (output_due) {
       std::cout << "writing file at time: " << time << "\n";
-      write_points(filenum, *this); // every 20 timestep
+      output(filenum);
       ++filenum;
     }
+    if (system.checkpoint_interval > 0 && cnt % system.checkpoint_interval == 0) {
+      NBODY_TIMER("checkpoint");
+      // a restart continues after the snapshots queued so far, they have
+      // to be on disk when the checkpoint is
+      if (writer)
+        writer->flush();
+      write_checkpoint(system.checkpoint_file, system);
+    }
   }
+  if (writer)
+    writer->flush();
+}
+
+template <class SystemT> double output_interval(const SystemT &system) {
+  return system.output_interval > 0 ? system.output_interval
+                                    : 20.0 * system.max_timestep;
+}
+
+template <class SystemT> int output_steps(const SystemT &system) {
+  return std::max(1, int(std::lround(output_interval(system) / system.max_timestep)));
+}
+
+template <class SystemT>
+void write_output(int filenum, int step, double time, SystemT &system) {
+  const int output = static_cast<int>(system.output);
+  if (output & static_cast<int>(OutputFormat::text))
+    write_points(filenum, system);
+  if (output & static_cast<int>(OutputFormat::binary))
+    write_snapshot(system.output_prefix + "snapshot." + std::to_string(filenum) +
+                       ".bin",
+                   step, time, system);
 }
 
 template <class vecT> void write_points(int filenum, System<vecT> &system) {
-  auto vmag = calculate_velocity_mag(system);
-  std::ofstream outfile("velocity_magnitude." + std::to_string(filenum) + ".3D");
+  NBODY_TIMER("write_points");
+  const std::string filename = system.output_prefix + "velocity_magnitude." +
+                               std::to_string(filenum) + ".3D";
+#ifdef ENABLE_MPI
+  if (system.num_ranks > 1) {
+    write_points_collective(filename, system);
+    return;
+  }
+#endif
+  const auto &vmag = calculate_velocity_mag(system);
+  // lines in original particle order
+  std::vector<int> &slot = system.workspace.reorder.id_slot;
+  if (!system.sysId.empty()) {
+    slot.resize(system.sysId.size());
+    int const *idptr = system.sysId.data();
+    int *slotptr = slot.data();
+    const IndexRange sys_i = index_range(system.sysId.size());
+    std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                  std::end(sys_i), [=](int i) { slotptr[idptr[i]] = i; });
+  }
+  std::ofstream outfile(filename);
   outfile << std::setprecision(8);
   outfile << "x y z velocity\n";
   outfile << "#coordflag xyzm\n";
-  for (int i = 0; i < system.sysPos.size(); i++) {
+  for (std::size_t k = 0; k < system.sysPos.size(); k++) {
+    const std::size_t i = system.sysId.empty() ? k : slot[k];
     outfile << system.sysPos[i].x << " " << system.sysPos[i].y << " "
             << system.sysPos[i].z << " " << vmag[i] << "\n";
   }
+  NBODY_COUNT("bytes.write_points", uint64_t(outfile.tellp()));
+}
+
+template <class vecT> void write_points(int filenum, SystemSoA<vecT> &system) {
+  NBODY_TIMER("write_points");
+  const auto &vmag = calculate_velocity_mag(system);
+  std::ofstream outfile(system.output_prefix + "velocity_magnitude." +
+                        std::to_string(filenum) + ".3D");
+  outfile << std::setprecision(8);
+  outfile << "x y z velocity\n";
+  outfile << "#coordflag xyzm\n";
+  for (std::size_t i = 0; i < system.sysPos.size(); i++) {
+    outfile << system.sysPos.x[i] << " " << system.sysPos.y[i] << " "
+            << system.sysPos.z[i] << " " << vmag[i] << "\n";
+  }
+  NBODY_COUNT("bytes.write_points", uint64_t(outfile.tellp()));
 }
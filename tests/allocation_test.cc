@@ -0,0 +1,88 @@
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include "allocation_counter.hh"
+#include "check.hh"
+#include "system.hh"
+#include "vec.hh"
+
+// Allocation free time loop
+// kernel scratch lives in the system workspace, so once a first advance has
+// grown the buffers, further steps of every engine and integrator must not
+// allocate
+
+// heap allocations of 4 more steps after a first advance of 3 steps
+template <class SystemT> uint64_t steady_allocations(Config config) {
+  config.nbodies = 512;
+  config.seed = 5;
+  config.timestep = 1.0f;
+  config.end_time = 3.0f;
+  config.output = OutputFormat::none;
+  SystemT system;
+  system.setup(config);
+  system.advance();
+  system.end_time += 4 * config.timestep;
+  const uint64_t allocations = allocation_count();
+  system.advance();
+  return allocation_count() - allocations;
+}
+
+template <class SystemT> void check_steady(const std::string &name, const Config &config) {
+  const uint64_t allocations = steady_allocations<SystemT>(config);
+  std::cout << name << ": " << allocations << " allocations\n";
+  CHECK(allocations == 0);
+}
+
+int main() {
+  using System3f = System<Vec3<float>>;
+  const std::pair<const char *, ForceEngine> engines[] = {
+      {"direct", ForceEngine::direct}, {"tiled", ForceEngine::tiled},
+      {"simd", ForceEngine::simd},     {"symmetric", ForceEngine::symmetric},
+      {"bh", ForceEngine::barnes_hut}, {"fmm", ForceEngine::fmm},
+      {"pm", ForceEngine::pm},         {"p3m", ForceEngine::p3m}};
+  for (const auto &[name, engine] : engines) {
+    Config config;
+    config.engine = engine;
+    check_steady<System3f>(name, config);
+    // the mesh engines recompute all particles in every block substep
+    config.integrator = Integrator::block;
+    if (engine != ForceEngine::pm && engine != ForceEngine::p3m)
+      check_steady<System3f>(std::string(name) + " block", config);
+    config.integrator = Integrator::fused;
+    check_steady<System3f>(std::string(name) + " fused", config);
+  }
+
+  const std::pair<const char *, Precision> precisions[] = {
+      {"mixed", Precision::mixed}, {"kahan", Precision::kahan}};
+  for (const auto &[name, precision] : precisions) {
+    Config config;
+    config.precision = precision;
+    check_steady<System3f>(name, config);
+  }
+
+  const std::pair<const char *, Integrator> integrators[] = {
+      {"hermite", Integrator::hermite}, {"yoshida", Integrator::yoshida}};
+  for (const auto &[name, integrator] : integrators) {
+    Config config;
+    config.integrator = integrator;
+    check_steady<System3f>(name, config);
+  }
+
+  Config adaptive;
+  adaptive.timestep_control = TimestepControl::aarseth;
+  adaptive.min_timestep = 0.25f;
+  check_steady<System3f>("aarseth", adaptive);
+
+  Config sorted;
+  sorted.sort_curve = SortCurve::hilbert;
+  sorted.sort_interval = 2;
+  sorted.merge_radius = 1e-3f;
+  check_steady<System3f>("hilbert merge", sorted);
+
+  Config soa;
+  soa.layout = Layout::soa;
+  check_steady<SystemSoA<Vec3<float>>>("soa", soa);
+  soa.engine = ForceEngine::simd;
+  check_steady<SystemSoA<Vec3<float>>>("soa simd", soa);
+  return check_result();
+}
@@ -0,0 +1,22 @@
+
+#pragma once
+
+#include <iostream>
+
+// Minimal checks of the regression tests, a failed check prints its
+// expression and makes the test exit 1
+inline int check_failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cout << "FAILED: " << #cond << " (" << __FILE__ << ":" << __LINE__  \
+                << ")\n";                                                      \
+      check_failures++;                                                        \
+    }                                                                          \
+  } while (0)
+
+inline int check_result() {
+  std::cout << (check_failures ? "FAILED\n" : "PASSED\n");
+  return check_failures ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "check.hh"
+#include "system.hh"
+#include "vec.hh"
+
+// Conservation diagnostics of reordered runs
+// the direct kernel stores potentials in the force pass before an output,
+// a reorder after that pass has to carry them along with the particles
+
+// energy_error column of a diagnostics file
+std::vector<double> energy_errors(const std::string &filename) {
+  std::vector<double> errors;
+  std::ifstream file(filename);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::stringstream fields(line);
+    double step, time, kinetic, potential, energy, error;
+    fields >> step >> time >> kinetic >> potential >> energy >> error;
+    errors.push_back(error);
+  }
+  return errors;
+}
+
+std::vector<double> run(SortCurve curve, const std::string &prefix) {
+  Config config;
+  config.nbodies = 1024;
+  config.seed = 3;
+  config.timestep = 1.0f;
+  config.end_time = 100.0f;
+  config.output = OutputFormat::none;
+  config.diagnostics = true;
+  config.sort_curve = curve;
+  config.sort_interval = 10;
+  config.output_prefix = prefix;
+  System<Vec3<float>> system;
+  system.setup(config);
+  system.advance();
+  return energy_errors(prefix + "diagnostics.txt");
+}
+
+int main() {
+  const std::string dir =
+      (std::filesystem::temp_directory_path() / "nbody_diagnostics_test").string();
+  std::filesystem::create_directories(dir);
+  const std::vector<double> unsorted = run(SortCurve::none, dir + "/unsorted.");
+  const std::vector<double> morton = run(SortCurve::morton, dir + "/morton.");
+  const std::vector<double> hilbert = run(SortCurve::hilbert, dir + "/hilbert.");
+  std::filesystem::remove_all(dir);
+
+  // the orders only change the rounding of the force sums
+  CHECK(unsorted.size() == 6);
+  CHECK(morton.size() == unsorted.size());
+  CHECK(hilbert.size() == unsorted.size());
+  for (std::size_t k = 0; k < unsorted.size(); k++) {
+    CHECK(std::abs(unsorted[k]) < 1e-2);
+    CHECK(k < morton.size() && std::abs(morton[k] - unsorted[k]) < 1e-4);
+    CHECK(k < hilbert.size() && std::abs(hilbert[k] - unsorted[k]) < 1e-4);
+  }
+  return check_result();
+}
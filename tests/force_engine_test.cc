@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "check.hh"
+#include "system.hh"
+#include "vec.hh"
+
+// Force engines against the direct kernel
+// every engine computes the accelerations of a small seeded system, the
+// rms of the differences relative to the rms of accumulate_forces has to
+// stay below the tolerance of the engine, run as
+// force_engine_test <engine>
+
+using System3f = System<Vec3<float>>;
+
+// rms |a - ref| / rms |ref|
+double rms_error(const std::vector<Vec3<float>> &accel,
+                 const std::vector<Vec3<float>> &ref) {
+  double error = 0.0, norm = 0.0;
+  for (std::size_t i = 0; i < ref.size(); i++) {
+    error += dot_product(accel[i] - ref[i]);
+    norm += dot_product(ref[i]);
+  }
+  return std::sqrt(error / norm);
+}
+
+// 2048 unit masses uniform in a cube of edge 2000, seeded; the galaxy setup
+// would test little, its heavy centers dominate every acceleration with a
+// monopole all engines get exactly, and pure PM does not resolve them
+System3f make_system() {
+  Config config;
+  config.nbodies = 2048;
+  config.seed = 7;
+  config.timestep = 1.0f;
+  config.end_time = 1.0f;
+  config.output = OutputFormat::none;
+  System3f system;
+  system.setup(config);
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> uniform(-1000.0f, 1000.0f);
+  for (Vec3<float> &p : system.sysPos)
+    p = Vec3<float>(uniform(rng), uniform(rng), uniform(rng));
+  std::fill(std::begin(system.sysMss), std::end(system.sysMss), 1.0f);
+  return system;
+}
+
+// error of engine on the setup of make_system, after adjust(system)
+template <class Adjust>
+double engine_error(const std::string &name, ForceEngine engine, Adjust adjust) {
+  System3f system = make_system();
+  std::vector<Vec3<float>> ref(system.sysPos.size());
+  accumulate_forces(system, ref);
+  system.engine = engine;
+  adjust(system);
+  std::vector<Vec3<float>> accel(system.sysPos.size());
+  compute_forces(system, accel);
+  const double error = rms_error(accel, ref);
+  std::cout << name << ": rms error " << error << "\n";
+  return error;
+}
+
+double engine_error(const std::string &name, ForceEngine engine) {
+  return engine_error(name, engine, [](System3f &) {});
+}
+
+int main(int argc, char *argv[]) {
+  const std::string engine = argc > 1 ? argv[1] : "";
+  if (engine == "bh") {
+    // the error grows with the opening angle
+    const double coarse = engine_error("bh theta 0.7", ForceEngine::barnes_hut,
+                                       [](System3f &s) { s.theta = 0.7f; });
+    const double fine = engine_error("bh theta 0.3", ForceEngine::barnes_hut,
+                                     [](System3f &s) { s.theta = 0.3f; });
+    CHECK(coarse < 1e-2);
+    CHECK(fine < 1e-3);
+    CHECK(fine < coarse);
+  } else if (engine == "fmm") {
+    // the error falls with the order down to the rsqrt estimate of the
+    // direct kernel, about 1e-4 here
+    double previous = 1.0;
+    for (int order : {2, 4, 6}) {
+      const double error =
+          engine_error("fmm order " + std::to_string(order), ForceEngine::fmm,
+                       [=](System3f &s) { s.fmm_order = order; });
+      CHECK(error < previous);
+      previous = error;
+    }
+    CHECK(previous < 5e-4);
+  } else if (engine == "pm") {
+    // mesh forces are smoothed over a few cells, a finer mesh resolves more
+    // of the pairs of a random distribution
+    const double coarse = engine_error("pm grid 32", ForceEngine::pm,
+                                       [](System3f &s) { s.pm_grid = 32; });
+    const double fine = engine_error("pm grid 128", ForceEngine::pm,
+                                     [](System3f &s) { s.pm_grid = 128; });
+    CHECK(coarse < 0.5);
+    CHECK(fine < 0.8 * coarse);
+  } else if (engine == "p3m") {
+    // the short-range pairs restore the forces below the split scale
+    for (int grid : {32, 64})
+      CHECK(engine_error("p3m grid " + std::to_string(grid), ForceEngine::p3m,
+                         [=](System3f &s) { s.pm_grid = grid; }) < 2e-3);
+  } else if (engine == "simd") {
+    // every instruction set this CPU runs, they refine the rsqrt estimate
+    // that the direct kernel takes as is
+    for (int isa = int(SimdIsa::scalar); isa <= int(detect_simd_isa()); isa++)
+      CHECK(engine_error(std::string("simd ") + simd_isa_name(SimdIsa(isa)),
+                         ForceEngine::simd,
+                         [=](System3f &s) { s.simd_isa = SimdIsa(isa); }) < 1e-3);
+  } else if (engine == "symmetric") {
+    // the same pair terms summed in another order
+    CHECK(engine_error("symmetric", ForceEngine::symmetric) < 1e-5);
+  } else if (engine == "tiled") {
+    // tiles that divide N and ragged ones, the order of the sums changes
+    const std::pair<int, int> tiles[] = {{64, 512}, {100, 300}, {256, 2048}};
+    for (const auto &[tile_i, tile_j] : tiles)
+      CHECK(engine_error("tiled " + std::to_string(tile_i) + "x" +
+                             std::to_string(tile_j),
+                         ForceEngine::tiled, [=](System3f &s) {
+                           s.tile_i = tile_i;
+                           s.tile_j = tile_j;
+                         }) < 1e-5);
+  } else {
+    std::cout << "unknown engine " << engine << "\n";
+    CHECK(false);
+  }
+  return check_result();
+}
@@ -0,0 +1,79 @@
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include "check.hh"
+#include "system.hh"
+#include "vec.hh"
+
+// Checkpoint restart against a straight run
+// a run of 13 steps writes a checkpoint at step 8, a restart from it has to
+// write the snapshots after that step byte for byte like the straight run
+
+std::string read_file(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
+Config make_config(Integrator integrator, const std::string &prefix) {
+  Config config;
+  config.nbodies = 512;
+  config.seed = 5;
+  config.timestep = 1.0f;
+  config.end_time = 12.0f;
+  config.output = OutputFormat::binary;
+  config.output_interval = 2.0f;
+  config.integrator = integrator;
+  config.checkpoint_interval = 8;
+  config.output_prefix = prefix;
+  return config;
+}
+
+void round_trip(Integrator integrator, const std::string &name,
+                const std::string &dir) {
+  const std::string straight = dir + "/" + name + ".straight.";
+  const std::string restarted = dir + "/" + name + ".restarted.";
+  {
+    Config config = make_config(integrator, straight);
+    System<Vec3<float>> system;
+    system.setup(config);
+    system.advance();
+  }
+  {
+    Config config = make_config(integrator, restarted);
+    config.restart_file = straight + config.checkpoint_file;
+    System<Vec3<float>> system;
+    system.restart(config);
+    system.advance();
+  }
+  int compared = 0;
+  for (int filenum = 0;; filenum++) {
+    const std::string file = "snapshot." + std::to_string(filenum) + ".bin";
+    if (!std::filesystem::exists(straight + file))
+      break;
+    if (!std::filesystem::exists(restarted + file))
+      continue;
+    const std::string expected = read_file(straight + file);
+    const bool identical = !expected.empty() && expected == read_file(restarted + file);
+    std::cout << name << " " << file << (identical ? " identical\n" : " differs\n");
+    CHECK(identical);
+    compared++;
+  }
+  // snapshots at steps 10 and 12
+  CHECK(compared == 2);
+}
+
+int main() {
+  const std::string dir =
+      (std::filesystem::temp_directory_path() / "nbody_restart_test").string();
+  std::filesystem::create_directories(dir);
+  round_trip(Integrator::verlet, "verlet", dir);
+  round_trip(Integrator::block, "block", dir);
+  round_trip(Integrator::fused, "fused", dir);
+  round_trip(Integrator::hermite, "hermite", dir);
+  round_trip(Integrator::yoshida, "yoshida", dir);
+  std::filesystem::remove_all(dir);
+  return check_result();
+}
@@ -0,0 +1,52 @@
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+#include "check.hh"
+#include "system.hh"
+#include "vec.hh"
+
+// Initial conditions for any thread count
+// every particle draws from its own counter-based stream, so setup on one
+// thread and on several has to give the same bits; the arena holds the
+// threads even where the machine has fewer cores
+
+struct Setup {
+  std::vector<Vec3<float>> pos, vel;
+  std::vector<float> mss;
+};
+
+Setup setup_on(int threads) {
+  tbb::global_control limit(tbb::global_control::max_allowed_parallelism,
+                            threads);
+  tbb::task_arena arena(threads);
+  Config config;
+  config.nbodies = 3001; // not a multiple of any chunk size
+  config.seed = 11;
+  config.timestep = 1.0f;
+  config.end_time = 1.0f;
+  config.output = OutputFormat::none;
+  System<Vec3<float>> system;
+  arena.execute([&] { system.setup(config); });
+  return {system.sysPos, system.sysVel, system.sysMss};
+}
+
+template <class T>
+bool identical(const std::vector<T> &a, const std::vector<T> &b) {
+  return a.size() == b.size() &&
+         std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+int main() {
+  const Setup serial = setup_on(1);
+  CHECK(serial.pos.size() == 3001);
+  for (int threads : {2, 4, 8}) {
+    const Setup parallel = setup_on(threads);
+    std::cout << threads << " threads\n";
+    CHECK(identical(parallel.pos, serial.pos));
+    CHECK(identical(parallel.vel, serial.vel));
+    CHECK(identical(parallel.mss, serial.mss));
+  }
+  return check_result();
+}
@@ -8,6 +8,7 @@
 // Vel(t+dt) = Vel(t) + Acc(t+dt) * dt
 // Pos(t+dt) = Pos(t) + Vel(t+dt) * dt
 template <class vecT> void integrate_euler(System<vecT> &system);
+template <class vecT> void integrate_euler(SystemSoA<vecT> &system);
 
 // Velocity Verlet 4 step
 // Vel(t+dt/2) = Vel(t) + 0.5 * dt * Acc(t)
@@ -15,11 +16,55 @@ template <class vecT> void integrate_euler(System<vecT> &system);
 // Acc(t+dt) = f(Pos(t+dt))
 // Vel(t+dt) = Vel(t+dt/2) + 0.5 * dt * Acc(t+dt)
 template <class vecT> void integrate_verlet4(System<vecT> &system);
+template <class vecT> void integrate_verlet4(SystemSoA<vecT> &system);
+
+// Velocity Verlet, fused kick-drift-kick
+// same operations as integrate_verlet4 in two passes instead of four
+// Vel(t+dt/2) = Vel(t) + 0.5 * dt * Acc(t), Pos(t+dt) = Pos(t) + Vel(t+dt/2) * dt
+// Acc(t+dt) = f(Pos(t+dt)), Vel(t+dt) = Vel(t+dt/2) + 0.5 * dt * Acc(t+dt)
+// the closing kick is applied by the force kernel as it stores Acc(t+dt)
+template <class vecT> void integrate_fused(System<vecT> &system);
+template <class vecT> void integrate_fused(SystemSoA<vecT> &system);
+// fused kick-drift-kick with step dt instead of system.timestep
+template <class vecT> void integrate_fused(System<vecT> &system, float dt);
+template <class vecT> void integrate_fused(SystemSoA<vecT> &system, float dt);
+
+// 4th order symplectic composition of Yoshida / Forest-Ruth
+// three fused Verlet substeps of w1 * dt, w0 * dt and w1 * dt with
+// w1 = 1 / (2 - 2^(1/3)), w0 = 1 - 2 w1 < 0, three force passes per step
+template <class vecT> void integrate_yoshida(System<vecT> &system);
+template <class vecT> void integrate_yoshida(SystemSoA<vecT> &system);
 
 // Velocity Verlet 3 step
 // Pos(t+dt) = Pos(t) + Vel(t) * dt + 0.5 * dt * dt * Acc(t)
 // Acc(t+dt) = f(Pos(t+dt))
 // Vel(t+dt) = Vel(t) + 0.5 * dt * (Acc(t)+Acc(t+dt))
 template <class vecT> void integrate_verlet3(System<vecT> &system);
+template <class vecT> void integrate_verlet3(SystemSoA<vecT> &system);
+
+// Kick-drift-kick with hierarchical block time steps
+// particle i steps with dt_i = timestep / 2^level_i, level_i is the
+// smallest level with dt_i <= eta |a_i| / |j_i|, capped at block_levels,
+// j_i estimated from the accelerations at both ends of its last step and
+// kept in sysJerk
+// in each substep only the particles whose step ends are kicked with new
+// forces, all others drift, all particles are synchronized after timestep
+// returns the force targets of the step, the active particles summed over
+// the substeps
+template <class vecT> uint64_t integrate_block(System<vecT> &system);
+
+// 4th order Hermite predictor-corrector, direct forces
+// Pos_p = Pos(t) + Vel(t) dt + Acc(t) dt^2 / 2 + Jerk(t) dt^3 / 6
+// Vel_p = Vel(t) + Acc(t) dt + Jerk(t) dt^2 / 2
+// Acc(t+dt), Jerk(t+dt) = f(Pos_p, Vel_p), in one all-pairs pass
+// Vel(t+dt) = Vel(t) + (Acc(t) + Acc(t+dt)) dt / 2 + (Jerk(t) - Jerk(t+dt)) dt^2 / 12
+// Pos(t+dt) = Pos(t) + (Vel(t) + Vel(t+dt)) dt / 2 + (Acc(t) - Acc(t+dt)) dt^2 / 12
+// the jerks are kept in sysJerk for the next step, a step without valid
+// jerks first evaluates Acc(t) and Jerk(t)
+template <class vecT> void integrate_hermite(System<vecT> &system);
+
+// Advance system by one timestep with the integrator selected in system
+template <class vecT> void integrate(System<vecT> &system);
+template <class vecT> void integrate(SystemSoA<vecT> &system);
 
 #include "time_integration_impl.hh"
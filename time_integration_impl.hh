@@ -1,18 +1,49 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <execution>
+#include <functional>
+#include <numeric>
 #include <vector>
+#include "forces.hh"
+#include "instrumentation.hh"
 #include "physics.hh"
 
 // forward Euler
 template <class vecT> void integrate_euler(System<vecT> &system) {
   // Acc(t+dt) = f(Pos(t))
-  accumulate_forces(system, system.sysAcc);
+  {
+    NBODY_TIMER("forces");
+    compute_forces(system, system.sysAcc);
+  }
   // Vel(t+dt) = Vel(t) + Acc(t+dt) * dt
-  update_velocities(system, system.timestep);
+  {
+    NBODY_TIMER("kick");
+    update_velocities(system, system.timestep);
+  }
   // Pos(t+dt) = Pos(t) + Vel(t+dt) * dt
-  update_positions(system, system.timestep);
+  {
+    NBODY_TIMER("drift");
+    update_positions(system, system.timestep);
+  }
+}
+
+// forward Euler, SoA layout
+template <class vecT> void integrate_euler(SystemSoA<vecT> &system) {
+  {
+    NBODY_TIMER("forces");
+    compute_forces(system, system.sysAcc);
+  }
+  {
+    NBODY_TIMER("kick");
+    update_velocities(system, system.timestep);
+  }
+  {
+    NBODY_TIMER("drift");
+    update_positions(system, system.timestep);
+  }
 }
 
 // Velocity Verlet 4 step
@@ -20,13 +51,144 @@ template <class vecT> void integrate_verlet4(System<vecT> &system) {
   const float dt{static_cast<float>(system.timestep)};
   const float half_dt{dt / 2};
   // Vel(t+dt/2) = Vel(t) + 0.5 * dt * Acc(t)
-  update_velocities(system, half_dt);
+  {
+    NBODY_TIMER("kick");
+    update_velocities(system, half_dt);
+  }
   // Pos(t+dt) = Pos(t) + Vel(t+dt/2) * dt
-  update_positions(system, dt);
+  {
+    NBODY_TIMER("drift");
+    update_positions(system, dt);
+  }
   // Acc(t+dt) = f(Pos(t+dt))
-  accumulate_forces(system, system.sysAcc);
+  {
+    NBODY_TIMER("forces");
+    compute_forces(system, system.sysAcc);
+  }
   // Vel(t+dt) = Vel(t+dt/2) + 0.5 * dt * Acc(t+dt)
-  update_velocities(system, half_dt);
+  {
+    NBODY_TIMER("kick");
+    update_velocities(system, half_dt);
+  }
+}
+
+// Velocity Verlet 4 step, SoA layout
+template <class vecT> void integrate_verlet4(SystemSoA<vecT> &system) {
+  const float dt{static_cast<float>(system.timestep)};
+  const float half_dt{dt / 2};
+  {
+    NBODY_TIMER("kick");
+    update_velocities(system, half_dt);
+  }
+  {
+    NBODY_TIMER("drift");
+    update_positions(system, dt);
+  }
+  {
+    NBODY_TIMER("forces");
+    compute_forces(system, system.sysAcc);
+  }
+  {
+    NBODY_TIMER("kick");
+    update_velocities(system, half_dt);
+  }
+}
+
+// Velocity Verlet, fused kick-drift-kick
+template <class vecT> void integrate_fused(System<vecT> &system) {
+  integrate_fused(system, static_cast<float>(system.timestep));
+}
+
+template <class vecT> void integrate_fused(System<vecT> &system, float dt) {
+  const float half_dt{dt / 2};
+  const IndexRange sys_i = index_range(system.sysPos.size());
+
+  // Vel(t+dt/2) = Vel(t) + 0.5 * dt * Acc(t)
+  // Pos(t+dt) = Pos(t) + Vel(t+dt/2) * dt
+  {
+    NBODY_TIMER("kick_drift");
+    vecT *posptr = system.sysPos.data();
+    vecT *velptr = system.sysVel.data();
+    vecT const *accptr = system.sysAcc.data();
+    std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                  [=](int i) {
+                    velptr[i] += accptr[i] * half_dt;
+                    posptr[i] += velptr[i] * dt;
+                  });
+  }
+  // Acc(t+dt) = f(Pos(t+dt))
+  // Vel(t+dt) = Vel(t+dt/2) + 0.5 * dt * Acc(t+dt)
+  {
+    NBODY_TIMER("forces_kick");
+    compute_forces_kick(system, half_dt);
+  }
+}
+
+// Velocity Verlet, fused kick-drift-kick, SoA layout
+template <class vecT> void integrate_fused(SystemSoA<vecT> &system) {
+  integrate_fused(system, static_cast<float>(system.timestep));
+}
+
+template <class vecT> void integrate_fused(SystemSoA<vecT> &system, float dt) {
+  using T = typename vecT::value_type;
+  const float half_dt{dt / 2};
+  {
+    NBODY_TIMER("kick_drift");
+    T *xptr = system.sysPos.x.data();
+    T *yptr = system.sysPos.y.data();
+    T *zptr = system.sysPos.z.data();
+    T *vxptr = system.sysVel.x.data();
+    T *vyptr = system.sysVel.y.data();
+    T *vzptr = system.sysVel.z.data();
+    T const *axptr = system.sysAcc.x.data();
+    T const *ayptr = system.sysAcc.y.data();
+    T const *azptr = system.sysAcc.z.data();
+    const IndexRange sys_i = index_range(system.sysMss.size());
+    std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                  std::end(sys_i), [=](int i) {
+                    vxptr[i] += axptr[i] * half_dt;
+                    vyptr[i] += ayptr[i] * half_dt;
+                    vzptr[i] += azptr[i] * half_dt;
+                    xptr[i] += vxptr[i] * dt;
+                    yptr[i] += vyptr[i] * dt;
+                    zptr[i] += vzptr[i] * dt;
+                  });
+  }
+  {
+    NBODY_TIMER("forces_kick");
+    compute_forces_kick(system, half_dt);
+  }
+}
+
+namespace {
+// substep weights of the 4th order composition
+inline double yoshida_w1() { return 1.0 / (2.0 - std::cbrt(2.0)); }
+}
+
+// Yoshida / Forest-Ruth, the closing kick of each substep and the opening
+// kick of the next one are both applied, they do not commute with the
+// force pass in between. Setup leaves Acc(0) zero, which costs the Verlet
+// step a 2nd order error once, so the first step computes it
+template <class vecT> void integrate_yoshida(System<vecT> &system) {
+  const double w1 = yoshida_w1();
+  const double w0 = 1.0 - 2.0 * w1;
+  if (system.step == 0) {
+    NBODY_TIMER("forces");
+    compute_forces(system, system.sysAcc);
+  }
+  for (double w : {w1, w0, w1})
+    integrate_fused(system, static_cast<float>(w * system.timestep));
+}
+
+template <class vecT> void integrate_yoshida(SystemSoA<vecT> &system) {
+  const double w1 = yoshida_w1();
+  const double w0 = 1.0 - 2.0 * w1;
+  if (system.step == 0) {
+    NBODY_TIMER("forces");
+    compute_forces(system, system.sysAcc);
+  }
+  for (double w : {w1, w0, w1})
+    integrate_fused(system, static_cast<float>(w * system.timestep));
 }
 
 // Velocity Verlet 3 step
@@ -35,12 +197,11 @@ template <class vecT> void integrate_verlet3(System<vecT> &system) {
   const float half_dt{dt / 2};
   const float half_dtdt{dt * dt / 2};
   const int sys_size = system.sysPos.size();
-
-  std::vector<int> sys_i(sys_size, 0);
-  std::iota(std::begin(sys_i), std::end(sys_i), 0);
+  const IndexRange sys_i = index_range(sys_size);
 
   // Pos(t+dt) = Pos(t) + Vel(t) * dt + 0.5 * dt * dt * Acc(t)
   {
+    NBODY_TIMER("drift");
     vecT *posptr = system.sysPos.data();
     vecT const *velptr = system.sysVel.data();
     vecT const *accptr = system.sysAcc.data();
@@ -52,11 +213,16 @@ template <class vecT> void integrate_verlet3(System<vecT> &system) {
   }
 
   // Acc(t+dt) = f(Pos(t+dt))
-  std::vector<vecT> accel(sys_size, vecT());
-  { accumulate_forces(system, accel); }
+  std::vector<vecT> &accel = system.workspace.integrator.accel;
+  accel.resize(sys_size);
+  {
+    NBODY_TIMER("forces");
+    compute_forces(system, accel);
+  }
 
   // Vel(t+dt) = Vel(t) + (Acc(t) + Acc(t+dt)) * dt * 0.5
   {
+    NBODY_TIMER("kick");
     vecT *velptr = system.sysVel.data();
     vecT *accptr = system.sysAcc.data();
     vecT const *newacc = accel.data();
@@ -69,3 +235,292 @@ template <class vecT> void integrate_verlet3(System<vecT> &system) {
                   });
   }
 }
+
+// Velocity Verlet 3 step, SoA layout
+template <class vecT> void integrate_verlet3(SystemSoA<vecT> &system) {
+  using T = typename vecT::value_type;
+  const float dt{static_cast<float>(system.timestep)};
+  const float half_dt{dt / 2};
+  const float half_dtdt{dt * dt / 2};
+  const int sys_size = system.sysMss.size();
+
+  // Pos(t+dt) = Pos(t) + Vel(t) * dt + 0.5 * dt * dt * Acc(t)
+  {
+    NBODY_TIMER("drift");
+    T *xptr = system.sysPos.x.data();
+    T *yptr = system.sysPos.y.data();
+    T *zptr = system.sysPos.z.data();
+    T const *vxptr = system.sysVel.x.data();
+    T const *vyptr = system.sysVel.y.data();
+    T const *vzptr = system.sysVel.z.data();
+    T const *axptr = system.sysAcc.x.data();
+    T const *ayptr = system.sysAcc.y.data();
+    T const *azptr = system.sysAcc.z.data();
+    const IndexRange sys_i = index_range(system.sysMss.size());
+    std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                  std::end(sys_i), [=](int i) {
+                    xptr[i] += vxptr[i] * dt + axptr[i] * half_dtdt;
+                    yptr[i] += vyptr[i] * dt + ayptr[i] * half_dtdt;
+                    zptr[i] += vzptr[i] * dt + azptr[i] * half_dtdt;
+                  });
+  }
+
+  // Acc(t+dt) = f(Pos(t+dt))
+  Vec3SoA<T> &accel = system.workspace.integrator.accel_soa;
+  accel.resize(sys_size);
+  {
+    NBODY_TIMER("forces");
+    compute_forces(system, accel);
+  }
+
+  // Vel(t+dt) = Vel(t) + (Acc(t) + Acc(t+dt)) * dt * 0.5
+  {
+    NBODY_TIMER("kick");
+    T *vxptr = system.sysVel.x.data();
+    T *vyptr = system.sysVel.y.data();
+    T *vzptr = system.sysVel.z.data();
+    T *axptr = system.sysAcc.x.data();
+    T *ayptr = system.sysAcc.y.data();
+    T *azptr = system.sysAcc.z.data();
+    T const *nxptr = accel.x.data();
+    T const *nyptr = accel.y.data();
+    T const *nzptr = accel.z.data();
+    const IndexRange sys_i = index_range(system.sysMss.size());
+    std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                  std::end(sys_i), [=](int i) {
+                    vxptr[i] += (axptr[i] + nxptr[i]) * half_dt;
+                    vyptr[i] += (ayptr[i] + nyptr[i]) * half_dt;
+                    vzptr[i] += (azptr[i] + nzptr[i]) * half_dt;
+                    axptr[i] = nxptr[i];
+                    ayptr[i] = nyptr[i];
+                    azptr[i] = nzptr[i];
+                  });
+  }
+}
+
+namespace {
+// block level of a particle, smallest level with dt / 2^level <= eta |a| / |j|
+// (Aarseth), particles with a vanishing acceleration or jerk take level 0
+template <class vecT, typename T>
+inline int block_level(const vecT &acc, const vecT &jrk, T dt, T eta,
+                       int max_level) {
+  const T jrk_sq = dot_product(jrk);
+  if (jrk_sq <= T(0))
+    return 0;
+  const T dt_i = eta * std::sqrt(dot_product(acc) / jrk_sq);
+  if (!(dt_i > T(0)) || dt_i >= dt)
+    return 0;
+  return std::min(max_level, int(std::ceil(std::log2(dt / dt_i))));
+}
+}
+
+// Block time steps, kick-drift-kick
+// time inside the step is counted in ticks of timestep / 2^block_levels,
+// a particle on level l starts and ends its steps on multiples of
+// 2^(block_levels - l) ticks, the loop jumps from one step end to the next
+template <class vecT> uint64_t integrate_block(System<vecT> &system) {
+  using T = typename vecT::value_type;
+  const int max_level = system.block_levels;
+  const int num_ticks = 1 << max_level;
+  const T dt = system.timestep;
+  const T tick_dt = dt / num_ticks;
+  const T eta = system.block_eta;
+  const int sys_size = system.sysPos.size();
+
+  const IndexRange sys_i = index_range(sys_size);
+  std::vector<int> &level = system.workspace.integrator.level;
+  std::vector<int> &active = system.workspace.integrator.active;
+  std::vector<vecT> &accel = system.workspace.integrator.accel;
+  level.resize(sys_size);
+  active.resize(sys_size);
+  accel.resize(sys_size);
+
+  vecT *posptr = system.sysPos.data();
+  vecT *velptr = system.sysVel.data();
+  vecT *accptr = system.sysAcc.data();
+  vecT const *newptr = accel.data();
+  int *lvlptr = level.data();
+
+  // levels from the synchronized state, all particles start a step
+  // without the jerks of a previous step particles start on the finest
+  // level, and Acc(t) may not come from a force pass, so the first closing
+  // kick keeps them there
+  const bool have_jerks =
+      system.jerk_step == system.step && system.sysJerk.size() == std::size_t(sys_size);
+  system.sysJerk.resize(sys_size);
+  vecT *jrkptr = system.sysJerk.data();
+  std::transform(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                 std::begin(level), [=](int i) {
+                   return have_jerks
+                              ? block_level(accptr[i], jrkptr[i], dt, eta, max_level)
+                              : max_level;
+                 });
+
+  uint64_t targets = 0;
+  int tick = 0;
+  while (tick < num_ticks) {
+    // occupied levels, the next step end is on the finest of them
+    const int used = std::transform_reduce(
+        std::execution::par_unseq, std::begin(level), std::end(level), 0,
+        std::bit_or<int>(), [](int l) { return 1 << l; });
+    int next = num_ticks;
+    for (int l = 0; l <= max_level; l++)
+      if (used & (1 << l)) {
+        const int ticks = num_ticks >> l;
+        next = std::min(next, (tick / ticks + 1) * ticks);
+      }
+
+    // opening half kick of particles starting a step, drift all to next
+    {
+      NBODY_TIMER("kick_drift");
+      const int t = tick;
+      const T drift_dt = (next - tick) * tick_dt;
+      std::for_each(std::execution::par_unseq, std::begin(sys_i),
+                    std::end(sys_i), [=](int i) {
+                      const int ticks = num_ticks >> lvlptr[i];
+                      if (t % ticks == 0)
+                        velptr[i] += accptr[i] * (ticks * tick_dt / 2);
+                      posptr[i] += velptr[i] * drift_dt;
+                    });
+    }
+    tick = next;
+
+    // particles whose step ends at tick
+    auto active_end = std::copy_if(
+        std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+        std::begin(active), [=](int i) {
+          return tick % (num_ticks >> lvlptr[i]) == 0;
+        });
+    active.resize(active_end - std::begin(active));
+    targets += active.size();
+    {
+      NBODY_TIMER("forces");
+      compute_forces(system, accel, active);
+    }
+
+    // closing half kick with the new forces, the jerk is the difference
+    // of the accelerations at both ends of the step, then pick the next
+    // level; a particle may only move to a coarser level on a step boundary
+    // of it
+    {
+      NBODY_TIMER("kick");
+      const int t = tick;
+      const bool estimate = have_jerks || t > 1;
+      std::for_each(std::execution::par_unseq, std::begin(active),
+                    std::end(active), [=](int i) {
+                      const int ticks = num_ticks >> lvlptr[i];
+                      const T step_dt = ticks * tick_dt;
+                      velptr[i] += newptr[i] * (step_dt / 2);
+                      if (estimate)
+                        jrkptr[i] = (newptr[i] - accptr[i]) * (T(1) / step_dt);
+                      accptr[i] = newptr[i];
+                      if (!estimate)
+                        return;
+                      int l = block_level(accptr[i], jrkptr[i], dt, eta, max_level);
+                      while (l < lvlptr[i] && t % (num_ticks >> l) != 0)
+                        l++;
+                      lvlptr[i] = l;
+                    });
+    }
+    active.resize(sys_size);
+  }
+  system.jerk_step = system.step + 1;
+  return targets;
+}
+
+// Hermite predictor-corrector
+template <class vecT> void integrate_hermite(System<vecT> &system) {
+  using T = typename vecT::value_type;
+  const T dt = system.timestep;
+  const T dt2 = dt * dt;
+  const int sys_size = system.sysPos.size();
+  const IndexRange sys_i = index_range(sys_size);
+  // only counted in instrumented builds
+  [[maybe_unused]] const uint64_t interactions = uint64_t(sys_size) * sys_size;
+  auto &work = system.workspace.integrator;
+  work.pred_pos.resize(sys_size);
+  work.pred_vel.resize(sys_size);
+  work.pred_jerk.resize(sys_size);
+  work.accel.resize(sys_size);
+
+  // Acc(t), Jerk(t) after a start, a restart without jerks or another
+  // integrator
+  if (system.jerk_step != system.step || system.sysJerk.size() != std::size_t(sys_size)) {
+    NBODY_TIMER("forces_jerk");
+    NBODY_COUNT("force_targets", sys_size);
+    NBODY_COUNT("interactions", interactions);
+    system.sysJerk.resize(sys_size);
+    accumulate_forces_jerk(system, system.sysPos, system.sysVel, system.sysAcc,
+                           system.sysJerk);
+  }
+
+  vecT *posptr = system.sysPos.data();
+  vecT *velptr = system.sysVel.data();
+  vecT *accptr = system.sysAcc.data();
+  vecT *jrkptr = system.sysJerk.data();
+  vecT *ppptr = work.pred_pos.data();
+  vecT *pvptr = work.pred_vel.data();
+  vecT *newacc = work.accel.data();
+  vecT *newjrk = work.pred_jerk.data();
+
+  // Pos_p = Pos(t) + Vel(t) dt + Acc(t) dt^2 / 2 + Jerk(t) dt^3 / 6
+  // Vel_p = Vel(t) + Acc(t) dt + Jerk(t) dt^2 / 2
+  {
+    NBODY_TIMER("predict");
+    std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                  [=](int i) {
+                    ppptr[i] = posptr[i] +
+                               (velptr[i] + (accptr[i] + jrkptr[i] * (dt / 3)) *
+                                                (dt / 2)) * dt;
+                    pvptr[i] = velptr[i] +
+                               (accptr[i] + jrkptr[i] * (dt / 2)) * dt;
+                  });
+  }
+  // Acc(t+dt), Jerk(t+dt) = f(Pos_p, Vel_p)
+  {
+    NBODY_TIMER("forces_jerk");
+    NBODY_COUNT("force_targets", sys_size);
+    NBODY_COUNT("interactions", interactions);
+    accumulate_forces_jerk(system, work.pred_pos, work.pred_vel, work.accel,
+                           work.pred_jerk);
+  }
+  // Vel(t+dt) = Vel(t) + (Acc(t) + Acc(t+dt)) dt / 2 + (Jerk(t) - Jerk(t+dt)) dt^2 / 12
+  // Pos(t+dt) = Pos(t) + (Vel(t) + Vel(t+dt)) dt / 2 + (Acc(t) - Acc(t+dt)) dt^2 / 12
+  {
+    NBODY_TIMER("correct");
+    std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                  [=](int i) {
+                    const vecT vel = velptr[i];
+                    const vecT acc = accptr[i];
+                    velptr[i] += (acc + newacc[i]) * (dt / 2) +
+                                 (jrkptr[i] - newjrk[i]) * (dt2 / 12);
+                    posptr[i] += (vel + velptr[i]) * (dt / 2) +
+                                 (acc - newacc[i]) * (dt2 / 12);
+                    accptr[i] = newacc[i];
+                    jrkptr[i] = newjrk[i];
+                  });
+  }
+  system.jerk_step = system.step + 1;
+}
+
+template <class vecT> void integrate(System<vecT> &system) {
+  if (system.integrator == Integrator::block)
+    integrate_block(system);
+  else if (system.integrator == Integrator::fused)
+    integrate_fused(system);
+  else if (system.integrator == Integrator::hermite)
+    integrate_hermite(system);
+  else if (system.integrator == Integrator::yoshida)
+    integrate_yoshida(system);
+  else
+    integrate_verlet4(system);
+}
+
+template <class vecT> void integrate(SystemSoA<vecT> &system) {
+  if (system.integrator == Integrator::fused)
+    integrate_fused(system);
+  else if (system.integrator == Integrator::yoshida)
+    integrate_yoshida(system);
+  else
+    integrate_verlet4(system);
+}
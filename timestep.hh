@@ -0,0 +1,53 @@
+
+#pragma once
+
+// Adaptive global time step
+// every step takes the largest dt all particles allow, a parallel min
+// reduction of a per-particle criterion over the particles (and the MPI
+// ranks). The step stays in [min_timestep, max_timestep], grows by at most
+// timestep_growth from one step to the next and is shortened to land
+// exactly on the next output time and on end_time
+
+template <class vecT> struct System;
+template <class vecT> struct SystemSoA;
+
+// largest ratio of two consecutive adaptive steps
+static constexpr double timestep_growth = 2.0;
+
+// softening of the force kernels (r^2 + 1e-5), the smallest eps of the
+// acceleration criterion
+static constexpr double softening_length = 0.0031622776601683794;
+
+// eps of the acceleration criterion when timestep_length is 0, the mean
+// particle separation: the edge of the bounding cube over all ranks divided
+// by N^(1/3), at least softening_length. The kernels soften at a fixed
+// length far below the scale of the galaxy setups, an eps at that length
+// asks for steps many orders of magnitude shorter than the dynamics need
+template <class vecT> double resolution_length(const System<vecT> &system);
+template <class vecT> double resolution_length(const SystemSoA<vecT> &system);
+
+// smallest dt_i of system.timestep_control over all particles of all
+// ranks, infinity if no particle limits the step
+// the aarseth criterion takes the jerks of the last Hermite step, or the
+// estimate of estimate_jerks, and uses the acceleration criterion until
+// either is available
+template <class vecT> double criterion_timestep(System<vecT> &system);
+template <class vecT> double criterion_timestep(SystemSoA<vecT> &system);
+
+// bounded step from the criterion, growth limited by the current
+// system.timestep and shortened to at most limit (> 0)
+// a criterion below an explicit min_timestep is clamped to it with a
+// warning, below the default timestep / 2^20 the run stops with an error
+template <class SystemT> double next_timestep(SystemT &system, double limit);
+
+// jerks of integrators without them, finite differences of the
+// accelerations of consecutive steps
+// save_accelerations keeps Acc(t) before the step, estimate_jerks sets
+// sysJerk = (Acc(t+dt) - Acc(t)) / dt after it, valid for the next step;
+// SoA systems use the acceleration criterion and keep no jerks
+template <class vecT> void save_accelerations(System<vecT> &system);
+template <class vecT> void save_accelerations(SystemSoA<vecT> &system);
+template <class vecT> void estimate_jerks(System<vecT> &system, double dt);
+template <class vecT> void estimate_jerks(SystemSoA<vecT> &system, double dt);
+
+#include "timestep_impl.hh"
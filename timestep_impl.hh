@@ -0,0 +1,181 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <execution>
+#include <iostream>
+#include <limits>
+#include "collectives.hh"
+#include "instrumentation.hh"
+#include "system.hh"
+#include "timestep.hh"
+#include "workspace.hh"
+
+namespace {
+// no particle limits the step
+static constexpr double unlimited_timestep = std::numeric_limits<double>::max();
+
+// eta sqrt(eps / |a|) of the particle with the largest acceleration,
+// acc_sq(i) returns |a_i|^2
+template <class AccSq>
+double acceleration_timestep(int n, double eta, double eps, AccSq acc_sq) {
+  const IndexRange sys_i = index_range(n);
+  const double max_acc_sq = std::transform_reduce(
+      std::execution::par_unseq, std::begin(sys_i), std::end(sys_i), 0.0,
+      [](double a, double b) { return std::max(a, b); }, acc_sq);
+  if (max_acc_sq <= 0.0)
+    return unlimited_timestep;
+  return eta * std::sqrt(eps / std::sqrt(max_acc_sq));
+}
+
+// edge of the bounding cube of the n local particles over all ranks
+// divided by the cube root of num_bodies, pos_at(i) returns particle i
+template <class PosAt>
+double mean_separation(int n, int num_bodies, PosAt pos_at) {
+  struct Box {
+    double lo[3], hi[3];
+  };
+  static constexpr double inf = std::numeric_limits<double>::infinity();
+  const IndexRange sys_i = index_range(n);
+  Box box = std::transform_reduce(
+      std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+      Box{{inf, inf, inf}, {-inf, -inf, -inf}},
+      [](const Box &a, const Box &b) {
+        Box c;
+        for (int d = 0; d < 3; d++) {
+          c.lo[d] = std::min(a.lo[d], b.lo[d]);
+          c.hi[d] = std::max(a.hi[d], b.hi[d]);
+        }
+        return c;
+      },
+      [=](int i) {
+        const auto p = pos_at(i);
+        return Box{{double(p.x), double(p.y), double(p.z)},
+                   {double(p.x), double(p.y), double(p.z)}};
+      });
+  double size = 0.0;
+  for (int d = 0; d < 3; d++)
+    size = std::max(size, -distributed_min(-box.hi[d]) - distributed_min(box.lo[d]));
+  return num_bodies > 0 ? size / std::cbrt(double(num_bodies)) : 0.0;
+}
+
+template <class SystemT> double timestep_eps(const SystemT &system) {
+  return system.timestep_length > 0 ? double(system.timestep_length)
+                                    : resolution_length(system);
+}
+}
+
+template <class vecT> double resolution_length(const System<vecT> &system) {
+  vecT const *posptr = system.sysPos.data();
+  return std::max(softening_length,
+                  mean_separation(system.sysPos.size(), system.num_bodies,
+                                  [=](int i) { return posptr[i]; }));
+}
+
+template <class vecT> double resolution_length(const SystemSoA<vecT> &system) {
+  using T = typename vecT::value_type;
+  T const *xptr = system.sysPos.x.data();
+  T const *yptr = system.sysPos.y.data();
+  T const *zptr = system.sysPos.z.data();
+  return std::max(softening_length,
+                  mean_separation(system.sysMss.size(), system.num_bodies, [=](int i) {
+                    return vecT(xptr[i], yptr[i], zptr[i]);
+                  }));
+}
+
+template <class vecT> double criterion_timestep(System<vecT> &system) {
+  NBODY_TIMER("timestep");
+  const int sys_size = system.sysPos.size();
+  const double eta = system.timestep_eta;
+  vecT const *accptr = system.sysAcc.data();
+  double dt;
+  if (system.timestep_control == TimestepControl::aarseth &&
+      system.jerk_step == system.step && system.sysJerk.size() == std::size_t(sys_size)) {
+    // smallest |a|^2 / |j|^2
+    vecT const *jrkptr = system.sysJerk.data();
+    const IndexRange sys_i = index_range(sys_size);
+    const double ratio = std::transform_reduce(
+        std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+        unlimited_timestep, [](double a, double b) { return std::min(a, b); },
+        [=](int i) {
+          const double acc_sq = dot_product(accptr[i]);
+          const double jrk_sq = dot_product(jrkptr[i]);
+          return jrk_sq > 0.0 ? acc_sq / jrk_sq : unlimited_timestep;
+        });
+    dt = ratio < unlimited_timestep ? eta * std::sqrt(ratio) : unlimited_timestep;
+  } else {
+    dt = acceleration_timestep(sys_size, eta, timestep_eps(system),
+                               [=](int i) { return double(dot_product(accptr[i])); });
+  }
+  return distributed_min(dt);
+}
+
+template <class vecT> double criterion_timestep(SystemSoA<vecT> &system) {
+  NBODY_TIMER("timestep");
+  using T = typename vecT::value_type;
+  T const *axptr = system.sysAcc.x.data();
+  T const *ayptr = system.sysAcc.y.data();
+  T const *azptr = system.sysAcc.z.data();
+  return acceleration_timestep(
+      system.sysMss.size(), system.timestep_eta, timestep_eps(system), [=](int i) {
+        return double(axptr[i]) * axptr[i] + double(ayptr[i]) * ayptr[i] +
+               double(azptr[i]) * azptr[i];
+      });
+}
+
+template <class SystemT> double next_timestep(SystemT &system, double limit) {
+  const double max_dt = system.max_timestep;
+  const double min_dt = system.min_timestep > 0 ? double(system.min_timestep)
+                                                : max_dt / (1 << 20);
+  double dt = std::min({criterion_timestep(system), max_dt,
+                        timestep_growth * system.timestep});
+  if (dt < min_dt) {
+    if (system.min_timestep <= 0) {
+      std::cout << "ERROR: the time step criterion asks for " << dt
+                << ", below the smallest step " << min_dt << ", set "
+                << (system.timestep_control == TimestepControl::acceleration
+                        ? "a larger --timestep-length or "
+                        : "")
+                << "--min-timestep to clamp it, exiting.\n";
+      exit(1);
+    }
+    if (!system.timestep_clamped)
+      std::cout << "WARNING: the time step criterion asks for " << dt
+                << ", below the smallest step " << min_dt << "\n";
+    system.timestep_clamped = true;
+    dt = min_dt;
+  }
+  // land on limit in two equal steps rather than leave a sliver before it
+  if (dt >= limit)
+    return limit;
+  if (dt > limit / 2)
+    return limit / 2;
+  return dt;
+}
+
+template <class vecT> void save_accelerations(System<vecT> &system) {
+  std::vector<vecT> &prev_acc = system.workspace.integrator.prev_acc;
+  prev_acc.resize(system.sysAcc.size());
+  std::copy(std::execution::par_unseq, std::begin(system.sysAcc),
+            std::end(system.sysAcc), std::begin(prev_acc));
+}
+
+template <class vecT> void estimate_jerks(System<vecT> &system, double dt) {
+  using T = typename vecT::value_type;
+  NBODY_TIMER("timestep");
+  const int sys_size = system.sysAcc.size();
+  const IndexRange sys_i = index_range(sys_size);
+  const T inv_dt = T(1.0 / dt);
+  system.sysJerk.resize(sys_size);
+  vecT const *accptr = system.sysAcc.data();
+  vecT const *prevptr = system.workspace.integrator.prev_acc.data();
+  vecT *jrkptr = system.sysJerk.data();
+  std::for_each(std::execution::par_unseq, std::begin(sys_i), std::end(sys_i),
+                [=](int i) { jrkptr[i] = (accptr[i] - prevptr[i]) * inv_dt; });
+  system.jerk_step = system.step;
+}
+
+template <class vecT> void save_accelerations(SystemSoA<vecT> &) {}
+
+template <class vecT> void estimate_jerks(SystemSoA<vecT> &, double) {}
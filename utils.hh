@@ -1,9 +1,19 @@
 
 #pragma once
 
+#include <cstdint>
 #include "system.hh"
+#include <string>
 #include <vector>
 
+// Seed the particle generators, the same seed gives the same initial
+// conditions on any number of threads
+inline void seed_rng(uint64_t seed);
+
+// Serialize / restore the state of the particle generator RNG
+inline std::string get_rng_state();
+inline void set_rng_state(const std::string &state);
+
 // Generate disc of particles
 template <class vecT, typename T>
 std::vector<vecT> generate_frisbee(int n_bodies, T rad);
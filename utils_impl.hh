@@ -3,93 +3,128 @@
 
 #include <algorithm>
 #include <execution>
-#include <random>
+#include <sstream>
 #include "math_functions.hh"
+#include "random.hh"
 #include "utils.hh"
+#include "workspace.hh"
 
-// global namepsace for RNGs and PI
+// global namepsace for the RNG state and PI
 namespace {
-std::random_device rd;
-std::mt19937 rg(rd());
-std::uniform_real_distribution<float> dist(-1.f, 1.f);
-std::lognormal_distribution<float> lgdist(0.0f, 1.0f);
+// seed of the run and stream of the next generator call
+uint64_t rng_seed{0};
+uint32_t rng_stream{0};
 static constexpr float PI = 3.14159265358979323846f;
 }; // namespace
 
+inline void seed_rng(uint64_t seed) {
+  rng_seed = seed;
+  rng_stream = 0;
+}
+
+// every generator call draws from its own stream, the calls run in a fixed
+// order so the streams do not depend on the thread count
+inline CounterRng next_rng() { return CounterRng{rng_seed, rng_stream++}; }
+
+inline std::string get_rng_state() {
+  std::ostringstream out;
+  out << rng_seed << " " << rng_stream;
+  return out.str();
+}
+
+inline void set_rng_state(const std::string &state) {
+  std::istringstream in(state);
+  in >> rng_seed >> rng_stream;
+}
 
 // Generate disc of particles
 template <class vecT, typename T>
 std::vector<vecT> generate_frisbee(int n_bodies, T rad) {
-  auto randomGenerator = [=]() {
+  const CounterRng rng = next_rng();
+  auto randomGenerator = [=](int i) {
+    const PhiloxBlock r = rng.block(i);
     vecT p;
-    const T theta = PI * 2 * dist(rg);
-    const T radius = dist(rg) * rad;
+    const T theta = PI * 2 * uniform_pm1(r[0]);
+    const T radius = uniform_pm1(r[1]) * rad;
     p.x = cos(theta) * radius;
     p.y = sin(theta) * radius;
-    p.z = dist(rg) * rad / 10.f;
+    p.z = uniform_pm1(r[2]) * rad / 10.f;
     return p;
   };
   std::vector<vecT> particles(n_bodies, vecT());
-  std::generate(particles.begin(), particles.end(), randomGenerator);
+  const IndexRange body_i = index_range(n_bodies);
+  std::transform(std::execution::par_unseq, std::begin(body_i),
+                 std::end(body_i), std::begin(particles), randomGenerator);
   return particles;
 }
 
 
 template <class vecT, typename T>
 std::vector<vecT> generate_ring(int n_bodies, T rad) {
-  auto randomGenerator = [=]() {
+  const CounterRng rng = next_rng();
+  auto randomGenerator = [=](int i) {
+    const PhiloxBlock r = rng.block(i);
     vecT p;
-    const T theta = PI * 2 * dist(rg);
-    const T radius = rad + dist(rg) * rad / 20.f;
+    const T theta = PI * 2 * uniform_pm1(r[0]);
+    const T radius = rad + uniform_pm1(r[1]) * rad / 20.f;
     p.x = cos(theta) * radius;
     p.y = sin(theta) * radius;
-    p.z = dist(rg) * rad / 100.f;
+    p.z = uniform_pm1(r[2]) * rad / 100.f;
     return p;
   };
   std::vector<vecT> particles(n_bodies, vecT());
-  std::generate(particles.begin(), particles.end(), randomGenerator);
+  const IndexRange body_i = index_range(n_bodies);
+  std::transform(std::execution::par_unseq, std::begin(body_i),
+                 std::end(body_i), std::begin(particles), randomGenerator);
   return particles;
 }
 
 
 template <class vecT, typename T>
 std::vector<vecT> generate_sphere(int n_bodies, T rad) {
-  auto randomGenerator = [=]() {
+  const CounterRng rng = next_rng();
+  auto randomGenerator = [=](int i) {
+    const PhiloxBlock r = rng.block(i);
     vecT p;
-    const T theta = PI * 2 * dist(rg);
-    const T phi = PI * dist(rg);
-    const T radius = dist(rg) * rad;
+    const T theta = PI * 2 * uniform_pm1(r[0]);
+    const T phi = PI * uniform_pm1(r[1]);
+    const T radius = uniform_pm1(r[2]) * rad;
     p.x = sin(theta) * cos(phi) * radius;
     p.y = sin(theta) * sin(phi) * radius;
     p.z = cos(theta) * radius;
     return p;
   };
   std::vector<vecT> particles(n_bodies, vecT());
-  std::generate(particles.begin(), particles.end(), randomGenerator);
+  const IndexRange body_i = index_range(n_bodies);
+  std::transform(std::execution::par_unseq, std::begin(body_i),
+                 std::end(body_i), std::begin(particles), randomGenerator);
   return particles;
 }
 
 
 template <class vecT, typename T>
 std::vector<vecT> generate_hollow_sphere(int n_bodies, T rad) {
-  auto randomGenerator = [=]() {
+  const CounterRng rng = next_rng();
+  auto randomGenerator = [=](int i) {
+    const PhiloxBlock r = rng.block(i);
     vecT p;
-    const T theta = PI * 2 * dist(rg);
-    const T phi = PI * dist(rg);
-    const T radius = rad + dist(rg) * rad / 100.f;
+    const T theta = PI * 2 * uniform_pm1(r[0]);
+    const T phi = PI * uniform_pm1(r[1]);
+    const T radius = rad + uniform_pm1(r[2]) * rad / 100.f;
     p.x = sin(theta) * cos(phi) * radius;
     p.y = sin(theta) * sin(phi) * radius;
     p.z = cos(theta) * radius;
     return p;
   };
   std::vector<vecT> particles(n_bodies, vecT());
-  std::generate(particles.begin(), particles.end(), randomGenerator);
+  const IndexRange body_i = index_range(n_bodies);
+  std::transform(std::execution::par_unseq, std::begin(body_i),
+                 std::end(body_i), std::begin(particles), randomGenerator);
   return particles;
 }
 
 
 template <class vecT> std::vector<vecT> generate_two_sphere(int n_bodies) {
-  using T = typename vecT::value_type;
   const vecT com1(30000.0f, 0.0f, 0.0f);
   const vecT com2(-30000.0f, 0.0f, 0.0f);
   const int half = n_bodies / 2;
@@ -121,12 +156,17 @@ std::vector<vecT> generate_concentric_rings(int n_bodies) {
 
 
 template <typename T> std::vector<T> generate_random_mass(int n_bodies, T max_mass) {
-  auto randomGenerator = [=]() {
-    T mass = 1.0f + lgdist(rg) * max_mass;
+  // lognormal(0, 1) from a standard normal
+  const CounterRng rng = next_rng();
+  auto randomGenerator = [=](int i) {
+    const PhiloxBlock r = rng.block(i);
+    T mass = 1.0f + std::exp(normal(r[0], r[1])) * max_mass;
     return mass;
   };
   std::vector<T> mass(n_bodies, 0.0f);
-  std::generate(mass.begin(), mass.end(), randomGenerator);
+  const IndexRange body_i = index_range(n_bodies);
+  std::transform(std::execution::par_unseq, std::begin(body_i),
+                 std::end(body_i), std::begin(mass), randomGenerator);
   return mass;
 }
 
@@ -187,14 +227,14 @@ template <class vecT> void rotating_4(System<vecT> &system) {
   const vecT center4(-400000.0f, 400000.0f, 0.0f);
 
   // add "galaxies" to system
-  add_galaxy_to_system(system, center1, quad, 1.e10f);
-  add_galaxy_to_system(system, center2, quad, 1.e10f);
-  add_galaxy_to_system(system, center3, quad, 1.e10f);
-  add_galaxy_to_system(system, center4, last_quad, 1.e10f);
+  add_galaxy_to_system(system, center1, quad, system.galaxy_mass);
+  add_galaxy_to_system(system, center2, quad, system.galaxy_mass);
+  add_galaxy_to_system(system, center3, quad, system.galaxy_mass);
+  add_galaxy_to_system(system, center4, last_quad, system.galaxy_mass);
 
   // calculate orbital velocity of system about global 0,0,0 coordinate
   // add it to system velocity
-  std::vector<vecT> orb_vel = orbital_velocity(system.sysPos, 1e13f);
+  std::vector<vecT> orb_vel = orbital_velocity(system.sysPos, system.central_mass);
   std::transform(std::execution::par_unseq,
                 orb_vel.begin(), orb_vel.end(),
                 system.sysVel.begin(), system.sysVel.begin(),
@@ -203,7 +243,7 @@ template <class vecT> void rotating_4(System<vecT> &system) {
   // set last position to center of system
   system.sysPos[system.num_bodies-1] = {0.f, 0.f, 0.f};
   system.sysVel[system.num_bodies-1] = {0.f, 0.f, 0.f};
-  system.sysMss[system.num_bodies-1] = 1.e13f;
+  system.sysMss[system.num_bodies-1] = system.central_mass;
 }
 
 
@@ -213,21 +253,25 @@ template <class vecT> void rotating_n(System<vecT> &system) {
   const int num_galaxies = 64;
   const int group = system.num_bodies / num_galaxies;
   const int last_group = system.num_bodies - group * (num_galaxies-1);
-  auto randomGenerator = [=]() {
+  const CounterRng rng = next_rng();
+  auto randomGenerator = [=](int i) {
+    const PhiloxBlock r = rng.block(i);
     vecT p;
     const T rad = 10000000.0f;
-    const T theta = PI * 2 * dist(rg);
-    const T radius = dist(rg) * rad;
+    const T theta = PI * 2 * uniform_pm1(r[0]);
+    const T radius = uniform_pm1(r[1]) * rad;
     p.x = cos(theta) * radius;
     p.y = sin(theta) * radius;
-    p.z = dist(rg) * rad / 10.f;
+    p.z = uniform_pm1(r[2]) * rad / 10.f;
     return p;
   };
 
   // create symmetry about center
   // first assign half of the galaxies randomly
   std::vector<vecT> center(num_galaxies, vecT());
-  std::generate(center.begin(), center.begin()+num_galaxies/2, randomGenerator);
+  const IndexRange half_i = index_range(num_galaxies / 2);
+  std::transform(std::begin(half_i), std::end(half_i), std::begin(center),
+                 randomGenerator);
   // then blance with the other half of the galaxies
   // for each randomly placed galaxy, assign a galaxy with opposite coordinates
   for (int i = 0; i < num_galaxies/2; i++)
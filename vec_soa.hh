@@ -0,0 +1,53 @@
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// cache line size used to align particle arrays
+static constexpr std::size_t cache_line_size = 64;
+
+// allocator that aligns every allocation to a cache line
+template <typename T> struct CacheAlignedAllocator {
+  using value_type = T;
+
+  CacheAlignedAllocator() = default;
+  template <typename U> CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+  T *allocate(std::size_t n);
+  void deallocate(T *p, std::size_t n);
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &);
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &);
+
+template <typename T>
+using aligned_vector = std::vector<T, CacheAlignedAllocator<T>>;
+
+// structure of arrays counterpart of Vec3
+// stores x, y, z in separate cache line aligned arrays, no padding
+template <typename T> class Vec3SoA {
+public:
+  using value_type = T;
+
+  aligned_vector<T> x;
+  aligned_vector<T> y;
+  aligned_vector<T> z;
+
+  // constructors
+  Vec3SoA();
+  Vec3SoA(std::size_t n);
+  template <class vecT> Vec3SoA(const std::vector<vecT> &aos);
+
+  std::size_t size() const;
+  void resize(std::size_t n);
+
+  // gather / scatter element i as a Vec3
+  template <class vecT> vecT get(std::size_t i) const;
+  template <class vecT> void set(std::size_t i, const vecT &v);
+};
+
+#include "vec_soa_impl.hh"
@@ -0,0 +1,58 @@
+
+#pragma once
+
+#include "vec_soa.hh"
+
+template <typename T> T *CacheAlignedAllocator<T>::allocate(std::size_t n) {
+  return static_cast<T *>(
+      ::operator new(n * sizeof(T), std::align_val_t(cache_line_size)));
+}
+
+template <typename T>
+void CacheAlignedAllocator<T>::deallocate(T *p, std::size_t) {
+  ::operator delete(p, std::align_val_t(cache_line_size));
+}
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) {
+  return false;
+}
+
+template <typename T> Vec3SoA<T>::Vec3SoA() {}
+
+template <typename T>
+Vec3SoA<T>::Vec3SoA(std::size_t n) : x(n, T(0.0)), y(n, T(0.0)), z(n, T(0.0)) {}
+
+template <typename T>
+template <class vecT>
+Vec3SoA<T>::Vec3SoA(const std::vector<vecT> &aos) : Vec3SoA(aos.size()) {
+  for (std::size_t i = 0; i < aos.size(); i++)
+    set(i, aos[i]);
+}
+
+template <typename T> std::size_t Vec3SoA<T>::size() const { return x.size(); }
+
+template <typename T> void Vec3SoA<T>::resize(std::size_t n) {
+  x.resize(n, T(0.0));
+  y.resize(n, T(0.0));
+  z.resize(n, T(0.0));
+}
+
+template <typename T>
+template <class vecT>
+vecT Vec3SoA<T>::get(std::size_t i) const {
+  return vecT(x[i], y[i], z[i]);
+}
+
+template <typename T>
+template <class vecT>
+void Vec3SoA<T>::set(std::size_t i, const vecT &v) {
+  x[i] = v.x;
+  y[i] = v.y;
+  z[i] = v.z;
+}
@@ -0,0 +1,117 @@
+
+#pragma once
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+#include "vec_soa.hh"
+
+// Random access iterator over consecutive indices, dereferences to the index
+// itself so parallel loops over particles need no materialized iota vector
+class IndexIterator {
+public:
+  using iterator_category = std::random_access_iterator_tag;
+  using value_type = int;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const int *;
+  using reference = int;
+
+  IndexIterator() = default;
+  explicit IndexIterator(int i) : i(i) {}
+
+  int operator*() const { return i; }
+  int operator[](difference_type n) const { return i + int(n); }
+  IndexIterator &operator++();
+  IndexIterator operator++(int);
+  IndexIterator &operator--();
+  IndexIterator operator--(int);
+  IndexIterator &operator+=(difference_type n);
+  IndexIterator &operator-=(difference_type n);
+  friend IndexIterator operator+(IndexIterator it, difference_type n) {
+    return it += n;
+  }
+  friend IndexIterator operator+(difference_type n, IndexIterator it) {
+    return it += n;
+  }
+  friend IndexIterator operator-(IndexIterator it, difference_type n) {
+    return it -= n;
+  }
+  friend difference_type operator-(IndexIterator a, IndexIterator b) {
+    return a.i - b.i;
+  }
+  friend bool operator==(IndexIterator a, IndexIterator b) { return a.i == b.i; }
+  friend auto operator<=>(IndexIterator a, IndexIterator b) { return a.i <=> b.i; }
+
+private:
+  int i{0};
+};
+
+// Indices [first, last) for the parallel algorithms
+struct IndexRange {
+  int first{0};
+  int last{0};
+  IndexIterator begin() const { return IndexIterator(first); }
+  IndexIterator end() const { return IndexIterator(last); }
+};
+
+// Indices 0..n-1
+IndexRange index_range(int n);
+// Indices first..last-1
+IndexRange index_range(int first, int last);
+
+// Scratch buffers of the subsystems, declared next to their kernels
+template <class vecT> struct BHTree;         // barnes_hut.hh
+template <class vecT> struct FmmBuffers;     // fmm.hh
+template <class vecT> struct PMMesh;         // particle_mesh.hh
+template <class vecT> struct SimdBuffers;    // simd_kernels.hh
+template <class vecT> struct ReorderBuffers; // reorder.hh
+template <class vecT> struct MergeBuffers;   // merging.hh
+template <class vecT> struct RingBuffers;    // distributed.hh
+template <class vecT> struct NumaReplicas;   // numa.hh
+
+// Second acceleration buffers and per-particle state of the integrators
+template <class vecT> struct IntegratorBuffers {
+  using T = typename vecT::value_type;
+  std::vector<vecT> accel;     // second acceleration buffer, AoS
+  Vec3SoA<T> accel_soa;        // second acceleration buffer, SoA
+  std::vector<int> level;      // block time step level of each particle
+  std::vector<int> active;     // particles kicked in a block substep
+  std::vector<vecT> pred_pos;  // Hermite predicted positions,
+  std::vector<vecT> pred_vel;  // velocities
+  std::vector<vecT> pred_jerk; // and jerks at the predicted state
+  std::vector<vecT> prev_acc;  // accelerations before the step, jerk estimate
+};
+
+// Buffers of the output cadence: snapshots, checkpoints and diagnostics
+template <class vecT> struct OutputBuffers {
+  using T = typename vecT::value_type;
+  std::vector<T> velocity_mag; // output of calculate_velocity_mag
+  std::vector<vecT> momentum;  // output of calculate_momentum
+  std::vector<T> potential;    // potential of each particle, diagnostics
+  std::vector<T> pack_pos;     // packed x, y, z for snapshots and
+  std::vector<T> pack_vel;     // checkpoints
+  std::vector<T> pack_acc;
+  std::vector<T> pack_mss;     // masses of the SoA layout
+  std::vector<T> pack_jerk;    // Hermite jerks for checkpoints
+};
+
+// Reusable scratch buffers of a system, one member per subsystem
+// kernels resize the buffers they use, which only allocates when the
+// particle count grows, so after the first step with a given N the time loop
+// runs without heap allocations
+template <class vecT> struct Workspace {
+  IntegratorBuffers<vecT> integrator;
+  OutputBuffers<vecT> output;
+  SimdBuffers<vecT> simd;       // SoA copies of the AoS sources
+  BHTree<vecT> tree;            // Barnes-Hut and FMM octree
+  FmmBuffers<vecT> fmm;         // expansions
+  PMMesh<vecT> mesh;            // particle-mesh grids
+  ReorderBuffers<vecT> reorder; // space-filling curve sort
+  MergeBuffers<vecT> merge;     // close pair search
+  RingBuffers<vecT> ring;       // MPI ring blocks
+  NumaReplicas<vecT> numa;      // per NUMA node sources
+};
+
+#include "workspace_impl.hh"
@@ -0,0 +1,42 @@
+
+#pragma once
+
+#include "workspace.hh"
+
+inline IndexIterator &IndexIterator::operator++() {
+  ++i;
+  return *this;
+}
+
+inline IndexIterator IndexIterator::operator++(int) {
+  IndexIterator it = *this;
+  ++i;
+  return it;
+}
+
+inline IndexIterator &IndexIterator::operator--() {
+  --i;
+  return *this;
+}
+
+inline IndexIterator IndexIterator::operator--(int) {
+  IndexIterator it = *this;
+  --i;
+  return it;
+}
+
+inline IndexIterator &IndexIterator::operator+=(difference_type n) {
+  i += int(n);
+  return *this;
+}
+
+inline IndexIterator &IndexIterator::operator-=(difference_type n) {
+  i -= int(n);
+  return *this;
+}
+
+inline IndexRange index_range(int n) { return IndexRange{0, n}; }
+
+inline IndexRange index_range(int first, int last) {
+  return IndexRange{first, last};
+}